@@ -1,104 +1,665 @@
 ﻿#pragma once
 
-#define WIN32_LEAN_AND_MEAN 
-#include "Windows.h"
-#include "WinSock2.h"
-#include <ws2tcpip.h>
+#include "common/socket_compat.hpp"
+#include "common/bytes_buffer.hpp"
+#include "common/bytes_stream.hpp"
+#include "common/frame_header.hpp"
+#include "common/lz_codec.hpp"
+#include "common/shm_transport.hpp"
+//#include "utf8_setup.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <iostream>
-#pragma comment(lib, "ws2_32.lib")
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
 
-#include "common/utf8_system_category.hpp"
-//#include "utf8_setup.hpp"
+class TopoDS_Shape;
 
-class WSAContext {
+// 默认是同步发送：sendBrepData在调用线程里把整帧发完再返回，出错时返回false，不会退出进程
+// withAsyncSender之后改为异步发送：快照只放进有界队列，由后台线程负责连接、重连和发送，调用线程不会被网络卡住
+// sendShape把形状直接序列化进池里复用的缓冲区，帧头和负载用一次vectored write发出，预热之后每次发送不再分配内存
+class Client {
 public:
-    WSAContext() {
-        WSADATA wsa_data;
-        if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
-            auto ec = std::error_code(WSAGetLastError(), utf8_system_category());
-            std::cerr << ec.message();
-            throw std::system_error(ec, "WSAStartup");
-        }
+    // 连接服务端的方式，后连的覆盖先连的
+    enum class Transport {
+        Tcp,
+        UnixSocket,   // 同机，AF_UNIX流式连接，帧格式和TCP一样
+        SharedMemory, // 同机，只在Linux上有
+    };
+
+    // 异步队列满了之后怎么处理新来的快照
+    enum class OverflowPolicy {
+        DropOldest, // 丢掉队列里最旧的一个，保证最新的状态能发出去
+        DropNewest, // 丢掉这次的快照
+        Block,      // 等队列有空位，调用线程会被阻塞
+    };
+
+    struct Stats {
+        uint64_t queued = 0;  // 进入发送队列(同步模式下是尝试发送)的快照数
+        uint64_t sent = 0;    // 完整发出去的快照数
+        uint64_t dropped = 0; // 因为队列满或者Client析构被丢掉的快照数
+        uint64_t failed = 0;  // 连接或发送失败的快照数
+    };
+
+    // 出错时的回调，异步模式下在发送线程里调用；默认打印到std::cerr
+    using ErrorHandler = std::function<void(std::error_code, const std::string&)>;
+
+    Client() {
+        buffer_pool.reserve(2);
     }
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
 
-    
-    ~WSAContext() {
-        WSACleanup();
+    ~Client() {
+        if (sender_thread.joinable()) {
+            // 连着服务端时给积压的快照一点时间发完，连不上就不等了
+            if (isConnected()) {
+                flush(std::chrono::seconds(1));
+            }
+            stopSender();
+        }
+        closeSocket();
     }
-};
 
-class Client {
-public:
+    // 同步模式下立即连接，失败时通过ErrorHandler报告；异步模式下只记下地址，由发送线程去连接，连不上会定期重试
     Client& connectServer(std::string server_ip, int server_port) {
-        // 创建套接字
-        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock == INVALID_SOCKET) {
-            std::cerr << "Failed to create socket. Error: " << WSAGetLastError() << std::endl;
-            WSACleanup();
-            exit(EXIT_FAILURE);
+        {
+            std::lock_guard lck(mtx);
+            this->server_ip = std::move(server_ip);
+            this->server_port = server_port;
+            transport = Transport::Tcp;
+        }
+        if (!async) {
+            connectNow();
+        }
+        return *this;
+    }
+
+    // 服务端在同一台机器上时改走共享内存(服务端要调用withSharedMemory(name))：大负载写进共享内存段，
+    // 服务端直接映射使用，不经过TCP协议栈；只在Linux上有，其它平台上连接会失败
+    Client& connectSharedMemory(std::string name) {
+        {
+            std::lock_guard lck(mtx);
+            local_name = std::move(name);
+            transport = Transport::SharedMemory;
+        }
+        if (!async) {
+            connectNow();
+        }
+        return *this;
+    }
+
+    // 服务端在同一台机器上时连它的AF_UNIX监听路径(服务端要调用withUnixSocket(path))，不占端口，也不经过TCP协议栈；
+    // Windows上不支持，连接会失败
+    Client& connectUnixSocket(std::string path) {
+        {
+            std::lock_guard lck(mtx);
+            local_name = std::move(path);
+            transport = Transport::UnixSocket;
+        }
+        if (!async) {
+            connectNow();
+        }
+        return *this;
+    }
+
+    // 连接服务端最多等多久，默认3秒；异步模式下Client析构时正在进行的连接也会马上放弃
+    Client& withConnectTimeout(std::chrono::milliseconds timeout) {
+        std::lock_guard lck(mtx);
+        connect_timeout = timeout;
+        return *this;
+    }
+
+    // 负载不小于这个字节数时先压缩再发送，SIZE_MAX表示从不压缩；只对TCP连接生效
+    Client& withCompressionThreshold(size_t bytes) {
+        compression_threshold = bytes;
+        return *this;
+    }
+
+    Client& withErrorHandler(ErrorHandler handler) {
+        std::lock_guard lck(mtx);
+        on_error = std::move(handler);
+        return *this;
+    }
+
+    // 开启异步发送，capacity是队列里最多积压的快照数，只在队列为空时才能改
+    Client& withAsyncSender(size_t capacity = 8, OverflowPolicy policy = OverflowPolicy::DropOldest) {
+        std::lock_guard lck(mtx);
+        overflow_policy = policy;
+        if (queue_size == 0) {
+            queue.clear();
+            queue.resize(capacity > 0 ? capacity : 1);
+            queue_head = 0;
+            buffer_pool.reserve(queue.size() + 2);
+        }
+        if (!async) {
+            async = true;
+            stopping = false;
+            sender_thread = std::thread([this] { senderLoop(); });
+        }
+        return *this;
+    }
+
+    // 序列化形状并发送，定义在文件后面，要用到OCCT的头文件
+    // 同步模式下返回是否发送成功；异步模式下返回快照是否进了队列
+    bool sendShape(const TopoDS_Shape& shape, payload_encoding encoding = payload_encoding::brep_binary);
+
+    // 同步模式下返回是否发送成功；异步模式下返回快照是否进了队列
+    bool sendBrepData(const std::string& brepData, payload_encoding encoding = payload_encoding::brep_text) {
+        bytes_const_view payload{ brepData.data(), brepData.size() };
+        if (!async) {
+            return sendNow(payload, encoding);
+        }
+        // 拷进池里的缓冲区，不用每次新分配一个string
+        Snapshot snapshot;
+        snapshot.buffer = acquireBuffer();
+        if (snapshot.buffer.size() < payload.size()) {
+            snapshot.buffer.resize(payload.size());
+        }
+        std::memcpy(snapshot.buffer.data(), payload.data(), payload.size());
+        snapshot.size = payload.size();
+        snapshot.encoding = encoding;
+        return enqueue(std::move(snapshot));
+    }
+
+    // 右值版本：异步模式下直接移动进队列，不用拷贝负载
+    bool sendBrepData(std::string&& brepData, payload_encoding encoding = payload_encoding::brep_text) {
+        if (!async) {
+            return sendNow(bytes_const_view{ brepData.data(), brepData.size() }, encoding);
+        }
+        Snapshot snapshot;
+        snapshot.text = std::move(brepData);
+        snapshot.encoding = encoding;
+        return enqueue(std::move(snapshot));
+    }
+
+    // 等队列里的快照全部发完，超时返回false；同步模式下总是返回true
+    bool flush(std::chrono::milliseconds timeout) {
+        std::unique_lock lck(mtx);
+        return idle_cv.wait_for(lck, timeout, [this] { return queue_size == 0 && !in_flight; });
+    }
+
+    Stats stats() const {
+        Stats s;
+        s.queued = queued_count.load(std::memory_order_relaxed);
+        s.sent = sent_count.load(std::memory_order_relaxed);
+        s.dropped = dropped_count.load(std::memory_order_relaxed);
+        s.failed = failed_count.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    std::error_code lastError() const {
+        std::lock_guard lck(mtx);
+        return last_error;
+    }
+
+    bool isConnected() const {
+        std::lock_guard lck(mtx);
+        return self_fd != INVALID_SOCKET;
+    }
+
+private:
+    // 队列里的一个快照：负载在池里的缓冲区里，或者是sendBrepData(std::string&&)移动进来的字符串
+    struct Snapshot {
+        bytes_buffer buffer;
+        size_t size = 0;
+        std::string text;
+        payload_encoding encoding = payload_encoding::brep_text;
+
+        bytes_const_view payload() const noexcept {
+            if (!text.empty()) {
+                return bytes_const_view{ text.data(), text.size() };
+            }
+            return bytes_const_view{ buffer.data(), size };
+        }
+    };
+
+    // 从池里拿一个缓冲区，容量保留着上次用过的大小
+    bytes_buffer acquireBuffer() {
+        std::lock_guard lck(mtx);
+        if (buffer_pool.empty()) {
+            return bytes_buffer();
+        }
+        bytes_buffer buffer = std::move(buffer_pool.back());
+        buffer_pool.pop_back();
+        return buffer;
+    }
+
+    void releaseBuffer(bytes_buffer&& buffer) {
+        if (buffer.m_data.capacity() == 0) {
+            return;
+        }
+        std::lock_guard lck(mtx);
+        if (buffer_pool.size() < buffer_pool.capacity()) {
+            buffer_pool.push_back(std::move(buffer));
+        }
+    }
+
+    bool enqueue(Snapshot&& snapshot) {
+        Snapshot evicted; // 被挤掉的快照在锁外面还回池里
+        bool has_evicted = false;
+        bool accepted = true;
+        {
+            std::unique_lock lck(mtx);
+            if (queue_size == queue.size()) {
+                switch (overflow_policy) {
+                case OverflowPolicy::DropNewest:
+                    accepted = false;
+                    break;
+                case OverflowPolicy::DropOldest:
+                    evicted = std::move(queue[queue_head]);
+                    has_evicted = true;
+                    queue_head = (queue_head + 1) % queue.size();
+                    --queue_size;
+                    break;
+                case OverflowPolicy::Block:
+                    not_full_cv.wait(lck, [this] { return queue_size < queue.size() || stopping; });
+                    accepted = !stopping;
+                    break;
+                }
+            }
+            if (accepted) {
+                queue[(queue_head + queue_size) % queue.size()] = std::move(snapshot);
+                ++queue_size;
+                queued_count.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        if (!accepted) {
+            dropped_count.fetch_add(1, std::memory_order_relaxed);
+            releaseBuffer(std::move(snapshot.buffer));
+            return false;
+        }
+        if (has_evicted) {
+            dropped_count.fetch_add(1, std::memory_order_relaxed);
+            releaseBuffer(std::move(evicted.buffer));
+        }
+        queue_cv.notify_one();
+        return true;
+    }
+
+    void senderLoop() {
+        auto retry_delay = std::chrono::milliseconds(100);
+        std::unique_lock lck(mtx);
+        while (true) {
+            queue_cv.wait(lck, [this] { return stopping || queue_size > 0; });
+            if (stopping) {
+                break;
+            }
+
+            if (self_fd == INVALID_SOCKET) {
+                lck.unlock();
+                bool connected = connectNow();
+                lck.lock();
+                if (!connected) {
+                    // 服务端没开或者连不上：快照留在队列里按溢出策略处理，等一会儿再重连
+                    queue_cv.wait_for(lck, retry_delay, [this] { return stopping; });
+                    retry_delay = std::min<std::chrono::milliseconds>(retry_delay * 2, std::chrono::seconds(5));
+                    continue;
+                }
+                retry_delay = std::chrono::milliseconds(100);
+            }
+
+            Snapshot snapshot = std::move(queue[queue_head]);
+            queue_head = (queue_head + 1) % queue.size();
+            --queue_size;
+            in_flight = true;
+            not_full_cv.notify_one();
+            lck.unlock();
+
+            sendNow(snapshot.payload(), snapshot.encoding);
+            releaseBuffer(std::move(snapshot.buffer));
+            snapshot.text = std::string();
+
+            lck.lock();
+            in_flight = false;
+            if (queue_size == 0) {
+                idle_cv.notify_all();
+            }
+        }
+
+        // 析构时还没发出去的快照算作丢弃
+        dropped_count.fetch_add(queue_size, std::memory_order_relaxed);
+        for (; queue_size > 0; --queue_size) {
+            queue[queue_head] = Snapshot{};
+            queue_head = (queue_head + 1) % queue.size();
+        }
+        in_flight = false;
+        idle_cv.notify_all();
+    }
+
+    void stopSender() {
+        {
+            std::lock_guard lck(mtx);
+            stopping = true;
+            // 卡在send里(服务端不读数据)时关掉发送方向，让send立刻返回
+            if (in_flight && self_fd != INVALID_SOCKET) {
+#if defined(_WIN32)
+                shutdown(self_fd, SD_BOTH);
+#else
+                shutdown(self_fd, SHUT_RDWR);
+#endif
+            }
+        }
+        queue_cv.notify_all();
+        not_full_cv.notify_all();
+        sender_thread.join();
+    }
+
+    // 服务端不响应(比如SYN被丢掉)时connect会卡很久，这里最多等connect_timeout，停止发送线程时也提前放弃
+    int connectSocket(SOCKET sock, sockaddr const* addr, socklen_t addr_len) {
+        std::chrono::milliseconds timeout;
+        {
+            std::lock_guard lck(mtx);
+            timeout = connect_timeout;
+        }
+        return connect_with_timeout(sock, addr, addr_len, timeout, [this] {
+            std::lock_guard lck(mtx);
+            return stopping;
+        });
+    }
+
+    bool connectNow() {
+        std::string ip;
+        int port = 0;
+        Transport kind = Transport::Tcp;
+        std::string local;
+        {
+            std::lock_guard lck(mtx);
+            if (self_fd != INVALID_SOCKET) {
+                return true;
+            }
+            ip = server_ip;
+            port = server_port;
+            kind = transport;
+            local = local_name;
+        }
+        if (kind == Transport::SharedMemory) {
+            return connectSharedMemoryNow(local);
+        }
+        if (kind == Transport::UnixSocket) {
+            return connectUnixSocketNow(local);
+        }
+        if (ip.empty()) {
+            reportError(std::error_code(), "connectServer has not been called");
+            return false;
         }
 
         // 设置服务器地址
-        sockaddr_in serverAddr;
+        sockaddr_in serverAddr{};
         serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(server_port);
-        inet_pton(AF_INET, server_ip.c_str(), &serverAddr.sin_addr);
+        serverAddr.sin_port = htons(static_cast<uint16_t>(port));
+        if (inet_pton(AF_INET, ip.c_str(), &serverAddr.sin_addr) != 1) {
+            reportError(std::error_code(), "Invalid server address " + ip);
+            return false;
+        }
+
+        // 创建套接字
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) {
+            reportError(std::error_code(last_socket_error(), utf8_system_category()), "Failed to create socket");
+            return false;
+        }
 
         // 连接到服务端
-        if (connect(sock, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-            std::cerr << "Connection failed. Error: " << WSAGetLastError() << std::endl;
+        if (int err = connectSocket(sock, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)); err != 0) {
+            auto ec = std::error_code(err, utf8_system_category());
             closesocket(sock);
-            WSACleanup();
-            exit(EXIT_FAILURE);
+            reportError(ec, "Connection failed");
+            return false;
         }
 
+        set_no_delay(sock); // 帧头和负载一次发出，不需要Nagle攒包，关掉它避免和延迟ACK叠在一起卡几十毫秒
+
+        std::lock_guard lck(mtx);
         self_fd = sock;
-        return *this;
+        return true;
     }
 
-    void sendBrepData(const std::string& brepData) {
-        // 发送数据长度（先转换为网络字节序）
-        int32_t dataLength = htonl(brepData.size());
-        int sentBytes = send(self_fd, reinterpret_cast<const char*>(&dataLength), sizeof(dataLength), 0);
-        if (sentBytes == SOCKET_ERROR) {
-            std::cerr << "Failed to send data length. Error: " << WSAGetLastError() << std::endl;
-            closesocket(self_fd);
-            WSACleanup();
-            exit(EXIT_FAILURE);
+    bool connectUnixSocketNow(const std::string& path) {
+#if !defined(_WIN32)
+        sockaddr_un addr;
+        socklen_t addr_len = make_unix_address(path, addr);
+        if (addr_len == 0) {
+            reportError(std::make_error_code(std::errc::filename_too_long), "Invalid unix socket path " + path);
+            return false;
+        }
+        SOCKET sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) {
+            reportError(std::error_code(last_socket_error(), utf8_system_category()), "Failed to create socket");
+            return false;
+        }
+        if (int err = connectSocket(sock, reinterpret_cast<sockaddr*>(&addr), addr_len); err != 0) {
+            auto ec = std::error_code(err, utf8_system_category());
+            closesocket(sock);
+            reportError(ec, "Unix socket connection failed");
+            return false;
         }
+        // 没有Nagle算法，不用设置TCP_NODELAY
+        std::lock_guard lck(mtx);
+        self_fd = sock;
+        return true;
+#else
+        reportError(std::make_error_code(std::errc::not_supported), "Unix socket transport is not available on this platform, " + path);
+        return false;
+#endif
+    }
 
-        // 发送实际的 BRep 数据
-        sentBytes = send(self_fd, brepData.c_str(), brepData.size(), 0);
-        if (sentBytes == SOCKET_ERROR) {
-            std::cerr << "Failed to send data. Error: " << WSAGetLastError() << std::endl;
-            closesocket(self_fd);
-            WSACleanup();
-            exit(EXIT_FAILURE);
+    bool connectSharedMemoryNow(const std::string& name) {
+#if defined(__linux__)
+        sockaddr_un addr;
+        socklen_t addr_len = shm_transport::make_address(name, addr);
+        SOCKET sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (sock == INVALID_SOCKET) {
+            reportError(std::error_code(last_socket_error(), utf8_system_category()), "Failed to create socket");
+            return false;
         }
+        if (int err = connectSocket(sock, reinterpret_cast<sockaddr*>(&addr), addr_len); err != 0) {
+            auto ec = std::error_code(err, utf8_system_category());
+            closesocket(sock);
+            reportError(ec, "Shared memory connection failed");
+            return false;
+        }
+        std::lock_guard lck(mtx);
+        self_fd = sock;
+        return true;
+#else
+        reportError(std::make_error_code(std::errc::not_supported), "Shared memory transport is not available on this platform, " + name);
+        return false;
+#endif
+    }
+
+    bool sendNow(bytes_const_view payload, payload_encoding encoding) {
+        if (!async) {
+            queued_count.fetch_add(1, std::memory_order_relaxed);
+        }
+        // 同步模式下上次出错断开后，这里重新连一次
+        if (!connectNow()) {
+            failed_count.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        // 帧头（负载编码和长度，网络字节序）
+        frame_header header;
+        header.m_encoding = encoding;
+        Transport kind = currentTransport();
+
+#if defined(__linux__)
+        // 共享内存不经过网络，压缩只会白白花时间
+        if (kind == Transport::SharedMemory) {
+            header.m_payload_size = payload.size();
+            if (!shm_transport::send_frame(self_fd, header, payload)) {
+                reportError(std::error_code(errno, utf8_system_category()), "Failed to send BRep data");
+                closeSocket();
+                failed_count.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            sent_count.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+#endif
 
-        std::cout << "BRep data sent successfully." << std::endl;
+        // 大负载压缩一下，压不小就还是发原始数据；压缩结果放在复用的缓冲区里
+        // 本机的unix socket只是内存拷贝，压缩省不下时间
+        bytes_const_view body = payload;
+        if (payload.size() >= compression_threshold && kind == Transport::Tcp) {
+            if (lz_table.empty()) {
+                lz_table.resize(lz::HASH_TABLE_SIZE, 0);
+            }
+            size_t packed = lz::compress_stream(payload, compressed, lz_table.data());
+            if (packed < payload.size()) {
+                header.m_flags |= frame_flag_compressed;
+                body = bytes_const_view{ compressed.data(), packed };
+            }
+        }
+        header.m_payload_size = body.size();
+        char headerBytes[frame_header::SIZE];
+        header.encode(headerBytes);
+
+        // 帧头和实际的 BRep 数据一起发；中途出错时这个连接上的帧已经对不齐了，只能断开重连
+        if (!sendAll(bytes_const_view{ headerBytes, sizeof(headerBytes) }, body)) {
+            reportError(std::error_code(last_socket_error(), utf8_system_category()), "Failed to send BRep data");
+            closeSocket();
+            failed_count.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        sent_count.fetch_add(1, std::memory_order_relaxed);
+        return true;
     }
 
-    ~Client() {
-        closesocket(self_fd);
+    // 帧头和负载一次vectored write发出；可能只发出一部分，循环直到全部发完
+    bool sendAll(bytes_const_view header, bytes_const_view body) {
+        bytes_const_view parts[2] = { header, body };
+        size_t first = 0;
+        while (first < 2) {
+            long long sent = send_vectored(self_fd, parts + first, 2 - first);
+            if (sent <= 0) {
+                return false;
+            }
+            size_t n = static_cast<size_t>(sent);
+            while (first < 2 && n >= parts[first].size()) {
+                n -= parts[first].size();
+                ++first;
+            }
+            if (first < 2) {
+                parts[first] = parts[first].subspan(n);
+            }
+        }
+        return true;
     }
 
-private:
-    WSAContext wsa;
-    SOCKET self_fd;
+    Transport currentTransport() const {
+        std::lock_guard lck(mtx);
+        return transport;
+    }
+
+    void closeSocket() {
+        std::lock_guard lck(mtx);
+        if (self_fd != INVALID_SOCKET) {
+            closesocket(self_fd);
+            self_fd = INVALID_SOCKET;
+        }
+    }
+
+    void reportError(std::error_code ec, const std::string& what) {
+        ErrorHandler handler;
+        {
+            std::lock_guard lck(mtx);
+            last_error = ec;
+            handler = on_error;
+        }
+        if (handler) {
+            handler(ec, what);
+        }
+        else {
+            std::cerr << what << ". Error: " << ec.value() << " " << ec.message() << std::endl;
+        }
+    }
+
+    socket_context net;
+    SOCKET self_fd = INVALID_SOCKET;
+    size_t compression_threshold = 64 * 1024;
+    bytes_buffer compressed;             // 压缩结果，只在发送的线程里用
+    std::vector<uint32_t> lz_table;
+    std::string server_ip;
+    int server_port = 0;
+    Transport transport = Transport::Tcp;
+    std::string local_name; // 共享内存的名字或者unix socket的路径
+    std::chrono::milliseconds connect_timeout = std::chrono::seconds(3);
+
+    mutable std::mutex mtx;
+    ErrorHandler on_error;
+    std::error_code last_error;
+
+    // 异步发送
+    bool async = false;
+    bool stopping = false;
+    bool in_flight = false;
+    OverflowPolicy overflow_policy = OverflowPolicy::DropOldest;
+    std::vector<Snapshot> queue; // 固定容量的环形队列
+    size_t queue_head = 0;
+    size_t queue_size = 0;
+    std::vector<bytes_buffer> buffer_pool; // 发送完的缓冲区放回这里，最多保留队列容量+2个
+    std::condition_variable queue_cv;
+    std::condition_variable not_full_cv;
+    std::condition_variable idle_cv;
+    std::thread sender_thread;
+
+    std::atomic<uint64_t> queued_count = 0;
+    std::atomic<uint64_t> sent_count = 0;
+    std::atomic<uint64_t> dropped_count = 0;
+    std::atomic<uint64_t> failed_count = 0;
 };
 
 #include <BRepTools.hxx>
+#include <BinTools.hxx>
 #include <sstream>
 #include <string>
 
-// 将 TopoDS_Shape 转换为 BRep 格式的字符串
-std::string shapeToBRep(const TopoDS_Shape& shape) {
+// 将 TopoDS_Shape 按指定编码写入输出流，二进制格式比文本格式小得多，服务端解析也快得多
+inline void writeShape(const TopoDS_Shape& shape, payload_encoding encoding, std::ostream& os) {
+    if (encoding == payload_encoding::brep_binary) {
+        BinTools::Write(shape, os);
+    }
+    else {
+        BRepTools::Write(shape, os);  // 将形状写入到输出流
+    }
+}
+
+// 将 TopoDS_Shape 转换为 BRep 格式的字符串；直接发送时用Client::sendShape更省，不用经过string
+std::string shapeToBRep(const TopoDS_Shape& shape, payload_encoding encoding = payload_encoding::brep_text) {
     std::ostringstream oss;
-    BRepTools::Write(shape, oss);  // 将形状写入到输出流
+    writeShape(shape, encoding, oss);
     return oss.str();  // 返回BRep格式的字符串
 }
 
+// 直接序列化进池里的缓冲区，不经过ostringstream，也不拷出一个string
+inline bool Client::sendShape(const TopoDS_Shape& shape, payload_encoding encoding) {
+    Snapshot snapshot;
+    snapshot.buffer = acquireBuffer();
+    snapshot.encoding = encoding;
+    {
+        bytes_ostream os(snapshot.buffer);
+        writeShape(shape, encoding, os);
+        snapshot.size = os.view().size();
+    }
+    if (!async) {
+        bool ok = sendNow(snapshot.payload(), encoding);
+        releaseBuffer(std::move(snapshot.buffer));
+        return ok;
+    }
+    return enqueue(std::move(snapshot));
+}
+
 #include <BRepBuilderAPI_MakeEdge.hxx>
 #include <BRepBuilderAPI_MakeWire.hxx>
 #include <BRepPrimAPI_MakeBox.hxx>
@@ -1,9 +1,11 @@
 ﻿#pragma once
 
+#include <algorithm>
 #include <deque>
 #include <mutex>
 #include <condition_variable>
 #include <iterator>
+#include <optional>
 #include <type_traits>
 
 template <typename T>
@@ -72,6 +74,24 @@ public:
 		return ret;
 	}
 
+	std::optional<T> try_pop() {
+		std::unique_lock lck(m_mtx);
+		if (m_arr.empty())
+			return std::nullopt;
+		T ret = std::move(m_arr.front());
+		m_arr.pop_front();
+		return ret;
+	}
+
+	// 最多取max个放进out，返回取到的个数，空时返回0
+	size_t pop_many(T* out, size_t max) {
+		std::unique_lock lck(m_mtx);
+		size_t n = m_arr.size() < max ? m_arr.size() : max;
+		std::move(m_arr.begin(), m_arr.begin() + n, out);
+		m_arr.erase(m_arr.begin(), m_arr.begin() + n);
+		return n;
+	}
+
 	auto pop_hold() {
 		std::unique_lock lck(m_mtx);
 		m_cv.wait(lck, [this] {return !m_arr.empty(); });
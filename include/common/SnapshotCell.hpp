@@ -0,0 +1,74 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+// 发布不可变快照的单元：写的一方整体替换一个shared_ptr<const T>，读的一方拿到引用计数的共享指针，不拷贝快照本身
+// 用Left-Right的做法：指针存两份，读的一方只在一个读者计数上加一减一、拷一次指针，没有循环也不加锁(wait-free)；
+// 写的一方先改不在读的那份，切换过去，再等旧的那份上的读者走完才改它，写之间用互斥锁串行
+template <typename T>
+class SnapshotCell {
+public:
+	using Ptr = std::shared_ptr<const T>;
+
+	SnapshotCell() : SnapshotCell(std::make_shared<const T>()) {}
+
+	explicit SnapshotCell(Ptr initial) {
+		m_slots[0] = initial;
+		m_slots[1] = std::move(initial);
+	}
+
+	SnapshotCell(SnapshotCell const&) = delete;
+	SnapshotCell& operator=(SnapshotCell const&) = delete;
+
+	Ptr load() const {
+		int version = m_version_index.load();
+		m_readers[version].m_count.fetch_add(1);
+		Ptr snapshot = m_slots[m_slot_index.load()];
+		m_readers[version].m_count.fetch_sub(1);
+		return snapshot;
+	}
+
+	// 被替换下来的快照在锁外释放，大快照的析构不挡住下一次发布
+	void store(Ptr snapshot) {
+		Ptr retired;
+		{
+			std::unique_lock lck(m_write_mtx);
+			int active = m_slot_index.load();
+			m_slots[1 - active] = snapshot;
+			m_slot_index.store(1 - active);
+
+			int version = m_version_index.load();
+			drain(1 - version);
+			m_version_index.store(1 - version);
+			drain(version);
+
+			retired = std::exchange(m_slots[active], std::move(snapshot));
+		}
+	}
+
+	void store(T value) {
+		store(std::make_shared<const T>(std::move(value)));
+	}
+
+private:
+	struct alignas(64) ReaderCount {
+		std::atomic<int64_t> m_count = 0;
+	};
+
+	// 只有写的一方等，读者的临界区只有一次指针拷贝
+	void drain(int version) {
+		while (m_readers[version].m_count.load() != 0)
+			std::this_thread::yield();
+	}
+
+	Ptr m_slots[2];
+	std::atomic<int> m_slot_index = 0;
+	std::atomic<int> m_version_index = 0;
+	mutable ReaderCount m_readers[2];
+	std::mutex m_write_mtx;
+};
@@ -0,0 +1,158 @@
+﻿#pragma once
+
+#include "common/bytes_buffer.hpp"
+
+#include <climits>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <streambuf>
+
+// 直接在一段已有的内存上读的streambuf，给BRepTools::Read/BinTools::Read用，不用先拷进istringstream
+class bytes_istreambuf : public std::streambuf {
+public:
+    explicit bytes_istreambuf(bytes_const_view bytes) {
+        char* begin = const_cast<char*>(bytes.data());
+        setg(begin, begin, begin + bytes.size());
+    }
+
+protected:
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        if (!(which & std::ios_base::in))
+            return pos_type(off_type(-1));
+        off_type base = 0;
+        if (dir == std::ios_base::cur)
+            base = gptr() - eback();
+        else if (dir == std::ios_base::end)
+            base = egptr() - eback();
+        return seekpos(pos_type(base + off), which);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        off_type off = off_type(pos);
+        if (!(which & std::ios_base::in) || off < 0 || off > egptr() - eback())
+            return pos_type(off_type(-1));
+        setg(eback(), eback() + off, egptr());
+        return pos;
+    }
+};
+
+class bytes_istream : public std::istream {
+public:
+    explicit bytes_istream(bytes_const_view bytes) : std::istream(nullptr), m_buf(bytes) {
+        rdbuf(&m_buf);
+    }
+
+private:
+    bytes_istreambuf m_buf;
+};
+
+// 写进一个bytes_buffer的streambuf，给BRepTools::Write/BinTools::Write用，不用经过ostringstream再拷出来
+// 缓冲区只增不减，reset之后从头写，同一个缓冲区反复使用时预热之后不再分配内存
+class bytes_ostreambuf : public std::streambuf {
+public:
+    static constexpr size_t MIN_GROWTH = 64 * 1024;
+
+    explicit bytes_ostreambuf(bytes_buffer& buffer) : m_buffer(buffer) {
+        reset();
+    }
+
+    void reset() {
+        // 已经分配好的容量全部用作写入区，resize到容量以内不会分配
+        m_buffer.resize(m_buffer.m_data.capacity());
+        setp(m_buffer.data(), m_buffer.data() + m_buffer.size());
+        m_high = 0;
+    }
+
+    // 已经写入的数据
+    bytes_const_view view() const noexcept {
+        return bytes_const_view{ pbase(), written() };
+    }
+
+    size_t written() const noexcept {
+        size_t pos = static_cast<size_t>(pptr() - pbase());
+        return pos > m_high ? pos : m_high;
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        if (traits_type::eq_int_type(ch, traits_type::eof()))
+            return traits_type::not_eof(ch);
+        grow(1);
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+        return ch;
+    }
+
+    std::streamsize xsputn(char const* s, std::streamsize n) override {
+        if (n <= 0)
+            return 0;
+        if (n > epptr() - pptr())
+            grow(static_cast<size_t>(n));
+        std::memcpy(pptr(), s, static_cast<size_t>(n));
+        advance(static_cast<size_t>(n));
+        return n;
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        if (!(which & std::ios_base::out))
+            return pos_type(off_type(-1));
+        off_type base = 0;
+        if (dir == std::ios_base::cur)
+            base = pptr() - pbase();
+        else if (dir == std::ios_base::end)
+            base = static_cast<off_type>(written());
+        return seekpos(pos_type(base + off), which);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        off_type off = off_type(pos);
+        if (!(which & std::ios_base::out) || off < 0 || off > static_cast<off_type>(written()))
+            return pos_type(off_type(-1));
+        m_high = written();
+        setp(pbase(), epptr());
+        advance(static_cast<size_t>(off));
+        return pos;
+    }
+
+private:
+    void grow(size_t need) {
+        size_t used = static_cast<size_t>(pptr() - pbase());
+        size_t high = written();
+        size_t size = m_buffer.size() * 2;
+        if (size < used + need)
+            size = used + need;
+        if (size < MIN_GROWTH)
+            size = MIN_GROWTH;
+        m_buffer.resize(size);
+        setp(m_buffer.data(), m_buffer.data() + m_buffer.size());
+        advance(used);
+        m_high = high;
+    }
+
+    // pbump只接受int，大缓冲区分几次移动
+    void advance(size_t n) {
+        while (n > 0) {
+            int step = n > static_cast<size_t>(INT_MAX) ? INT_MAX : static_cast<int>(n);
+            pbump(step);
+            n -= static_cast<size_t>(step);
+        }
+    }
+
+    bytes_buffer& m_buffer;
+    size_t m_high = 0; // 往回seek之后记住写到过的最远位置
+};
+
+class bytes_ostream : public std::ostream {
+public:
+    explicit bytes_ostream(bytes_buffer& buffer) : std::ostream(nullptr), m_buf(buffer) {
+        rdbuf(&m_buf);
+    }
+
+    bytes_const_view view() const noexcept {
+        return m_buf.view();
+    }
+
+private:
+    bytes_ostreambuf m_buf;
+};
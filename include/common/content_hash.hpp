@@ -0,0 +1,128 @@
+﻿#pragma once
+
+#include "common/bytes_buffer.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// 负载的内容哈希，算法和XXH64一样(种子为0)，结果可以和其它工具算出来的对照
+// 每32字节分给4条互不依赖的累加链，乘法可以流水起来，接近内存带宽；
+// 可以分段喂进去，接收的时候每收到一段就算一段，数据还在缓存里
+class content_hasher {
+public:
+    content_hasher() noexcept {
+        reset();
+    }
+
+    void reset() noexcept {
+        m_acc[0] = PRIME1 + PRIME2;
+        m_acc[1] = PRIME2;
+        m_acc[2] = 0;
+        m_acc[3] = 0 - PRIME1;
+        m_total = 0;
+        m_buffered = 0;
+    }
+
+    void update(char const* data, size_t size) noexcept {
+        auto const* in = reinterpret_cast<unsigned char const*>(data);
+        m_total += size;
+        if (m_buffered > 0) {
+            size_t take = STRIPE - m_buffered < size ? STRIPE - m_buffered : size;
+            std::memcpy(m_buffer + m_buffered, in, take);
+            m_buffered += take;
+            in += take;
+            size -= take;
+            if (m_buffered < STRIPE)
+                return;
+            consume_stripe(m_buffer);
+            m_buffered = 0;
+        }
+        for (; size >= STRIPE; in += STRIPE, size -= STRIPE)
+            consume_stripe(in);
+        std::memcpy(m_buffer, in, size);
+        m_buffered = size;
+    }
+
+    void update(bytes_const_view data) noexcept {
+        update(data.data(), data.size());
+    }
+
+    uint64_t digest() const noexcept {
+        uint64_t h;
+        if (m_total >= STRIPE) {
+            h = rotl(m_acc[0], 1) + rotl(m_acc[1], 7) + rotl(m_acc[2], 12) + rotl(m_acc[3], 18);
+            for (uint64_t acc : m_acc)
+                h = (h ^ round(0, acc)) * PRIME1 + PRIME4;
+        }
+        else {
+            h = PRIME5;
+        }
+        h += m_total;
+
+        unsigned char const* p = m_buffer;
+        size_t left = m_buffered;
+        for (; left >= 8; p += 8, left -= 8)
+            h = rotl(h ^ round(0, load_le(p, 8)), 27) * PRIME1 + PRIME4;
+        if (left >= 4) {
+            h = rotl(h ^ (load_le(p, 4) * PRIME1), 23) * PRIME2 + PRIME3;
+            p += 4;
+            left -= 4;
+        }
+        for (; left > 0; ++p, --left)
+            h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+
+        h ^= h >> 33;
+        h *= PRIME2;
+        h ^= h >> 29;
+        h *= PRIME3;
+        h ^= h >> 32;
+        return h;
+    }
+
+private:
+    static constexpr size_t STRIPE = 32;
+    static constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ull;
+    static constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4Full;
+    static constexpr uint64_t PRIME3 = 0x165667B19E3779F9ull;
+    static constexpr uint64_t PRIME4 = 0x85EBCA77C2B2AE63ull;
+    static constexpr uint64_t PRIME5 = 0x27D4EB2F165667C5ull;
+
+    static uint64_t rotl(uint64_t x, int r) noexcept {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static uint64_t round(uint64_t acc, uint64_t input) noexcept {
+        return rotl(acc + input * PRIME2, 31) * PRIME1;
+    }
+
+    // 按小端读取；逐字节拼的写法编译器不一定能合成一条load，慢好几倍
+    static uint64_t load_le(unsigned char const* p, size_t bytes) noexcept {
+        uint64_t value = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        for (size_t i = 0; i < bytes; ++i)
+            value |= static_cast<uint64_t>(p[i]) << (8 * i);
+#else
+        std::memcpy(&value, p, bytes);
+#endif
+        return value;
+    }
+
+    void consume_stripe(unsigned char const* p) noexcept {
+        m_acc[0] = round(m_acc[0], load_le(p, 8));
+        m_acc[1] = round(m_acc[1], load_le(p + 8, 8));
+        m_acc[2] = round(m_acc[2], load_le(p + 16, 8));
+        m_acc[3] = round(m_acc[3], load_le(p + 24, 8));
+    }
+
+    uint64_t m_acc[4];
+    uint64_t m_total = 0;
+    unsigned char m_buffer[STRIPE];
+    size_t m_buffered = 0;
+};
+
+inline uint64_t content_hash(bytes_const_view data) noexcept {
+    content_hasher hasher;
+    hasher.update(data);
+    return hasher.digest();
+}
@@ -1,5 +1,10 @@
 ﻿#pragma once
 #include <functional>
+#include <iostream>
+#include <string>
+#include <system_error>
+
+#include "common/socket_compat.hpp"
 
 template<typename T>
 class EasyLogic {
@@ -34,7 +39,7 @@ public:
 
     EasyLogic& throw_if_equal(const T& value, std::string message = "error") {
         if (expression_result == value) {
-            auto ec = std::error_code(WSAGetLastError(), utf8_system_category());
+            auto ec = std::error_code(last_socket_error(), utf8_system_category());
             std::cerr << ec.message();
             throw std::system_error(ec, message);
         }
@@ -43,7 +48,7 @@ public:
 
     EasyLogic& throw_if_not_equal(const T& value, std::string message = "error") {
         if (expression_result != value) {
-            auto ec = std::error_code(WSAGetLastError(), utf8_system_category());
+            auto ec = std::error_code(last_socket_error(), utf8_system_category());
             std::cerr << ec.message();
             throw std::system_error(ec, message);
         }
@@ -0,0 +1,182 @@
+﻿#pragma once
+
+#include "common/bytes_buffer.hpp"
+#include "common/content_hash.hpp"
+#include "common/frame_header.hpp"
+#include "common/lz_codec.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+
+// 把字节流切成完整的帧，同时接受版本化的帧头(见frame_header)和旧的 {[int32 网络字节序长度][数据]} 格式
+// 平时recv到一块固定大小的暂存区里，一次能解析出几帧就交出几帧；
+// 遇到一帧没收全时按头里的长度分配好最终的存储，后面的数据直接recv进去，不再经过暂存区；
+// 长度是对端说的，不能全信：超过PAYLOAD_STEP的帧先分配一步，收满了再按倍数扩大，占用的内存不超过已经收到的两倍
+// 压缩帧的数据一直走暂存区，每收到一段就喂给流解码器解出已经完整的块，不会先把整帧压缩数据攒下来
+// 交出的帧都带着负载的content_hash，直接收进最终存储的大帧每收到一段就算一段
+class frame_decoder {
+public:
+    static constexpr size_t STAGING_SIZE = 64 * 1024;
+    static constexpr size_t PAYLOAD_STEP = 64 * 1024 * 1024;
+
+    frame_decoder() : m_staging(STAGING_SIZE), m_inflater(frame_header::MAX_PAYLOAD_SIZE) {}
+    frame_decoder(frame_decoder&&) = default;
+    frame_decoder& operator=(frame_decoder&&) = default;
+
+    // 下一次recv应该写入的位置
+    bytes_view prepare() {
+        if (m_in_payload) {
+            if (m_payload_filled == m_payload.size()) {
+                growPayload();
+            }
+            return bytes_view{ m_payload.data() + m_payload_filled, m_payload.size() - m_payload_filled };
+        }
+        if (m_begin == m_end) {
+            m_begin = m_end = 0;
+        }
+        else if (m_begin > 0) {
+            // 剩下的只会是不到一个头的几个字节
+            std::memmove(m_staging.data(), m_staging.data() + m_begin, m_end - m_begin);
+            m_end -= m_begin;
+            m_begin = 0;
+        }
+        return m_staging.subspan(m_end, m_staging.size() - m_end);
+    }
+
+    // 收到了一帧的一部分，还差后面的数据
+    bool partial() const noexcept {
+        return m_in_payload || m_in_compressed || m_end > m_begin;
+    }
+
+    // 提交recv到prepare()位置的n个字节，每解出一帧调用一次on_frame(brep_frame&&)
+    // 帧头不合法时返回false，这个连接上的数据已经没法再对齐了
+    template <typename OnFrame>
+    bool commit(size_t n, OnFrame&& on_frame) {
+        if (m_in_payload) {
+            m_hasher.update(m_payload.data() + m_payload_filled, n);
+            m_payload_filled += n;
+            if (m_payload_filled == m_payload_total) {
+                m_in_payload = false;
+                brep_frame frame;
+                frame.m_encoding = m_header.m_encoding;
+                frame.m_flags = m_header.m_flags;
+                frame.m_payload = std::exchange(m_payload, std::string());
+                frame.m_digest = m_hasher.digest();
+                on_frame(std::move(frame));
+            }
+            return true;
+        }
+
+        m_end += n;
+        if (m_in_compressed && !inflate(on_frame)) {
+            return false;
+        }
+        while (!m_in_compressed && m_end - m_begin >= frame_header::LEGACY_SIZE) {
+            char const* head = m_staging.data() + m_begin;
+            size_t header_size = frame_header::LEGACY_SIZE;
+            if (frame_header::is_versioned(head)) {
+                if (m_end - m_begin < frame_header::SIZE) {
+                    break;
+                }
+                if (!frame_header::decode(head, m_header)) {
+                    return false;
+                }
+                header_size = frame_header::SIZE;
+            }
+            else if (!frame_header::decode_legacy(head, m_header)) {
+                return false;
+            }
+
+            size_t length = static_cast<size_t>(m_header.m_payload_size);
+            size_t staged = m_end - m_begin - header_size;
+            char const* body = head + header_size;
+            if (m_header.m_flags & frame_flag_compressed) {
+                m_begin += header_size;
+                m_in_compressed = true;
+                m_compressed_left = length;
+                m_inflater.reset();
+                if (!inflate(on_frame)) {
+                    return false;
+                }
+                continue;
+            }
+            if (staged >= length) {
+                brep_frame frame;
+                frame.m_encoding = m_header.m_encoding;
+                frame.m_flags = m_header.m_flags;
+                frame.m_payload.assign(body, length);
+                frame.m_digest = content_hash(bytes_const_view{ body, length });
+                on_frame(std::move(frame));
+                m_begin += header_size + length;
+                continue;
+            }
+
+            // 这一帧没收全：按长度准备好最终的存储，已经暂存的部分搬过去
+            m_payload_total = length;
+            m_payload.resize(length < PAYLOAD_STEP ? length : PAYLOAD_STEP);
+            std::memcpy(m_payload.data(), body, staged);
+            m_hasher.reset();
+            m_hasher.update(body, staged);
+            m_payload_filled = staged;
+            m_in_payload = true;
+            m_begin = m_end = 0;
+            break;
+        }
+        return true;
+    }
+
+private:
+    // 大帧的存储收满了还没到头里的长度时扩大，只在prepare里调用
+    void growPayload() {
+        size_t size = m_payload.size();
+        size_t grown = size + (size < PAYLOAD_STEP ? PAYLOAD_STEP : size);
+        m_payload.resize(grown < m_payload_total ? grown : m_payload_total);
+    }
+
+    // 把暂存区里属于当前压缩帧的数据喂给解码器，整帧喂完就交出解压后的帧
+    template <typename OnFrame>
+    bool inflate(OnFrame& on_frame) {
+        size_t take = m_end - m_begin;
+        if (take > m_compressed_left) {
+            take = static_cast<size_t>(m_compressed_left);
+        }
+        if (!m_inflater.consume(m_staging.data() + m_begin, take)) {
+            return false;
+        }
+        m_begin += take;
+        m_compressed_left -= take;
+        if (m_compressed_left > 0) {
+            return true;
+        }
+
+        if (!m_inflater.finished()) {
+            return false;
+        }
+        m_in_compressed = false;
+        uint16_t flags = static_cast<uint16_t>(m_header.m_flags & ~frame_flag_compressed);
+        brep_frame frame;
+        frame.m_encoding = m_header.m_encoding;
+        frame.m_flags = flags;
+        frame.m_payload = m_inflater.take();
+        frame.m_digest = content_hash(frame.payload());
+        on_frame(std::move(frame));
+        return true;
+    }
+
+    bytes_buffer m_staging;
+    size_t m_begin = 0;
+    size_t m_end = 0;
+
+    bool m_in_payload = false;
+    frame_header m_header;
+    std::string m_payload;
+    size_t m_payload_total = 0; // 头里的长度，m_payload可能还没扩到这么大
+    size_t m_payload_filled = 0;
+    content_hasher m_hasher;
+
+    bool m_in_compressed = false;
+    uint64_t m_compressed_left = 0;
+    lz::stream_decoder m_inflater;
+};
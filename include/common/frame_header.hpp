@@ -0,0 +1,122 @@
+﻿#pragma once
+
+#include "common/bytes_buffer.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// 帧的负载编码
+enum class payload_encoding : uint8_t {
+    brep_text = 0,   // BRepTools::Write 的文本格式
+    brep_binary = 1, // BinTools::Write 的二进制格式
+};
+
+// 帧头里的标志位
+enum frame_flag : uint16_t {
+    frame_flag_compressed = 1 << 0, // 负载是lz::compress_stream压缩后的分块流
+};
+
+// 版本化的帧头，所有整数都按网络字节序(大端)存放：
+// [magic u32][version u8][encoding u8][flags u16][payload_size u64]
+// 旧格式只有 [int32 长度]，靠开头的magic区分；旧格式里恰好长度等于magic的帧会被误判，实际不会出现这么大的文本帧
+struct frame_header {
+    static constexpr uint32_t MAGIC = 0x47444246; // "GDBF"
+    static constexpr uint8_t VERSION = 1;
+    static constexpr size_t SIZE = 16;
+    static constexpr size_t LEGACY_SIZE = sizeof(int32_t);
+    static constexpr uint64_t MAX_PAYLOAD_SIZE = uint64_t(4) << 30;
+
+    uint8_t m_version = VERSION;
+    payload_encoding m_encoding = payload_encoding::brep_text;
+    uint16_t m_flags = 0;
+    uint64_t m_payload_size = 0;
+
+    void encode(char* out) const noexcept {
+        store_be(out, MAGIC, 4);
+        out[4] = static_cast<char>(m_version);
+        out[5] = static_cast<char>(m_encoding);
+        store_be(out + 6, m_flags, 2);
+        store_be(out + 8, m_payload_size, 8);
+    }
+
+    std::string encode() const {
+        std::string out(SIZE, '\0');
+        encode(out.data());
+        return out;
+    }
+
+    static bool is_versioned(char const* in) noexcept {
+        return load_be(in, 4) == MAGIC;
+    }
+
+    // in至少要有SIZE个字节；版本、编码不认识或长度超限时返回false
+    static bool decode(char const* in, frame_header& header) noexcept {
+        if (!is_versioned(in))
+            return false;
+        header.m_version = static_cast<uint8_t>(in[4]);
+        header.m_encoding = static_cast<payload_encoding>(in[5]);
+        header.m_flags = static_cast<uint16_t>(load_be(in + 6, 2));
+        header.m_payload_size = load_be(in + 8, 8);
+        return header.m_version == VERSION
+            && header.m_encoding <= payload_encoding::brep_binary
+            && header.m_payload_size <= MAX_PAYLOAD_SIZE;
+    }
+
+    // 旧格式的头：只有一个int32长度，负载总是文本BRep
+    static bool decode_legacy(char const* in, frame_header& header) noexcept {
+        uint64_t length = load_be(in, 4);
+        header = frame_header{};
+        header.m_version = 0;
+        header.m_payload_size = length;
+        return length <= static_cast<uint64_t>(INT32_MAX);
+    }
+
+private:
+    static void store_be(char* out, uint64_t value, size_t bytes) noexcept {
+        for (size_t i = 0; i < bytes; ++i)
+            out[i] = static_cast<char>((value >> (8 * (bytes - 1 - i))) & 0xff);
+    }
+
+    static uint64_t load_be(char const* in, size_t bytes) noexcept {
+        uint64_t value = 0;
+        for (size_t i = 0; i < bytes; ++i)
+            value = (value << 8) | static_cast<unsigned char>(in[i]);
+        return value;
+    }
+};
+
+// 解码后的一帧
+struct brep_frame {
+    payload_encoding m_encoding = payload_encoding::brep_text;
+    uint16_t m_flags = 0;
+    std::string m_payload;
+    // 负载不在m_payload里(比如映射进来的共享内存段)时m_view指向它，m_storage保证它一直有效
+    std::shared_ptr<const void> m_storage;
+    bytes_const_view m_view{ nullptr, 0 };
+    // 负载的content_hash，接收的一方在收的时候算好，服务端按它给内容相同的快照去重
+    uint64_t m_digest = 0;
+
+    bytes_const_view payload() const noexcept {
+        if (m_storage)
+            return m_view;
+        return bytes_const_view{ m_payload.data(), m_payload.size() };
+    }
+
+    bool empty() const noexcept {
+        return payload().size() == 0;
+    }
+
+    friend bool operator==(brep_frame const& a, brep_frame const& b) {
+        return a.m_encoding == b.m_encoding && std::string_view(a.payload()) == std::string_view(b.payload());
+    }
+
+    friend bool operator!=(brep_frame const& a, brep_frame const& b) {
+        return !(a == b);
+    }
+};
+
+// 收到之后就不再改的帧，快照历史、解析任务和预取任务共享同一份负载
+using brep_frame_ptr = std::shared_ptr<const brep_frame>;
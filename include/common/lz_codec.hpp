@@ -0,0 +1,362 @@
+﻿#pragma once
+
+#include "common/bytes_buffer.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+// 仓库内实现的快速LZ压缩，块格式与LZ4块格式一致(token + 字面量 + 16位偏移 + 匹配长度)
+// 帧负载压缩后的流格式(大端)：[u64 原始总长度] 之后是若干块 [u32 原始长度][u32 压缩长度|STORED_BIT][数据]
+// 每块最多BLOCK_SIZE字节，接收端收齐一块就能解一块，不需要等整帧收完
+namespace lz {
+
+    constexpr size_t BLOCK_SIZE = 64 * 1024;
+    constexpr uint32_t STORED_BIT = 0x80000000u; // 压不小的块原样存放
+    constexpr size_t STREAM_HEADER_SIZE = 8;
+    constexpr size_t BLOCK_HEADER_SIZE = 8;
+
+    namespace detail {
+        constexpr int HASH_LOG = 14;
+        constexpr size_t MIN_MATCH = 4;
+        constexpr size_t LAST_LITERALS = 5;
+        constexpr size_t MF_LIMIT = 12;
+
+        inline uint32_t read32(uint8_t const* p) noexcept {
+            uint32_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline uint32_t hash32(uint32_t v) noexcept {
+            return (v * 2654435761u) >> (32 - HASH_LOG);
+        }
+
+        inline void store_be(char* out, uint64_t value, size_t bytes) noexcept {
+            for (size_t i = 0; i < bytes; ++i)
+                out[i] = static_cast<char>((value >> (8 * (bytes - 1 - i))) & 0xff);
+        }
+
+        inline uint64_t load_be(char const* in, size_t bytes) noexcept {
+            uint64_t value = 0;
+            for (size_t i = 0; i < bytes; ++i)
+                value = (value << 8) | static_cast<unsigned char>(in[i]);
+            return value;
+        }
+
+        // 写长度的扩展字节，返回false表示输出空间不够
+        inline bool write_length(uint8_t*& op, uint8_t const* oend, size_t len) noexcept {
+            while (len >= 255) {
+                if (op >= oend)
+                    return false;
+                *op++ = 255;
+                len -= 255;
+            }
+            if (op >= oend)
+                return false;
+            *op++ = static_cast<uint8_t>(len);
+            return true;
+        }
+
+        inline bool emit_sequence(uint8_t*& op, uint8_t const* oend, uint8_t const* literals, size_t literal_len,
+                                  size_t offset, size_t match_len) noexcept {
+            if (op >= oend)
+                return false;
+            uint8_t* token = op++;
+            *token = static_cast<uint8_t>((literal_len >= 15 ? 15 : literal_len) << 4);
+            if (literal_len >= 15 && !write_length(op, oend, literal_len - 15))
+                return false;
+            if (static_cast<size_t>(oend - op) < literal_len)
+                return false;
+            std::memcpy(op, literals, literal_len);
+            op += literal_len;
+
+            if (match_len == 0)
+                return true; // 最后一个序列只有字面量
+
+            if (oend - op < 2)
+                return false;
+            *op++ = static_cast<uint8_t>(offset & 0xff);
+            *op++ = static_cast<uint8_t>(offset >> 8);
+            size_t ml = match_len - MIN_MATCH;
+            *token |= static_cast<uint8_t>(ml >= 15 ? 15 : ml);
+            if (ml >= 15 && !write_length(op, oend, ml - 15))
+                return false;
+            return true;
+        }
+    }
+
+    inline size_t compress_bound(size_t n) noexcept {
+        return n + n / 255 + 16;
+    }
+
+    constexpr size_t HASH_TABLE_SIZE = size_t(1) << detail::HASH_LOG;
+
+    // 压缩一块，返回压缩后的长度；输出放不下或者压不小时返回0
+    // table是HASH_TABLE_SIZE大小的哈希表，可以跨块复用(候选位置都会逐字节校验)，不需要每块清零
+    inline size_t compress_block(char const* src, size_t n, char* dst, size_t capacity, uint32_t* table) {
+        using namespace detail;
+        auto const* in = reinterpret_cast<uint8_t const*>(src);
+        auto* op = reinterpret_cast<uint8_t*>(dst);
+        uint8_t const* oend = op + (capacity < n ? capacity : n); // 不比原始数据小就没意义
+
+        size_t anchor = 0;
+        if (n > MF_LIMIT) {
+            size_t const mf_limit = n - MF_LIMIT;
+            size_t const match_limit = n - LAST_LITERALS;
+            size_t ip = 0;
+            while (ip < mf_limit) {
+                uint32_t seq = read32(in + ip);
+                uint32_t h = hash32(seq);
+                size_t candidate = table[h];
+                table[h] = static_cast<uint32_t>(ip);
+
+                if (candidate < ip && ip - candidate <= 0xffff && read32(in + candidate) == seq) {
+                    size_t len = MIN_MATCH;
+                    while (ip + len < match_limit && in[candidate + len] == in[ip + len])
+                        ++len;
+                    if (!emit_sequence(op, oend, in + anchor, ip - anchor, ip - candidate, len))
+                        return 0;
+                    ip += len;
+                    anchor = ip;
+                    if (ip - 2 < mf_limit)
+                        table[hash32(read32(in + ip - 2))] = static_cast<uint32_t>(ip - 2);
+                }
+                else {
+                    ip += 1 + ((ip - anchor) >> 6); // 长时间没有匹配时加大步长
+                }
+            }
+        }
+        if (!emit_sequence(op, oend, in + anchor, n - anchor, 0, 0))
+            return 0;
+        return static_cast<size_t>(op - reinterpret_cast<uint8_t*>(dst));
+    }
+
+    inline size_t compress_block(char const* src, size_t n, char* dst, size_t capacity) {
+        std::vector<uint32_t> table(HASH_TABLE_SIZE, 0);
+        return compress_block(src, n, dst, capacity, table.data());
+    }
+
+    // 解压一块，数据不合法时返回false，不会越界读写
+    inline bool decompress_block(char const* src, size_t n, char* dst, size_t raw_size) noexcept {
+        auto const* in = reinterpret_cast<uint8_t const*>(src);
+        auto* out = reinterpret_cast<uint8_t*>(dst);
+        size_t ip = 0, op = 0;
+
+        auto read_length = [&](size_t& len) {
+            uint8_t b = 0;
+            do {
+                if (ip >= n)
+                    return false;
+                b = in[ip++];
+                len += b;
+            } while (b == 255);
+            return true;
+        };
+
+        while (true) {
+            if (ip >= n)
+                return false;
+            uint8_t token = in[ip++];
+
+            size_t literal_len = token >> 4;
+            if (literal_len == 15 && !read_length(literal_len))
+                return false;
+            if (literal_len > n - ip || literal_len > raw_size - op)
+                return false;
+            std::memcpy(out + op, in + ip, literal_len);
+            ip += literal_len;
+            op += literal_len;
+
+            if (ip == n)
+                return op == raw_size;
+
+            if (n - ip < 2)
+                return false;
+            size_t offset = in[ip] | (size_t(in[ip + 1]) << 8);
+            ip += 2;
+            if (offset == 0 || offset > op)
+                return false;
+
+            size_t match_len = token & 15;
+            if (match_len == 15 && !read_length(match_len))
+                return false;
+            match_len += detail::MIN_MATCH;
+            if (match_len > raw_size - op)
+                return false;
+
+            uint8_t const* match = out + op - offset;
+            if (offset >= match_len) {
+                std::memcpy(out + op, match, match_len);
+            }
+            else {
+                for (size_t i = 0; i < match_len; ++i)
+                    out[op + i] = match[i];
+            }
+            op += match_len;
+        }
+    }
+
+    namespace detail {
+        // out至少要有stream_bound(in.size())个字节，返回写入的长度
+        inline size_t compress_stream_into(bytes_const_view in, char* out, uint32_t* table) {
+            store_be(out, in.size(), 8);
+            size_t pos = STREAM_HEADER_SIZE;
+            for (size_t offset = 0; offset < in.size(); offset += BLOCK_SIZE) {
+                size_t raw = in.size() - offset < BLOCK_SIZE ? in.size() - offset : BLOCK_SIZE;
+                char* block_header = out + pos;
+                char* body = block_header + BLOCK_HEADER_SIZE;
+                size_t packed = compress_block(in.data() + offset, raw, body, raw, table);
+                uint32_t stored_size = static_cast<uint32_t>(packed);
+                if (packed == 0) {
+                    std::memcpy(body, in.data() + offset, raw);
+                    stored_size = static_cast<uint32_t>(raw) | STORED_BIT;
+                    packed = raw;
+                }
+                store_be(block_header, raw, 4);
+                store_be(block_header + 4, stored_size, 4);
+                pos += BLOCK_HEADER_SIZE + packed;
+            }
+            return pos;
+        }
+    }
+
+    // 压缩流最大可能的长度
+    inline size_t stream_bound(size_t n) noexcept {
+        return STREAM_HEADER_SIZE + (n / BLOCK_SIZE + 1) * BLOCK_HEADER_SIZE + compress_bound(n);
+    }
+
+    // 把整个负载压成分块的流
+    inline std::string compress_stream(bytes_const_view in) {
+        std::string out;
+        out.resize(stream_bound(in.size()));
+        std::vector<uint32_t> table(HASH_TABLE_SIZE, 0);
+        out.resize(detail::compress_stream_into(in, out.data(), table.data()));
+        return out;
+    }
+
+    // 压进一个复用的缓冲区，返回压缩后的长度；out只增不减，预热之后不再分配内存
+    // table是调用方保存的HASH_TABLE_SIZE大小的哈希表
+    inline size_t compress_stream(bytes_const_view in, bytes_buffer& out, uint32_t* table) {
+        size_t bound = stream_bound(in.size());
+        if (out.size() < bound)
+            out.resize(bound);
+        return detail::compress_stream_into(in, out.data(), table);
+    }
+
+    // 边收边解的流解码器：每次喂进来一段压缩数据，凑齐一块就解一块，内部最多缓存一块压缩数据
+    class stream_decoder {
+    public:
+        explicit stream_decoder(uint64_t max_raw_size = UINT64_MAX) : m_max_raw_size(max_raw_size) {}
+
+        void reset() {
+            m_stage = Stage::StreamHeader;
+            m_want = STREAM_HEADER_SIZE;
+            m_pending.clear();
+            m_out = std::string();
+            m_raw_total = 0;
+        }
+
+        // 数据不合法时返回false
+        bool consume(char const* data, size_t n) {
+            while (n > 0) {
+                if (m_pending.empty() && n >= m_want) {
+                    size_t want = m_want;
+                    if (!process(data, want))
+                        return false;
+                    data += want;
+                    n -= want;
+                    continue;
+                }
+                size_t take = m_want - m_pending.size();
+                if (take > n)
+                    take = n;
+                m_pending.insert(m_pending.end(), data, data + take);
+                data += take;
+                n -= take;
+                if (m_pending.size() == m_want) {
+                    bool ok = process(m_pending.data(), m_want);
+                    m_pending.clear();
+                    if (!ok)
+                        return false;
+                }
+            }
+            return true;
+        }
+
+        bool finished() const noexcept {
+            return m_stage == Stage::BlockHeader && m_out.size() == m_raw_total;
+        }
+
+        std::string take() {
+            return std::exchange(m_out, std::string());
+        }
+
+    private:
+        enum class Stage { StreamHeader, BlockHeader, BlockBody };
+
+        bool process(char const* data, size_t n) {
+            switch (m_stage) {
+            case Stage::StreamHeader:
+                m_raw_total = detail::load_be(data, 8);
+                if (m_raw_total > m_max_raw_size)
+                    return false;
+                // 不按头里声明的总长一次预留：几个字节的流就能声明4GB，内存要随真正收到的块增长
+                m_stage = Stage::BlockHeader;
+                m_want = BLOCK_HEADER_SIZE;
+                return true;
+
+            case Stage::BlockHeader: {
+                m_block_raw = static_cast<size_t>(detail::load_be(data, 4));
+                uint32_t stored = static_cast<uint32_t>(detail::load_be(data + 4, 4));
+                m_block_stored = (stored & STORED_BIT) != 0;
+                size_t body = stored & ~STORED_BIT;
+                if (m_block_raw == 0 || m_block_raw > BLOCK_SIZE || body == 0 || body > compress_bound(BLOCK_SIZE)
+                    || m_block_raw > m_raw_total - m_out.size() || (m_block_stored && body != m_block_raw))
+                    return false;
+                m_stage = Stage::BlockBody;
+                m_want = body;
+                return true;
+            }
+
+            case Stage::BlockBody: {
+                size_t old_size = m_out.size();
+                reserve_for(old_size + m_block_raw);
+                if (m_block_stored) {
+                    m_out.append(data, n);
+                }
+                else {
+                    m_out.resize(old_size + m_block_raw);
+                    if (!decompress_block(data, n, m_out.data() + old_size, m_block_raw))
+                        return false;
+                }
+                m_stage = Stage::BlockHeader;
+                m_want = BLOCK_HEADER_SIZE;
+                return true;
+            }
+            }
+            return false;
+        }
+
+        // 容量按倍数增长但不超过声明的总长，占用的内存最多是已经解出来的两倍
+        void reserve_for(size_t size) {
+            if (size <= m_out.capacity())
+                return;
+            size_t grown = m_out.capacity() * 2;
+            if (grown > m_raw_total)
+                grown = static_cast<size_t>(m_raw_total);
+            m_out.reserve(grown > size ? grown : size);
+        }
+
+        uint64_t m_max_raw_size;
+        Stage m_stage = Stage::StreamHeader;
+        size_t m_want = STREAM_HEADER_SIZE;
+        std::vector<char> m_pending;
+        std::string m_out;
+        uint64_t m_raw_total = 0;
+        size_t m_block_raw = 0;
+        bool m_block_stored = false;
+    };
+}
@@ -0,0 +1,239 @@
+﻿#pragma once
+
+// 可以按位置写、按段只读映射的文件，服务端的会话日志和会话文件都用它；映射出来的段直接当作帧的负载，不拷贝
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "common/bytes_buffer.hpp"
+#include "common/utf8_system_category.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+
+// 只读映射的一段文件，最后一个引用它的帧释放时解除映射
+class file_mapping {
+public:
+    file_mapping(void* base, size_t base_size, size_t skip, size_t size) noexcept
+        : m_base(base), m_base_size(base_size), m_skip(skip), m_size(size) {}
+    ~file_mapping() {
+#if defined(_WIN32)
+        UnmapViewOfFile(m_base);
+#else
+        munmap(m_base, m_base_size);
+#endif
+    }
+    file_mapping(file_mapping const&) = delete;
+    file_mapping& operator=(file_mapping const&) = delete;
+
+    bytes_const_view view() const noexcept {
+        return bytes_const_view{ static_cast<char const*>(m_base) + m_skip, m_size };
+    }
+
+private:
+    void* m_base;
+    size_t m_base_size;
+    size_t m_skip; // 映射的起点要按页对齐，数据从这里开始
+    size_t m_size;
+};
+
+class mapped_file {
+public:
+    mapped_file() = default;
+    mapped_file(mapped_file&& other) noexcept : m_handle(std::exchange(other.m_handle, INVALID)) {}
+    mapped_file& operator=(mapped_file&& other) noexcept {
+        if (this != &other) {
+            close();
+            m_handle = std::exchange(other.m_handle, INVALID);
+        }
+        return *this;
+    }
+    ~mapped_file() {
+        close();
+    }
+
+    // 新建(已有时清空)一个可读写的文件；temporary为true时文件在关闭(进程退出)后自动删除
+    static mapped_file create(std::string const& path, std::error_code& ec, bool temporary = false) {
+        mapped_file file;
+#if defined(_WIN32)
+        DWORD flags = temporary ? FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE : FILE_ATTRIBUTE_NORMAL;
+        file.m_handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, CREATE_ALWAYS, flags, nullptr);
+#else
+        file.m_handle = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (file.is_open() && temporary)
+            ::unlink(path.c_str()); // 只剩描述符，崩溃了也不会留下文件
+#endif
+        ec = file.is_open() ? std::error_code() : last_error();
+        return file;
+    }
+
+    // 只读打开已有的文件
+    static mapped_file open_read(std::string const& path, std::error_code& ec) {
+        mapped_file file;
+#if defined(_WIN32)
+        file.m_handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+#else
+        file.m_handle = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+        ec = file.is_open() ? std::error_code() : last_error();
+        return file;
+    }
+
+    // 把from改名成to，to已经存在时原子地替换掉；已经打开、映射了to的一方继续看到原来的内容
+    static bool replace(std::string const& from, std::string const& to, std::error_code& ec) {
+#if defined(_WIN32)
+        bool ok = MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+        bool ok = ::rename(from.c_str(), to.c_str()) == 0;
+#endif
+        ec = ok ? std::error_code() : last_error();
+        return ok;
+    }
+
+    static void remove(std::string const& path) noexcept {
+#if defined(_WIN32)
+        DeleteFileA(path.c_str());
+#else
+        ::unlink(path.c_str());
+#endif
+    }
+
+    bool is_open() const noexcept {
+        return m_handle != INVALID;
+    }
+
+    void close() noexcept {
+        if (!is_open())
+            return;
+#if defined(_WIN32)
+        CloseHandle(m_handle);
+#else
+        ::close(m_handle);
+#endif
+        m_handle = INVALID;
+    }
+
+    // 文件现在的大小，出错时返回0并设置ec
+    uint64_t size(std::error_code& ec) const {
+        ec.clear();
+#if defined(_WIN32)
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_handle, &size)) {
+            ec = last_error();
+            return 0;
+        }
+        return static_cast<uint64_t>(size.QuadPart);
+#else
+        struct stat st;
+        if (fstat(m_handle, &st) != 0) {
+            ec = last_error();
+            return 0;
+        }
+        return static_cast<uint64_t>(st.st_size);
+#endif
+    }
+
+    // 在offset处写入全部数据，不移动共享的文件位置，多个线程可以同时写不重叠的区间
+    bool write_at(uint64_t offset, bytes_const_view data, std::error_code& ec) {
+        char const* p = data.data();
+        size_t left = data.size();
+        while (left > 0) {
+            size_t chunk = left < (size_t(1) << 30) ? left : (size_t(1) << 30);
+#if defined(_WIN32)
+            OVERLAPPED at{};
+            at.Offset = static_cast<DWORD>(offset);
+            at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD written = 0;
+            if (!WriteFile(m_handle, p, static_cast<DWORD>(chunk), &written, &at)) {
+                ec = last_error();
+                return false;
+            }
+#else
+            ssize_t written = ::pwrite(m_handle, p, chunk, static_cast<off_t>(offset));
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                ec = last_error();
+                return false;
+            }
+#endif
+            p += written;
+            left -= static_cast<size_t>(written);
+            offset += static_cast<uint64_t>(written);
+        }
+        ec.clear();
+        return true;
+    }
+
+    // 只读映射[offset, offset + size)，size为0时返回空
+    std::shared_ptr<const file_mapping> map(uint64_t offset, size_t size, std::error_code& ec) const {
+        ec.clear();
+        if (size == 0)
+            return nullptr;
+        uint64_t base = offset - offset % granularity();
+        size_t skip = static_cast<size_t>(offset - base);
+#if defined(_WIN32)
+        uint64_t end = offset + size;
+        HANDLE section = CreateFileMappingA(m_handle, nullptr, PAGE_READONLY, static_cast<DWORD>(end >> 32), static_cast<DWORD>(end), nullptr);
+        if (!section) {
+            ec = last_error();
+            return nullptr;
+        }
+        void* view = MapViewOfFile(section, FILE_MAP_READ, static_cast<DWORD>(base >> 32), static_cast<DWORD>(base), skip + size);
+        ec = view ? std::error_code() : last_error();
+        CloseHandle(section); // 视图自己拿着映射对象
+        if (!view)
+            return nullptr;
+#else
+        void* view = mmap(nullptr, skip + size, PROT_READ, MAP_SHARED, m_handle, static_cast<off_t>(base));
+        if (view == MAP_FAILED) {
+            ec = last_error();
+            return nullptr;
+        }
+#endif
+        return std::make_shared<const file_mapping>(view, skip + size, skip, size);
+    }
+
+private:
+#if defined(_WIN32)
+    using native_handle = HANDLE;
+    static inline const HANDLE INVALID = INVALID_HANDLE_VALUE;
+
+    static size_t granularity() noexcept {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwAllocationGranularity;
+    }
+
+    static std::error_code last_error() noexcept {
+        return std::error_code(static_cast<int>(GetLastError()), utf8_system_category());
+    }
+#else
+    using native_handle = int;
+    static constexpr int INVALID = -1;
+
+    static size_t granularity() noexcept {
+        static size_t const page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        return page;
+    }
+
+    static std::error_code last_error() noexcept {
+        return std::error_code(errno, utf8_system_category());
+    }
+#endif
+
+    native_handle m_handle = INVALID;
+};
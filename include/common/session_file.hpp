@@ -0,0 +1,287 @@
+﻿#pragma once
+
+// 会话文件：把一次调试收到的快照存成一个文件，拿到别的机器上可以直接打开浏览，不用重新运行客户端
+// [文件头16字节][记录]...[索引项]...[尾部32字节]，所有整数都是大端
+//   文件头：[magic "GDBS" u32][版本 u32][保留 u64]
+//   记录：  [帧头16字节(和TCP上的相同)][内容哈希 u64][负载]，内容相同的快照只写一条记录，几个索引项指向它
+//   索引项：[记录位置 u64][负载长度 u64][内容哈希 u64][收到的时间 i64，Unix时间微秒][连接号 u64][编码 u8][保留 u8][标志 u16][保留 u32]
+//   尾部：  [索引位置 u64][索引项数 u64][保留 u64][magic "GDBI" u32][版本 u32]
+// 打开时只读尾部和索引，负载在用到时才映射；服务端的会话日志也用同样的记录格式
+
+#include "common/bytes_buffer.hpp"
+#include "common/frame_header.hpp"
+#include "common/mapped_file.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace session_file {
+    constexpr uint32_t MAGIC = 0x47444253;       // "GDBS"
+    constexpr uint32_t INDEX_MAGIC = 0x47444249; // "GDBI"
+    constexpr uint32_t VERSION = 1;
+    constexpr size_t FILE_HEADER_SIZE = 16;
+    constexpr size_t RECORD_HEADER_SIZE = frame_header::SIZE + 8;
+    constexpr size_t INDEX_ENTRY_SIZE = 48;
+    constexpr size_t TRAILER_SIZE = 32;
+
+    namespace detail {
+        inline void store_be(char* out, uint64_t value, size_t bytes) noexcept {
+            for (size_t i = 0; i < bytes; ++i)
+                out[i] = static_cast<char>((value >> (8 * (bytes - 1 - i))) & 0xff);
+        }
+
+        inline uint64_t load_be(char const* in, size_t bytes) noexcept {
+            uint64_t value = 0;
+            for (size_t i = 0; i < bytes; ++i)
+                value = (value << 8) | static_cast<unsigned char>(in[i]);
+            return value;
+        }
+    }
+
+    // 索引里的一项，对应一个快照
+    struct index_entry {
+        uint64_t m_offset = 0; // 记录(记录头)在文件里的位置
+        uint64_t m_size = 0;   // 负载长度
+        uint64_t m_digest = 0;
+        int64_t m_timestamp_us = 0;
+        uint64_t m_connection = 0;
+        payload_encoding m_encoding = payload_encoding::brep_text;
+        uint16_t m_flags = 0;
+
+        void encode(char* out) const noexcept {
+            detail::store_be(out, m_offset, 8);
+            detail::store_be(out + 8, m_size, 8);
+            detail::store_be(out + 16, m_digest, 8);
+            detail::store_be(out + 24, static_cast<uint64_t>(m_timestamp_us), 8);
+            detail::store_be(out + 32, m_connection, 8);
+            out[40] = static_cast<char>(m_encoding);
+            out[41] = 0;
+            detail::store_be(out + 42, m_flags, 2);
+            detail::store_be(out + 44, 0, 4);
+        }
+
+        static index_entry decode(char const* in) noexcept {
+            index_entry entry;
+            entry.m_offset = detail::load_be(in, 8);
+            entry.m_size = detail::load_be(in + 8, 8);
+            entry.m_digest = detail::load_be(in + 16, 8);
+            entry.m_timestamp_us = static_cast<int64_t>(detail::load_be(in + 24, 8));
+            entry.m_connection = detail::load_be(in + 32, 8);
+            entry.m_encoding = static_cast<payload_encoding>(in[40]);
+            entry.m_flags = static_cast<uint16_t>(detail::load_be(in + 42, 2));
+            return entry;
+        }
+    };
+
+    inline void encode_record_header(char* out, brep_frame const& frame) noexcept {
+        frame_header header;
+        header.m_encoding = frame.m_encoding;
+        header.m_flags = frame.m_flags;
+        header.m_payload_size = frame.payload().size();
+        header.encode(out);
+        detail::store_be(out + frame_header::SIZE, frame.m_digest, 8);
+    }
+
+    // 只读映射位置offset处的一条记录，size是索引里记的负载长度；返回的帧引用映射，不拷贝负载
+    inline brep_frame_ptr load_record(mapped_file const& file, uint64_t offset, uint64_t size, std::error_code& ec) {
+        auto mapping = file.map(offset, static_cast<size_t>(RECORD_HEADER_SIZE + size), ec);
+        if (!mapping)
+            return nullptr;
+        char const* head = mapping->view().data();
+        frame_header header;
+        if (!frame_header::decode(head, header) || header.m_payload_size != size) {
+            ec = std::make_error_code(std::errc::illegal_byte_sequence);
+            return nullptr;
+        }
+        auto frame = std::make_shared<brep_frame>();
+        frame->m_encoding = header.m_encoding;
+        frame->m_flags = header.m_flags;
+        frame->m_digest = detail::load_be(head + frame_header::SIZE, 8);
+        frame->m_view = bytes_const_view{ head + RECORD_HEADER_SIZE, static_cast<size_t>(size) };
+        frame->m_storage = std::move(mapping);
+        return frame;
+    }
+
+    // 顺序写一个会话文件，finish之后才是完整的文件
+    // 先写到path.tmp，finish成功后才改名替换path：写失败不会毁掉原来的文件，
+    // 正在映射原文件浏览的一方(服务端打开的会话)也不会因为文件被截短收到SIGBUS
+    class writer {
+    public:
+        writer() = default;
+        writer(writer const&) = delete;
+        writer& operator=(writer const&) = delete;
+        // 没有finish成功就丢掉临时文件
+        ~writer() {
+            discard();
+        }
+
+        bool create(std::string const& path, std::error_code& ec) {
+            discard();
+            m_path = path;
+            m_temp_path = path + ".tmp";
+            m_file = mapped_file::create(m_temp_path, ec);
+            if (ec) {
+                m_temp_path.clear();
+                return false;
+            }
+            char head[FILE_HEADER_SIZE] = {};
+            detail::store_be(head, MAGIC, 4);
+            detail::store_be(head + 4, VERSION, 4);
+            m_end = 0;
+            m_index.clear();
+            m_records.clear();
+            return write(bytes_const_view{ head, sizeof(head) }, ec);
+        }
+
+        // content不为0时，content相同的快照只写一条记录(服务端传SnapshotStore的编号)
+        bool append(brep_frame const& frame, uint64_t connection, int64_t timestamp_us, uint64_t content, std::error_code& ec) {
+            index_entry entry;
+            entry.m_size = frame.payload().size();
+            entry.m_digest = frame.m_digest;
+            entry.m_timestamp_us = timestamp_us;
+            entry.m_connection = connection;
+            entry.m_encoding = frame.m_encoding;
+            entry.m_flags = frame.m_flags;
+            auto written = content != 0 ? m_records.find(content) : m_records.end();
+            if (written != m_records.end()) {
+                entry.m_offset = written->second;
+            }
+            else {
+                entry.m_offset = m_end;
+                char head[RECORD_HEADER_SIZE];
+                encode_record_header(head, frame);
+                if (!write(bytes_const_view{ head, sizeof(head) }, ec) || !write(frame.payload(), ec))
+                    return false;
+                if (content != 0)
+                    m_records.emplace(content, entry.m_offset);
+            }
+            m_index.push_back(entry);
+            return true;
+        }
+
+        // 写索引和尾部，关闭文件，替换掉目标文件
+        bool finish(std::error_code& ec) {
+            uint64_t index_offset = m_end;
+            std::vector<char> index(m_index.size() * INDEX_ENTRY_SIZE);
+            for (size_t i = 0; i < m_index.size(); ++i)
+                m_index[i].encode(index.data() + i * INDEX_ENTRY_SIZE);
+            char trailer[TRAILER_SIZE] = {};
+            detail::store_be(trailer, index_offset, 8);
+            detail::store_be(trailer + 8, m_index.size(), 8);
+            detail::store_be(trailer + 24, INDEX_MAGIC, 4);
+            detail::store_be(trailer + 28, VERSION, 4);
+            bool ok = write(bytes_const_view{ index.data(), index.size() }, ec) && write(bytes_const_view{ trailer, sizeof(trailer) }, ec);
+            m_file.close();
+            if (!ok || !mapped_file::replace(m_temp_path, m_path, ec)) {
+                discard();
+                return false;
+            }
+            m_temp_path.clear();
+            return true;
+        }
+
+        size_t count() const noexcept {
+            return m_index.size();
+        }
+
+    private:
+        bool write(bytes_const_view data, std::error_code& ec) {
+            if (!m_file.write_at(m_end, data, ec))
+                return false;
+            m_end += data.size();
+            return true;
+        }
+
+        void discard() noexcept {
+            m_file.close();
+            if (!m_temp_path.empty())
+                mapped_file::remove(m_temp_path);
+            m_temp_path.clear();
+        }
+
+        std::string m_path;
+        std::string m_temp_path; // 还没替换目标文件时不为空
+        mapped_file m_file;
+        uint64_t m_end = 0;
+        std::vector<index_entry> m_index;
+        std::unordered_map<uint64_t, uint64_t> m_records; // content -> 记录位置
+    };
+
+    // 打开一个会话文件，只读尾部和索引；多GB的文件也是立即打开
+    class reader {
+    public:
+        bool open(std::string const& path, std::error_code& ec) {
+            m_entries.clear();
+            m_file = std::make_shared<mapped_file>(mapped_file::open_read(path, ec));
+            if (ec)
+                return false;
+            uint64_t size = m_file->size(ec);
+            if (ec)
+                return false;
+            auto bad = [&ec] {
+                ec = std::make_error_code(std::errc::illegal_byte_sequence);
+                return false;
+            };
+            if (size < FILE_HEADER_SIZE + TRAILER_SIZE)
+                return bad();
+
+            auto head = m_file->map(0, FILE_HEADER_SIZE, ec);
+            if (!head)
+                return false;
+            if (detail::load_be(head->view().data(), 4) != MAGIC || detail::load_be(head->view().data() + 4, 4) != VERSION)
+                return bad();
+
+            auto tail = m_file->map(size - TRAILER_SIZE, TRAILER_SIZE, ec);
+            if (!tail)
+                return false;
+            char const* trailer = tail->view().data();
+            uint64_t index_offset = detail::load_be(trailer, 8);
+            uint64_t count = detail::load_be(trailer + 8, 8);
+            if (detail::load_be(trailer + 24, 4) != INDEX_MAGIC || detail::load_be(trailer + 28, 4) != VERSION
+                || index_offset < FILE_HEADER_SIZE || count > (size - TRAILER_SIZE - index_offset) / INDEX_ENTRY_SIZE
+                || index_offset + count * INDEX_ENTRY_SIZE + TRAILER_SIZE != size)
+                return bad();
+
+            if (count > 0) {
+                auto index = m_file->map(index_offset, static_cast<size_t>(count * INDEX_ENTRY_SIZE), ec);
+                if (!index)
+                    return false;
+                m_entries.reserve(static_cast<size_t>(count));
+                for (uint64_t i = 0; i < count; ++i) {
+                    index_entry entry = index_entry::decode(index->view().data() + i * INDEX_ENTRY_SIZE);
+                    // 记录要完整地落在数据区里，坏的索引在打开时就报出来，而不是浏览到一半
+                    if (entry.m_offset < FILE_HEADER_SIZE || entry.m_offset > index_offset
+                        || index_offset - entry.m_offset < RECORD_HEADER_SIZE
+                        || index_offset - entry.m_offset - RECORD_HEADER_SIZE < entry.m_size)
+                        return bad();
+                    m_entries.push_back(entry);
+                }
+            }
+            ec.clear();
+            return true;
+        }
+
+        std::vector<index_entry> const& entries() const noexcept {
+            return m_entries;
+        }
+
+        // 映射第i个快照的负载
+        brep_frame_ptr load(size_t i, std::error_code& ec) const {
+            return load_record(*m_file, m_entries[i].m_offset, m_entries[i].m_size, ec);
+        }
+
+        // 打开的文件(只读)，以后还要映射别的记录时留着它；已经映射出去的帧不依赖它
+        std::shared_ptr<mapped_file> file() const noexcept {
+            return m_file;
+        }
+
+    private:
+        std::shared_ptr<mapped_file> m_file;
+        std::vector<index_entry> m_entries;
+    };
+}
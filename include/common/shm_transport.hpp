@@ -0,0 +1,210 @@
+﻿#pragma once
+
+// 同机的共享内存传输(只在Linux上有)：客户端和服务端之间是一条AF_UNIX SOCK_SEQPACKET连接，每条消息是一帧
+// 消息的开头是和TCP上一样的16字节帧头；小负载直接跟在帧头后面，大负载写进一个单独的memfd共享内存段，
+// 段的描述符随消息一起传过去(SCM_RIGHTS)，接收端只读映射之后直接把映射当作负载，不经过内核拷贝，也不用重新拼接
+// 段在发送前加上封印(不能再写、不能改大小)，接收端只收封好的段：发送端事后既改不了服务端正在用的数据，
+// 也没法把段截短让服务端读映射时收到SIGBUS
+// 每帧一个段而不是一个循环缓冲区：服务端的快照历史会一直引用收到的帧，循环缓冲区里的位置没法按时回收
+// 消息本身就是门铃，连接和TCP连接一样交给同一个Reactor等待
+
+#if defined(__linux__)
+
+#include "common/bytes_buffer.hpp"
+#include "common/content_hash.hpp"
+#include "common/frame_header.hpp"
+#include "common/lz_codec.hpp"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+
+namespace shm_transport {
+    // 负载不超过这个大小时直接放在消息里，建段和映射的开销比拷贝这点数据还大
+    constexpr size_t INLINE_LIMIT = 32 * 1024;
+    constexpr size_t MAX_MESSAGE = frame_header::SIZE + INLINE_LIMIT;
+
+    // 抽象命名空间里的地址，不在文件系统里留下文件，进程退出后自动消失
+    inline socklen_t make_address(std::string const& name, sockaddr_un& addr) noexcept {
+        static constexpr char PREFIX[] = "geomdebug-shm/";
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        size_t len = sizeof(PREFIX) - 1 + name.size();
+        if (len > sizeof(addr.sun_path) - 1)
+            len = sizeof(addr.sun_path) - 1;
+        std::string path = PREFIX + name;
+        std::memcpy(addr.sun_path + 1, path.data(), len); // sun_path[0]为0表示抽象命名空间
+        return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 + len);
+    }
+
+    // 发送端必须加上的封印，少一个接收端就拒收
+    constexpr int REQUIRED_SEALS = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+
+    // 建一个允许封印的匿名共享内存段，只有描述符；失败返回-1，errno说明原因
+    inline int create_segment(size_t size) noexcept {
+        int fd = memfd_create("geomdebug-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0)
+            return -1;
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        return fd;
+    }
+
+    // 发出一帧，负载大时先拷进新建的共享内存段；成功返回true，失败时errno说明原因
+    inline bool send_frame(int sock, frame_header const& header, bytes_const_view payload) noexcept {
+        char head[frame_header::SIZE];
+        header.encode(head);
+
+        iovec parts[2] = { { head, sizeof(head) }, { const_cast<char*>(payload.data()), payload.size() } };
+        msghdr msg{};
+        msg.msg_iov = parts;
+        msg.msg_iovlen = 2;
+
+        int segment = -1;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+        if (payload.size() > INLINE_LIMIT) {
+            segment = create_segment(payload.size());
+            if (segment < 0)
+                return false;
+            void* map = mmap(nullptr, payload.size(), PROT_WRITE, MAP_SHARED, segment, 0);
+            if (map == MAP_FAILED) {
+                int err = errno;
+                close(segment);
+                errno = err;
+                return false;
+            }
+            std::memcpy(map, payload.data(), payload.size());
+            munmap(map, payload.size()); // 还有可写映射时加不上F_SEAL_WRITE
+            if (fcntl(segment, F_ADD_SEALS, REQUIRED_SEALS | F_SEAL_SEAL) != 0) {
+                int err = errno;
+                close(segment);
+                errno = err;
+                return false;
+            }
+
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            std::memcpy(CMSG_DATA(cmsg), &segment, sizeof(int));
+        }
+
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        int err = errno;
+        if (segment >= 0)
+            close(segment); // 接收端收到的是它自己的描述符
+        errno = err;
+        return sent >= 0;
+    }
+
+    // 只读映射的共享内存段，最后一个引用它的帧释放时解除映射
+    class segment_mapping {
+    public:
+        segment_mapping(void* data, size_t size) noexcept : m_data(data), m_size(size) {}
+        ~segment_mapping() {
+            munmap(m_data, m_size);
+        }
+        segment_mapping(segment_mapping const&) = delete;
+        segment_mapping& operator=(segment_mapping const&) = delete;
+
+        bytes_const_view view() const noexcept {
+            return bytes_const_view{ static_cast<char const*>(m_data), m_size };
+        }
+
+    private:
+        void* m_data;
+        size_t m_size;
+    };
+
+    enum class recv_status {
+        frame,       // 收到一帧
+        would_block, // 暂时没有消息
+        closed,      // 对端关闭
+        bad,         // 消息不合法，连接上的数据已经没法用了
+        error,       // 系统调用出错，errno说明原因
+    };
+
+    // 收一条消息还原成一帧；scratch至少MAX_MESSAGE字节，小负载从这里拷出来，大负载直接映射共享内存段
+    inline recv_status recv_frame(int sock, bytes_view scratch, brep_frame& out) {
+        iovec part{ scratch.data(), scratch.size() };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+        msghdr msg{};
+        msg.msg_iov = &part;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t n = recvmsg(sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? recv_status::would_block : recv_status::error;
+        if (n == 0)
+            return recv_status::closed;
+
+        int segment = -1;
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+                std::memcpy(&segment, CMSG_DATA(cmsg), sizeof(int));
+        }
+        std::unique_ptr<int, void (*)(int*)> segment_guard(segment >= 0 ? &segment : nullptr, [](int* fd) { close(*fd); });
+
+        frame_header header;
+        if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || static_cast<size_t>(n) < frame_header::SIZE
+            || !frame_header::is_versioned(scratch.data()) || !frame_header::decode(scratch.data(), header))
+            return recv_status::bad;
+
+        size_t size = static_cast<size_t>(header.m_payload_size);
+        out = brep_frame{};
+        out.m_encoding = header.m_encoding;
+        out.m_flags = header.m_flags;
+        if (segment < 0) {
+            if (static_cast<size_t>(n) != frame_header::SIZE + size)
+                return recv_status::bad;
+            out.m_payload.assign(scratch.data() + frame_header::SIZE, size);
+        }
+        else {
+            struct stat st;
+            int seals = fcntl(segment, F_GET_SEALS);
+            if (static_cast<size_t>(n) != frame_header::SIZE || seals < 0 || (seals & REQUIRED_SEALS) != REQUIRED_SEALS
+                || fstat(segment, &st) != 0
+                || static_cast<uint64_t>(st.st_size) < size || size == 0)
+                return recv_status::bad;
+            void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, segment, 0);
+            if (map == MAP_FAILED)
+                return recv_status::error;
+            auto mapping = std::make_shared<const segment_mapping>(map, size);
+            out.m_view = mapping->view();
+            out.m_storage = std::move(mapping);
+        }
+
+        // 发送端一般不压缩，压缩了的话在这里解开
+        if (header.m_flags & frame_flag_compressed) {
+            lz::stream_decoder inflater(frame_header::MAX_PAYLOAD_SIZE);
+            bytes_const_view packed = out.payload();
+            if (!inflater.consume(packed.data(), packed.size()) || !inflater.finished())
+                return recv_status::bad;
+            out.m_payload = inflater.take();
+            out.m_storage.reset();
+            out.m_flags = static_cast<uint16_t>(header.m_flags & ~frame_flag_compressed);
+        }
+        out.m_digest = content_hash(out.payload());
+        return recv_status::frame;
+    }
+}
+
+#endif
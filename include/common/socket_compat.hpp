@@ -0,0 +1,241 @@
+﻿#pragma once
+
+// 对WinSock和POSIX socket做一层薄封装，Server和Client只通过这里访问平台相关的接口
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <WinSock2.h>
+#include <ws2tcpip.h>
+#include <Windows.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <cerrno>
+
+using SOCKET = int;
+constexpr SOCKET INVALID_SOCKET = -1;
+constexpr int SOCKET_ERROR = -1;
+#ifndef NO_ERROR
+#define NO_ERROR 0
+#endif
+
+inline int closesocket(SOCKET s) {
+    return ::close(s);
+}
+#endif
+
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <system_error>
+
+#include "common/bytes_buffer.hpp"
+#include "common/utf8_system_category.hpp"
+
+inline int last_socket_error() noexcept {
+#if defined(_WIN32)
+    return WSAGetLastError();
+#else
+    return errno;
+#endif
+}
+
+inline bool is_would_block(int err) noexcept {
+#if defined(_WIN32)
+    return err == WSAEWOULDBLOCK;
+#else
+    return err == EAGAIN || err == EWOULDBLOCK;
+#endif
+}
+
+// 把socket切换到非阻塞模式，失败返回SOCKET_ERROR
+inline int set_non_blocking(SOCKET s) noexcept {
+#if defined(_WIN32)
+    u_long mode = 1;
+    return ioctlsocket(s, FIONBIO, &mode) == NO_ERROR ? NO_ERROR : SOCKET_ERROR;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0)
+        return SOCKET_ERROR;
+    return fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0 ? NO_ERROR : SOCKET_ERROR;
+#endif
+}
+
+// 切回阻塞模式，失败返回SOCKET_ERROR
+inline int set_blocking(SOCKET s) noexcept {
+#if defined(_WIN32)
+    u_long mode = 0;
+    return ioctlsocket(s, FIONBIO, &mode) == NO_ERROR ? NO_ERROR : SOCKET_ERROR;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0)
+        return SOCKET_ERROR;
+    return fcntl(s, F_SETFL, flags & ~O_NONBLOCK) == 0 ? NO_ERROR : SOCKET_ERROR;
+#endif
+}
+
+// 非阻塞地connect，最多等timeout，每隔一小段时间问一次cancelled()，返回true就放弃；
+// 成功时socket切回阻塞模式并返回0，否则返回错误码，超时或放弃时是ETIMEDOUT/WSAETIMEDOUT
+template<typename Cancelled>
+int connect_with_timeout(SOCKET s, sockaddr const* addr, socklen_t len, std::chrono::milliseconds timeout, Cancelled cancelled) {
+#if defined(_WIN32)
+    constexpr int IN_PROGRESS = WSAEWOULDBLOCK;
+    constexpr int TIMED_OUT = WSAETIMEDOUT;
+#else
+    constexpr int IN_PROGRESS = EINPROGRESS;
+    constexpr int TIMED_OUT = ETIMEDOUT;
+#endif
+    constexpr auto SLICE = std::chrono::milliseconds(100);
+
+    if (set_non_blocking(s) == SOCKET_ERROR)
+        return last_socket_error();
+    if (connect(s, addr, len) == SOCKET_ERROR) {
+        int err = last_socket_error();
+        if (err != IN_PROGRESS && !is_would_block(err))
+            return err;
+
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (true) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (left.count() <= 0 || cancelled())
+                return TIMED_OUT;
+            auto wait = left < SLICE ? left : SLICE;
+#if defined(_WIN32)
+            // WSAPoll在老版本Windows上不报告connect失败，这里用select
+            fd_set writable, failed;
+            FD_ZERO(&writable);
+            FD_ZERO(&failed);
+            FD_SET(s, &writable);
+            FD_SET(s, &failed);
+            timeval tv{ static_cast<long>(wait.count() / 1000), static_cast<long>(wait.count() % 1000 * 1000) };
+            int n = select(0, nullptr, &writable, &failed, &tv);
+#else
+            pollfd p{};
+            p.fd = s;
+            p.events = POLLOUT;
+            int n = poll(&p, 1, static_cast<int>(wait.count()));
+            if (n < 0 && errno == EINTR)
+                continue;
+#endif
+            if (n < 0)
+                return last_socket_error();
+            if (n > 0)
+                break;
+        }
+
+        int so_error = 0;
+        socklen_t so_len = sizeof(so_error);
+        if (getsockopt(s, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&so_error), &so_len) == SOCKET_ERROR)
+            return last_socket_error();
+        if (so_error != 0)
+            return so_error;
+    }
+    return set_blocking(s) == SOCKET_ERROR ? last_socket_error() : 0;
+}
+
+// 关掉Nagle算法，小帧头和负载不会因为等ACK而被攒着不发
+inline int set_no_delay(SOCKET s) noexcept {
+    int on = 1;
+    return setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char const*>(&on), sizeof(on));
+}
+
+#if !defined(_WIN32)
+// 文件系统里的AF_UNIX地址，路径放不进sun_path时返回0
+inline socklen_t make_unix_address(std::string const& path, sockaddr_un& addr) noexcept {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        return 0;
+    std::memcpy(addr.sun_path, path.data(), path.size());
+    return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size() + 1);
+}
+#endif
+
+constexpr size_t MAX_SEND_PARTS = 8;
+
+// 一次系统调用发出多段数据(POSIX上是sendmsg，Windows上是WSASend)，返回实际发出的字节数，出错返回SOCKET_ERROR
+// 最多MAX_SEND_PARTS段，每次最多发1GB，调用方要自己处理只发出一部分的情况
+inline long long send_vectored(SOCKET s, bytes_const_view const* parts, size_t count) noexcept {
+    constexpr size_t MAX_CHUNK = size_t(1) << 30;
+    if (count > MAX_SEND_PARTS)
+        count = MAX_SEND_PARTS;
+    size_t total = 0;
+#if defined(_WIN32)
+    WSABUF buffers[MAX_SEND_PARTS];
+    DWORD n = 0;
+    for (; n < count && total < MAX_CHUNK; ++n) {
+        size_t len = parts[n].size() < MAX_CHUNK - total ? parts[n].size() : MAX_CHUNK - total;
+        buffers[n].buf = const_cast<char*>(parts[n].data());
+        buffers[n].len = static_cast<ULONG>(len);
+        total += len;
+    }
+    DWORD sent = 0;
+    if (WSASend(s, buffers, n, &sent, 0, nullptr, nullptr) == SOCKET_ERROR)
+        return SOCKET_ERROR;
+    return static_cast<long long>(sent);
+#else
+    iovec buffers[MAX_SEND_PARTS];
+    size_t n = 0;
+    for (; n < count && total < MAX_CHUNK; ++n) {
+        size_t len = parts[n].size() < MAX_CHUNK - total ? parts[n].size() : MAX_CHUNK - total;
+        buffers[n].iov_base = const_cast<char*>(parts[n].data());
+        buffers[n].iov_len = len;
+        total += len;
+    }
+    msghdr msg{};
+    msg.msg_iov = buffers;
+    msg.msg_iovlen = n;
+#ifdef MSG_NOSIGNAL
+    ssize_t sent = sendmsg(s, &msg, MSG_NOSIGNAL);
+#else
+    ssize_t sent = sendmsg(s, &msg, 0);
+#endif
+    if (sent < 0)
+        return SOCKET_ERROR;
+    return static_cast<long long>(sent);
+#endif
+}
+
+// 进程级的网络初始化：Windows上是WSAStartup/WSACleanup，POSIX上屏蔽SIGPIPE
+class socket_context {
+public:
+    socket_context() {
+#if defined(_WIN32)
+        WSADATA wsa_data;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+            auto ec = std::error_code(WSAGetLastError(), utf8_system_category());
+            std::cerr << ec.message();
+            throw std::system_error(ec, "WSAStartup");
+        }
+#else
+        signal(SIGPIPE, SIG_IGN); // 对端关闭后send返回EPIPE，而不是直接杀掉进程
+#endif
+    }
+
+    ~socket_context() {
+#if defined(_WIN32)
+        WSACleanup();
+#endif
+    }
+
+    socket_context(socket_context const&) = delete;
+    socket_context& operator=(socket_context const&) = delete;
+};
@@ -19,6 +19,7 @@ using boost::locale::conv::to_utf;
 //    return instance;
 //}
 
+#ifdef _MSC_VER
 inline std::error_category const& utf8_system_category() {
 	static struct final : std::_System_error_category {
 		std::string message(int err) const override {
@@ -27,6 +28,12 @@ inline std::error_category const& utf8_system_category() {
 	} instance;
 	return instance;
 }
+#else
+// 非MSVC平台上系统错误信息本身就是UTF-8
+inline std::error_category const& utf8_system_category() {
+	return std::system_category();
+}
+#endif
 
 //class utf8_system_category : public std::error_category {
 //public:
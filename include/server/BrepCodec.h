@@ -0,0 +1,36 @@
+﻿#ifndef BREP_CODEC_H
+#define BREP_CODEC_H
+
+#include "common/bytes_buffer.hpp"
+#include "common/frame_header.hpp"
+
+#include <Message_ProgressIndicator.hxx>
+#include <Message_ProgressRange.hxx>
+#include <TopoDS_Shape.hxx>
+
+#include <functional>
+#include <utility>
+
+// 只用来取消的进度指示器：OCCT读取和剖分时会不停地询问UserBreak，返回true就尽快退出
+class CancellableProgress : public Message_ProgressIndicator
+{
+public:
+	explicit CancellableProgress(std::function<bool()> cancelled) : m_cancelled_(std::move(cancelled)) {}
+
+	Standard_Boolean UserBreak() override { return m_cancelled_(); }
+	void Show(const Message_ProgressScope&, const Standard_Boolean) override {}
+
+private:
+	std::function<bool()> m_cancelled_;
+};
+
+// 按帧里声明的编码把负载还原成形状，数据损坏或者被取消时返回空形状
+TopoDS_Shape decodeBrepPayload(payload_encoding encoding, bytes_const_view payload,
+	const Message_ProgressRange& progress = Message_ProgressRange());
+
+inline TopoDS_Shape decodeBrepFrame(brep_frame const& frame, const Message_ProgressRange& progress = Message_ProgressRange())
+{
+	return decodeBrepPayload(frame.m_encoding, frame.payload(), progress);
+}
+
+#endif
@@ -0,0 +1,107 @@
+﻿#ifndef CONNECTION_REGISTRY_H
+#define CONNECTION_REGISTRY_H
+
+#include "common/SnapshotCell.hpp"
+#include "common/frame_decoder.hpp"
+#include "common/socket_compat.hpp"
+#include "server/ShapeCache.h"
+#include "server/SnapshotStore.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// 一个客户端连接；解码器和快照历史只由这个连接的任务(串行执行)读写
+struct ConnectionInfo
+{
+	SOCKET m_id;
+	uint64_t m_serial = 0; // 连接的序号，用作快照缓存的键
+	std::string m_peer;    // 对端地址，显示在连接列表里
+	frame_decoder m_decoder;
+	// 共享内存连接一条消息就是一帧，不经过m_decoder；小负载先收进m_shm_scratch
+	bool m_shared_memory = false;
+	bytes_buffer m_shm_scratch;
+
+	int m_data_index = 0;
+	std::vector<SnapshotRef> m_brep_data_list; // 负载都在SnapshotStore里，内容相同的快照共用一份
+	std::vector<int64_t> m_receive_times;      // 和m_brep_data_list一一对应，收到的时间(Unix时间，微秒)，存会话文件用
+
+	// 返回的是负载的视图，不拷贝：还在内存里的直接共享，已经写进会话日志的只读映射回来；没有快照时为空
+	brep_frame_ptr getCurrentBrepData(){
+		if(m_data_index >= 0 && m_data_index < static_cast<int>(m_brep_data_list.size()))
+			return m_brep_data_list.at(m_data_index)->frame();
+		else
+			return {};
+	}
+
+	SnapshotKey getKey(int index) const {
+		if(index >= 0 && index < static_cast<int>(m_brep_data_list.size()))
+			return SnapshotKey{ m_serial, index, m_brep_data_list[index]->content() };
+		return SnapshotKey{ m_serial, -1 };
+	}
+
+	SnapshotKey getCurrentKey() const {
+		return getKey(m_data_index);
+	}
+
+	void setCurrentIndexToLatest(){
+		m_data_index = m_brep_data_list.size() - 1;
+	}
+};
+
+// 连接的句柄，连接从表里删掉之后拿着句柄的任务仍然可以安全地用完
+using ConnectionHandle = std::shared_ptr<ConnectionInfo>;
+
+// 连接列表里的一行
+struct ConnectionSummary
+{
+	SOCKET m_id = INVALID_SOCKET;
+	uint64_t m_serial = 0;
+	std::string m_peer;
+};
+
+// 按socket分片的连接表，每个分片一把读写锁，不同连接的接收任务查表时互不争用；
+// 显示流水线要的当前连接和GUI要的连接列表都通过SnapshotCell整体发布，读的时候不加锁(wait-free)；
+// std::atomic_load(shared_ptr)在libstdc++里其实是按地址散列的全局互斥锁，所以不用它
+class ConnectionRegistry
+{
+public:
+	static constexpr size_t SHARD_COUNT = 16;
+
+	ConnectionHandle find(SOCKET id) const;
+	ConnectionHandle add(SOCKET id, uint64_t serial, std::string peer);
+	// 返回被删掉的连接，不存在时为空；删掉的是当前连接时当前连接置空
+	ConnectionHandle remove(SOCKET id);
+
+	ConnectionHandle current() const;
+	// 任务的affinity()要的只是socket，不用拿句柄
+	SOCKET currentId() const noexcept { return m_current_id_.load(std::memory_order_acquire); }
+	void setCurrent(ConnectionHandle connection);
+
+	// 只在连接增删时整体替换的不可变列表，按连接的先后排列
+	std::shared_ptr<const std::vector<ConnectionSummary>> list() const;
+
+private:
+	struct Shard
+	{
+		mutable std::shared_mutex m_mtx;
+		std::unordered_map<SOCKET, ConnectionHandle> m_connections;
+	};
+
+	Shard& shardOf(SOCKET id) const noexcept;
+
+	mutable std::array<Shard, SHARD_COUNT> m_shards_;
+	std::mutex m_current_mtx_; // 串行化当前连接的修改，读的一方不用
+	SnapshotCell<ConnectionHandle> m_current_; // 连接切换不频繁，多包一层换来读的一方wait-free
+	std::atomic<SOCKET> m_current_id_ = INVALID_SOCKET;
+	std::mutex m_list_mtx_; // 串行化列表的替换，读的一方不用
+	SnapshotCell<std::vector<ConnectionSummary>> m_list_;
+};
+
+#endif
@@ -0,0 +1,44 @@
+﻿#ifndef DRAW_NOTIFIER_H
+#define DRAW_NOTIFIER_H
+
+#include "server/Task.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+
+// 显示流水线(BrepDataSetTask→解析→剖分→WaitingDrawTask)的唤醒
+// 要显示的内容可能变了(收到新快照、切换连接、前进后退、GUI画完)时notify()把代数加一；
+// 流水线没事可做时把自己停在这里，不再反复提交自己，空闲时不占CPU，notify时把停着的任务交给调用方提交
+class DrawNotifier
+{
+public:
+	uint64_t generation() const noexcept {
+		return m_generation_.load(std::memory_order_acquire);
+	}
+
+	// seen之后没有新的通知时停下task并返回true；已经有新通知时返回false，调用方接着跑
+	bool park(TaskPtr task, uint64_t seen) {
+		std::unique_lock lck(m_mtx_);
+		if (m_generation_.load(std::memory_order_relaxed) != seen) {
+			return false;
+		}
+		m_parked_ = std::move(task);
+		return true;
+	}
+
+	// 返回停着的任务，没有时为空
+	TaskPtr notify() {
+		std::unique_lock lck(m_mtx_);
+		m_generation_.fetch_add(1, std::memory_order_release);
+		return std::exchange(m_parked_, TaskPtr());
+	}
+
+private:
+	std::mutex m_mtx_;
+	std::atomic<uint64_t> m_generation_ = 0;
+	TaskPtr m_parked_;
+};
+
+#endif
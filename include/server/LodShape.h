@@ -0,0 +1,36 @@
+﻿#ifndef LOD_SHAPE_H
+#define LOD_SHAPE_H
+
+#include <AIS_Shape.hxx>
+#include <PrsMgr_PresentationManager.hxx>
+#include <Prs3d_Presentation.hxx>
+
+// 带两个细节层级的AIS_Shape：普通的显示模式用精细网格(myshape)，COARSE_MODE_OFFSET+模式用粗糙网格
+// 两个层级的显示数据都由PrsMgr缓存，旋转时切换显示模式不需要重新计算；精细网格到了之后用Set+Redisplay原地替换
+class LodShape : public AIS_Shape
+{
+	DEFINE_STANDARD_RTTI_INLINE(LodShape, AIS_Shape)
+public:
+	static constexpr Standard_Integer COARSE_MODE_OFFSET = 10;
+
+	LodShape(const TopoDS_Shape& shape, const TopoDS_Shape& coarse) : AIS_Shape(shape), m_coarse_(coarse) {}
+
+	static Standard_Integer coarseMode(Standard_Integer mode) { return mode + COARSE_MODE_OFFSET; }
+
+	// 精细网格已经换上、两个层级确实不同时，旋转期间才值得切到粗糙层级
+	bool hasCoarseLevel() const { return !m_coarse_.IsNull() && !m_coarse_.IsEqual(myshape); }
+
+	Standard_Boolean AcceptDisplayMode(const Standard_Integer mode) const override {
+		return AIS_Shape::AcceptDisplayMode(mode % COARSE_MODE_OFFSET);
+	}
+
+protected:
+	void Compute(const Handle(PrsMgr_PresentationManager)& manager,
+		const Handle(Prs3d_Presentation)& presentation,
+		const Standard_Integer mode) override;
+
+private:
+	TopoDS_Shape m_coarse_;
+};
+
+#endif
@@ -3,9 +3,12 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
+#include <QListWidget>
 #include "OCCTViewer.h"
 #include "Server.h"
 
+#include <memory>
+
 class MainWindow : public QMainWindow
 {
     Q_OBJECT
@@ -14,9 +17,16 @@ public:
     MainWindow(QWidget* parent = nullptr);
     ~MainWindow() override = default;
 
+    // 打开一个会话文件浏览，也可以在命令行上给出
+    void openSession(const QString& path);
+
 private:
+    // 按服务端的连接列表重建左侧的列表，当前连接处于选中状态
+    void refreshConnections();
+
     OcctViewer* m_occt_viewer_;
-    MyServer* m_server_;
+    QListWidget* m_connection_list_;
+    std::unique_ptr<MyServer> m_server_; // 先于子窗口析构，停下worker之后不会再有通知
 };
 
 #endif // MAINWINDOW_H
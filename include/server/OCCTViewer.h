@@ -7,6 +7,14 @@
 #include <AIS_InteractiveContext.hxx>
 #include <V3d_View.hxx>
 
+#include "server/LodShape.h"
+#include "server/ShapeCache.h"
+
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
 class OcctViewer : public QWidget
 {
     Q_OBJECT
@@ -16,9 +24,15 @@ public:
 
     Handle(AIS_InteractiveContext) getContext() const { return mContext; }
     void drawBrepData();
+    // 正在显示的快照的精细网格算好了就原地替换
+    void onShapeRefined();
 
 signals:
     void initialized();
+    // 交过来的快照处理完了，显示流水线可以接着准备下一个
+    void snapshotDrawn();
+    // 显示了一个快照，带上它解析和剖分的耗时
+    void statusMessage(const QString& message);
 
 protected:
     // 重写 QWidget 的事件处理方法
@@ -37,11 +51,38 @@ protected:
         return nullptr;// 返回nullptr，告诉 Qt 不使用它自己的绘图引擎
     }
 private:
+    // 不再显示的部分留着显示数据，前进后退时直接拿回来用；形状缓存淘汰了的条目只要部分还留在这里，网格就还占着内存，
+    // 所以单独限制：估算的字节数最多是形状缓存预算的1/HIDDEN_BUDGET_SHARE，个数最多HIDDEN_PART_LIMIT
+    static constexpr size_t HIDDEN_BUDGET_SHARE = 4;
+    static constexpr size_t HIDDEN_PART_LIMIT = 4096;
+
+    // 一个部分的AIS对象，以及它的显示数据估算占的字节数
+    struct PartPresentation {
+        Handle(LodShape) m_shape;
+        size_t m_cost = 0;
+    };
+
+    void updateScene(const std::vector<ScenePart>& parts);
+    // 显示的还是粗糙网格、part已经有精细网格时换上，返回是否换了
+    bool refinePart(PartPresentation& shown, const ScenePart& part);
+    void hidePart(uint64_t hash, PartPresentation part);
+    PartPresentation takeHidden(uint64_t hash);
+    void showTiming(const SnapshotTiming& timing);
+    // 旋转结束或者换了快照时，把临时切到粗糙层级的部分换回默认的显示模式
+    void restoreFineLevel();
+
     Handle(V3d_Viewer) mViewer;
     Handle(V3d_View) mView;
     Handle(AIS_InteractiveContext) mContext;
 
     QPoint mLastMousePos;
+    std::unordered_map<uint64_t, PartPresentation> mScene; // 正在显示的部分，按ScenePart::m_hash索引
+    std::list<std::pair<uint64_t, PartPresentation>> mHidden; // 隐藏了但还留着显示数据的部分，最近隐藏的在前
+    std::unordered_map<uint64_t, std::list<std::pair<uint64_t, PartPresentation>>::iterator> mHiddenIndex;
+    size_t mHiddenBytes = 0;
+    std::vector<Handle(LodShape)> mCoarseParts; // 旋转期间切到粗糙层级的部分
+    SnapshotKey mDisplayedKey;
+    uint64_t mCoalesced = 0; // 总是显示最新时累计跳过的快照数
 };
 
 #endif // OCCTVIEWER_H
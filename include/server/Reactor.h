@@ -0,0 +1,43 @@
+﻿#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "common/socket_compat.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+
+// 基于就绪通知的事件循环：Linux上用epoll，其它平台退化为poll/WSAPoll
+// 所有socket都以"一次性"方式关注可读事件，任务处理到EWOULDBLOCK后再调用rearm重新关注
+class Reactor {
+public:
+	Reactor();
+	~Reactor();
+	Reactor(Reactor const&) = delete;
+	Reactor& operator=(Reactor const&) = delete;
+
+	void watch(SOCKET fd);
+	void rearm(SOCKET fd);
+	void unwatch(SOCKET fd);
+
+	// 阻塞直到有socket可读、被wakeup唤醒或超时(timeout_ms < 0 表示一直等)，返回就绪的socket
+	size_t wait(std::vector<SOCKET>& ready_list, int timeout_ms);
+	void wakeup();
+
+private:
+#if defined(__linux__)
+	int m_epoll_fd_ = -1;
+	int m_wakeup_fd_ = -1;
+#else
+	// 关注的集合变了或者要退出时打断正在进行的poll
+	void interrupt();
+
+	std::mutex m_mtx_;
+	std::unordered_map<SOCKET, bool> m_armed_;
+	std::atomic<bool> m_wakeup_ = false;
+	std::atomic<SOCKET> m_wakeup_socket_ = INVALID_SOCKET; // 写一个字节打断poll
+#endif
+};
+
+#endif
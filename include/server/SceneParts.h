@@ -0,0 +1,30 @@
+﻿#ifndef SCENE_PARTS_H
+#define SCENE_PARTS_H
+
+#include <TopoDS_Shape.hxx>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// 显示时把形状拆成若干部分，每部分一个AIS对象；相邻快照之间按几何哈希找出没变的部分，只增删变了的
+// 每个部分带两个层级：m_coarse是粗糙网格拓扑上的子形状，m_shape是目前最精细的(精细网格没算好之前就是m_coarse)
+struct ScenePart
+{
+	uint64_t m_hash = 0; // 几何和位置的哈希，和网格无关，同一快照里唯一
+	TopoDS_Shape m_shape;
+	TopoDS_Shape m_coarse;
+	size_t m_cost = 0; // 两个层级的网格和显示数据估算占的字节数
+};
+
+// 复合体逐层展开；面数不超过FACES_PER_PART的实体/壳整个作为一部分，更大的按遍历顺序每FACES_PER_PART个面一部分，
+// 大实体上改了几个面时只有它们所在的那几部分变化
+constexpr size_t FACES_PER_PART = 64;
+
+// 在worker上调用，哈希要把每部分的几何序列化一遍
+std::vector<ScenePart> splitScene(TopoDS_Shape const& shape);
+
+// fine是coarse的拓扑副本(copyTopology)，拆出来的顺序和coarse一致，按下标换上精细层级；结构对不上时返回false，保持原样
+bool assignFineParts(std::vector<ScenePart>& parts, TopoDS_Shape const& fine);
+
+#endif
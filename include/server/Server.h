@@ -3,89 +3,183 @@
 #define SERVER_H
 
 #include "common/bytes_buffer.hpp"
+#include "common/frame_decoder.hpp"
 #include "common/MTQueue.hpp"
+#include "common/SnapshotCell.hpp"
+#include "common/session_file.hpp"
+#include "common/socket_compat.hpp"
+#include "server/ConnectionRegistry.h"
+#include "server/DrawNotifier.h"
+#include "server/Reactor.h"
+#include "server/ShapeCache.h"
+#include "server/SnapshotStore.h"
+#include "server/TaskScheduler.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
 #include <unordered_map>
 
-#include <QObject>
-#include <AIS_InteractiveContext.hxx>
-
-#include <ws2tcpip.h>
-#include <WinSock2.h>
-#include <Windows.h>
-class Task;
+// 交给GUI线程显示的快照，形状已经在worker上解析并剖分好，GUI线程只负责显示；解析失败时条目为空
+// 条目和缓存里的是同一份，GUI线程按它的m_parts增量更新场景；精细网格算好后通过ServerEvents::m_shape_refined通知GUI线程替换
+struct DrawSnapshot {
+	SnapshotKey m_key;
+	ShapeCache::EntryPtr m_entry;
+	uint64_t m_coalesced = 0; // 到这个快照为止，总是显示最新时被跳过没有显示的快照数
+};
 
 inline auto& getCriticalSection() {
 	static struct CriticalSection {
 		std::atomic<bool> m_has_drawn = false;
 		std::atomic<bool> m_stop_server = false;
         std::atomic<bool> m_mode_draw_new = true;
-		MTObj<SOCKET> m_current_connetion_id;
-		MTObj<std::string> m_brep_data;
-        MTQueue<SOCKET> m_connection_list_to_delete;
-		MTQueue<std::shared_ptr<Task>> m_task_deque;
+		SnapshotCell<DrawSnapshot> m_brep_data; // 整体替换发布，读的一方不加锁也不拷贝
+		DrawNotifier m_draw_notifier;
+		std::atomic<uint64_t> m_coalesced_frames = 0;
+		SnapshotStore m_snapshot_store;
+		ShapeCache m_shape_cache;
+		MTObj<MeshSettings> m_mesh_settings;
 	} c;
     return c;
 }
 
-class MyServer : public QObject {
-    Q_OBJECT
-public:
-	MyServer(QObject* parent) : QObject(parent) { }
-    MyServer& operator=(MyServer&&) = delete;
-    ~MyServer() override;
+// 服务端状态变化的通知，在worker线程(或者调用onXxx的线程)上调用，GUI要自己转到GUI线程；没设置的不通知
+struct ServerEvents {
+	std::function<void()> m_draw_data_ready;
+	// 缓存里某个快照的精细网格算好了
+	std::function<void()> m_shape_refined;
+	// 有连接建立或断开，当前连接也可能变了
+	std::function<void()> m_connections_changed;
+	// 打开或保存会话文件的结果
+	std::function<void(std::string)> m_session_message;
+};
 
-	class WSAContext {
-	public:
-		WSAContext();
-		~WSAContext();
+// 接收、去重、保存快照，并把当前快照解析剖分好交给显示；不依赖Qt，GUI通过ServerEvents接收通知，
+// 没有窗口时(withoutDisplay)可以单独运行
+class MyServer {
+public:
+	MyServer() = default;
+	MyServer(const MyServer&) = delete;
+	MyServer& operator=(const MyServer&) = delete;
+	~MyServer();
+
+	// 累计的统计，stats()时汇总
+	struct Stats {
+		uint64_t m_connections = 0;        // 现在的连接数(含打开会话文件的离线连接)
+		uint64_t m_connections_total = 0;  // 累计建立过的连接数
+		SnapshotStore::Stats m_store;
+		uint64_t m_validated = 0;          // withValidation时解析过的不重复快照数
+		uint64_t m_invalid = 0;            // 其中解析失败的
+		uint64_t m_validate_pending = 0;   // 还在排队等解析的
+		double m_decode_ms_total = 0;
+		double m_decode_ms_max = 0;
 	};
 
-    struct ConnectionInfo
-    {
-		SOCKET m_id;
-        bytes_buffer m_reserve_buffer;
-
-        int m_data_index = 0;
-        std::vector<std::string> m_brep_data_list;
-
-		std::string getCurrentBrepData(){
-			if(m_data_index >= 0 && m_data_index < m_brep_data_list.size())
-				return m_brep_data_list.at(m_data_index);
-			else
-				return "";
-		}
-
-		void setCurrentIndexToLatest(){
-			m_data_index = m_brep_data_list.size() - 1;
-		}
-    };
-
-signals:
-    void sigDrawDataReady();
-
-public slots:
 	void onMovePreviousBrep();
+	// GUI线程画完了交过去的快照
+	void onSnapshotDrawn();
+	// 在连接列表里选了一个连接，按序号找，socket可能已经被新连接复用
+	void onSelectConnection(uint64_t serial);
 	void onMoveNextBrep();
 	void onUpdateMode(bool selected);
+	// 打开会话文件(见common/session_file.hpp)：只读索引，文件里的每个连接成为一个离线连接，快照浏览到时才映射
+	void onOpenSession(std::string path);
+	// 把当前连接收到的快照存成会话文件，作为该连接的任务写
+	void onSaveSession(std::string path);
 
 public:
     MyServer& withListenPort(std::string ip, std::string port);
+    // 同机客户端走共享内存(见common/shm_transport.hpp)，和TCP同时监听；只在Linux上有
+    MyServer& withSharedMemory(std::string name);
+    // 同机客户端走AF_UNIX流式连接，帧格式和TCP一样，和TCP同时监听；路径上残留的旧socket文件会先删掉，Windows上不支持
+    MyServer& withUnixSocket(std::string path);
+    MyServer& withWorkerCount(size_t count);
+    // 剖分精度，GUI上AIS的显示精度也用这一套
+    MyServer& withMeshing(MeshSettings settings);
+    // 已解析形状缓存的内存预算，以及前进后退时预取前后各几个快照
+    MyServer& withShapeCache(size_t budget_bytes, int prefetch_radius = ShapeCache::DEFAULT_PREFETCH_RADIUS);
+    // 快照负载在内存里最多占ram_budget字节，更早的写进path处的临时会话日志，导航时再映射回来；不调用时全部留在内存里
+    MyServer& withSessionLog(std::string path, size_t ram_budget = SnapshotStore::DEFAULT_RAM_BUDGET);
+    MyServer& withEvents(ServerEvents events);
+    // 不启动显示流水线，只接收、去重和保存；没有窗口时用
+    MyServer& withoutDisplay();
+    // 每个不重复的快照收到后就在worker上解析一遍，统计解析失败的个数和耗时；不剖分
+    MyServer& withValidation();
+    // 断开的连接的快照历史也留着，saveSession时一起写进会话文件；不调用时断开就释放
+    MyServer& withClosedHistory();
     void run();
-
+    // 不再等新的数据：内核里已经到了的数据收完、正在跑的接收任务都结束后返回，之后不会再有新的快照；
+    // 对端一直在发时最多再收grace这么久。worker继续跑已经排队的任务(比如解析收到的快照)，之后还要调用stop
+    void stopReceiving(std::chrono::steady_clock::duration grace = {});
+    // 还收了一半的帧数(对端发到一半时停止了接收)，要在stopReceiving之后调用
+    size_t partialFrames();
+    // 停止接收并等所有worker退出，还在排队的任务不再执行，之后可以不加锁地访问连接；析构时也会调用
+    void stop();
+    // 把所有连接(withClosedHistory时包括已经断开的)的快照存进一个会话文件，要在stop之后调用
+    bool saveSession(std::string const& path, std::error_code& ec);
+    Stats stats() const;
+    ServerEvents const& events() const noexcept { return m_events_; }
+
+    // 同一连接的任务串行执行，拿到句柄后可以不加锁使用连接的数据
+    ConnectionHandle findConnection(SOCKET id) const { return m_connections_.find(id); }
+    ConnectionHandle addConnection(SOCKET id, std::string peer);
+    void removeConnection(SOCKET id);
+    // 把一个连接的接收交给worker，接收任务不再继续时调用onReceiveDone
+    void submitReceive(SOCKET id);
+    void onReceiveDone() noexcept { m_receive_tasks_.fetch_sub(1, std::memory_order_release); }
+    // stopReceiving给的期限到了，接收任务不再接着收
+    bool receiveExpired() const noexcept {
+        return std::chrono::steady_clock::now().time_since_epoch().count() >= m_receive_deadline_.load(std::memory_order_relaxed);
+    }
+    // 新收到的不重复快照，withValidation时交给worker解析
+    void onNewSnapshot(SnapshotRef stored);
+    // SnapshotValidateTask解析完一个快照
+    void onValidated(bool ok, double decode_ms);
+    // 连接列表，GUI线程用
+    std::shared_ptr<const std::vector<ConnectionSummary>> connections() const { return m_connections_.list(); }
+    SOCKET currentConnectionId() const noexcept { return m_connections_.currentId(); }
+    // 在worker上预取focus前后的快照，要在该连接的任务里调用
+    void prefetchAround(ConnectionInfo& connection, SnapshotKey focus);
+    // 要显示的快照可能变了，先改好状态再调用；显示流水线停着时把它重新提交
+    void notifyDraw();
+
+    // 离线连接(打开的会话文件)没有socket，给一个不会和真socket重复的标识，任务的affinity照常用它
+    SOCKET nextOfflineId() noexcept;
+    bool isOfflineId(SOCKET id) const noexcept;
 
     SOCKET m_id_ = INVALID_SOCKET;
-    std::unordered_map<SOCKET, ConnectionInfo> m_connection_map_;
+    SOCKET m_shm_id_ = INVALID_SOCKET; // 共享内存传输的监听socket
+    SOCKET m_unix_id_ = INVALID_SOCKET; // AF_UNIX的监听socket
+    bool isListener(SOCKET fd) const noexcept { return fd == m_id_ || fd == m_shm_id_ || fd == m_unix_id_; }
+    ConnectionRegistry m_connections_;
+    Reactor m_reactor_;
+    TaskScheduler m_scheduler_;
 
 private:
-    WSAContext m_wsa_;
+    socket_context m_socket_context_;
+    ServerEvents m_events_;
+    bool m_display_ = true;
+    bool m_validate_ = false;
+    bool m_keep_closed_ = false;
+    std::mutex m_closed_mtx_;
+    std::vector<ConnectionHandle> m_closed_;
+    std::atomic<uint64_t> m_validated_ = 0;
+    std::atomic<uint64_t> m_invalid_ = 0;
+    std::atomic<uint64_t> m_validate_pending_ = 0;
+    std::atomic<size_t> m_receive_tasks_ = 0; // 已经提交还没结束的接收任务
+    std::atomic<int64_t> m_receive_deadline_ = INT64_MAX; // steady_clock的计数，stopReceiving之前是最大值
+    mutable std::mutex m_decode_time_mtx_;
+    double m_decode_ms_total_ = 0;
+    double m_decode_ms_max_ = 0;
+    std::string m_unix_path_; // 析构时删掉
+    size_t m_worker_count_ = std::thread::hardware_concurrency();
     std::thread m_work_thread_;
-};
-
-class Task
-{
-public:
-	virtual std::vector<std::shared_ptr<Task>> run() { return {}; }
-	virtual ~Task() = default;
+    std::atomic<uint64_t> m_next_connection_serial_ = 1;
+    std::atomic<uint64_t> m_next_offline_id_ = 0;
 };
 
 class ConnectionAcceptTask : public Task
@@ -97,11 +191,12 @@ public:
 		AcceptOne,
 	};
 
-	ConnectionAcceptTask(MyServer* boss) : m_boss_(boss) {}
-	std::vector<std::shared_ptr<Task>> run() override;
+	ConnectionAcceptTask(MyServer* boss, SOCKET listener) : m_boss_(boss), m_listener_(listener) {}
+	TaskList run() override;
 
 private:
 	MyServer* m_boss_;
+	SOCKET m_listener_;
 };
 
 class BrepDataReceiveTask : public Task
@@ -113,11 +208,13 @@ public:
 		NeedReTry,
 		Received,
 		EnoughData,
-		LackData
+		LackData,
+		BadFrame
 	};
 
 	BrepDataReceiveTask(MyServer* boss, SOCKET connection) : m_boss_(boss), m_connection_id_(connection) {}
-	std::vector<std::shared_ptr<Task>> run() override;
+	TaskList run() override;
+	SOCKET affinity() const override { return m_connection_id_; }
 
 private:
 	MyServer* m_boss_ = nullptr;
@@ -133,8 +230,11 @@ public:
 		LackData,
 	};
 
-	BrepDataSetTask(MyServer* boss) : m_boss_(boss) {}
-	std::vector<std::shared_ptr<Task>> run() override;
+	BrepDataSetTask(MyServer* boss) : m_boss_(boss), m_connection_id_(boss->currentConnectionId()) {}
+	TaskList run() override;
+	// 读的是当前连接的数据，和该连接的接收任务串行执行；
+	// 运行时发现当前连接换了就更新m_connection_id_，把自己重新提交到新连接的串行队列里
+	SOCKET affinity() const override { return m_connection_id_; }
 
 private:
 	MyServer* m_boss_ = nullptr;
@@ -151,7 +251,8 @@ public:
 	};
 
 	WaitingDrawTask(MyServer* boss) : m_boss_(boss){}
-	std::vector<std::shared_ptr<Task>> run() override;
+	TaskList run() override;
+	SOCKET affinity() const override { return m_boss_->currentConnectionId(); }
 
 private:
 	MyServer* m_boss_ = nullptr;
@@ -162,7 +263,8 @@ class ConnectionCloseTask : public Task
 {
 public:
 	ConnectionCloseTask(MyServer* boss, SOCKET connection) : m_boss_(boss), m_connection_id_(connection) {}
-	std::vector<std::shared_ptr<Task>> run() override;
+	TaskList run() override;
+	SOCKET affinity() const override { return m_connection_id_; }
 
 private:
 	MyServer* m_boss_ = nullptr;
@@ -174,7 +276,7 @@ class ErrorThrowTask : public Task
 {
 public:
 	ErrorThrowTask(std::string str = "error") : m_str(str) {}
-	std::vector<std::shared_ptr<Task>> run() override;
+	TaskList run() override;
 private:
 	std::string m_str = "error";
 };
@@ -183,13 +285,16 @@ class PreviousBrepTask : public Task
 {
 public:
 	PreviousBrepTask(MyServer* boss, SOCKET connection) : m_boss_(boss), m_connection_id_(connection) {}
-	std::vector<std::shared_ptr<Task>> run() override{
-		auto& connection = m_boss_->m_connection_map_[m_connection_id_];
-		if(connection.m_data_index > 0){
-			m_boss_->m_connection_map_[m_connection_id_].m_data_index--;
+	TaskList run() override{
+		auto connection = m_boss_->findConnection(m_connection_id_);
+		if(connection && connection->m_data_index > 0){
+			connection->m_data_index--;
+			getCriticalSection().m_shape_cache.setFocus(connection->getCurrentKey());
+			m_boss_->notifyDraw();
 		}
 		return {};
 	}
+	SOCKET affinity() const override { return m_connection_id_; }
 
 private:
 	MyServer* m_boss_ = nullptr;
@@ -201,13 +306,40 @@ class NextBrepTask : public Task
 {
 public:
 	NextBrepTask(MyServer* boss, SOCKET connection) : m_boss_(boss), m_connection_id_(connection) {}
-	std::vector<std::shared_ptr<Task>> run() override{
-		auto& connection = m_boss_->m_connection_map_[m_connection_id_];
-		if(connection.m_data_index < connection.m_brep_data_list.size()-1){
-			m_boss_->m_connection_map_[m_connection_id_].m_data_index++;
+	TaskList run() override{
+		auto connection = m_boss_->findConnection(m_connection_id_);
+		if(connection && connection->m_data_index + 1 < static_cast<int>(connection->m_brep_data_list.size())){
+			connection->m_data_index++;
+			getCriticalSection().m_shape_cache.setFocus(connection->getCurrentKey());
+			m_boss_->notifyDraw();
+		}
+		return {};
+	}
+	SOCKET affinity() const override { return m_connection_id_; }
+
+private:
+	MyServer* m_boss_ = nullptr;
+	SOCKET m_connection_id_ = INVALID_SOCKET;
+
+};
+
+class LatestBrepTask : public Task
+{
+public:
+	LatestBrepTask(MyServer* boss, SOCKET connection) : m_boss_(boss), m_connection_id_(connection) {}
+	TaskList run() override{
+		if(auto connection = m_boss_->findConnection(m_connection_id_)){
+			connection->setCurrentIndexToLatest();
+			getCriticalSection().m_shape_cache.setFocus(connection->getCurrentKey());
+			// 切到手动浏览时先把最新快照前面的几个准备好
+			if(!getCriticalSection().m_mode_draw_new){
+				m_boss_->prefetchAround(*connection, connection->getCurrentKey());
+			}
+			m_boss_->notifyDraw();
 		}
 		return {};
 	}
+	SOCKET affinity() const override { return m_connection_id_; }
 
 private:
 	MyServer* m_boss_ = nullptr;
@@ -215,5 +347,103 @@ private:
 
 };
 
+// 把会话文件里一个连接的快照放进离线连接的历史，只建引用，不读负载
+class SessionLoadTask : public Task
+{
+public:
+	SessionLoadTask(MyServer* boss, SOCKET connection, std::shared_ptr<const SessionLog> file, std::vector<session_file::index_entry> entries, bool make_current)
+		: m_boss_(boss), m_connection_id_(connection), m_file_(std::move(file)), m_entries_(std::move(entries)), m_make_current_(make_current) {}
+	TaskList run() override;
+	SOCKET affinity() const override { return m_connection_id_; }
+
+private:
+	MyServer* m_boss_ = nullptr;
+	SOCKET m_connection_id_ = INVALID_SOCKET;
+	std::shared_ptr<const SessionLog> m_file_;
+	std::vector<session_file::index_entry> m_entries_;
+	bool m_make_current_ = false;
+};
+
+// 把一个连接的历史写成会话文件，内容相同的快照只写一份负载
+class SessionSaveTask : public Task
+{
+public:
+	SessionSaveTask(MyServer* boss, SOCKET connection, std::string path) : m_boss_(boss), m_connection_id_(connection), m_path_(std::move(path)) {}
+	TaskList run() override;
+	SOCKET affinity() const override { return m_connection_id_; }
+
+private:
+	MyServer* m_boss_ = nullptr;
+	SOCKET m_connection_id_ = INVALID_SOCKET;
+	std::string m_path_;
+};
+
+// withValidation时解析一个新收到的快照，只看能不能解析，不剖分也不放进缓存
+class SnapshotValidateTask : public Task
+{
+public:
+	SnapshotValidateTask(MyServer* boss, SnapshotRef stored) : m_boss_(boss), m_stored_(std::move(stored)) {}
+	TaskList run() override;
+
+private:
+	MyServer* m_boss_ = nullptr;
+	SnapshotRef m_stored_;
+};
+
+// 当前要显示的快照先在worker上解析(ShapeDecodeTask)，再剖分(ShapeMeshTask)，完成后交给GUI线程显示；
+// 用户已经切到别的快照时中途取消，回到BrepDataSetTask
+class ShapeDecodeTask : public Task
+{
+public:
+	ShapeDecodeTask(MyServer* boss, SnapshotKey key, brep_frame_ptr frame) : m_boss_(boss), m_key_(key), m_frame_(std::move(frame)) {}
+	TaskList run() override;
+
+private:
+	MyServer* m_boss_ = nullptr;
+	SnapshotKey m_key_;
+	brep_frame_ptr m_frame_;
+};
+
+class ShapeMeshTask : public Task
+{
+public:
+	ShapeMeshTask(MyServer* boss, SnapshotKey key, TopoDS_Shape shape, size_t payload_size, SnapshotTiming timing)
+		: m_boss_(boss), m_key_(key), m_shape_(std::move(shape)), m_payload_size_(payload_size), m_timing_(timing) {}
+	TaskList run() override;
+
+private:
+	MyServer* m_boss_ = nullptr;
+	SnapshotKey m_key_;
+	TopoDS_Shape m_shape_;
+	size_t m_payload_size_ = 0;
+	SnapshotTiming m_timing_;
+};
+
+// 当前快照先用粗糙网格显示，这个任务在拓扑副本上剖分精细网格，算好后换进缓存并通知GUI线程
+// 离当前快照已经远了就放弃，下次再显示到它时重新开始
+class ShapeRefineTask : public Task
+{
+public:
+	ShapeRefineTask(MyServer* boss, SnapshotKey key, ShapeCache::EntryPtr coarse)
+		: m_boss_(boss), m_key_(key), m_coarse_(std::move(coarse)) {}
+	TaskList run() override;
+
+private:
+	MyServer* m_boss_ = nullptr;
+	SnapshotKey m_key_;
+	ShapeCache::EntryPtr m_coarse_; // 只有粗糙网格的条目
+};
+
+// 在worker上解析并剖分一个快照放进缓存，离当前快照已经远了就放弃
+class ShapePrefetchTask : public Task
+{
+public:
+	ShapePrefetchTask(SnapshotKey key, brep_frame_ptr frame) : m_key_(key), m_frame_(std::move(frame)) {}
+	TaskList run() override;
+
+private:
+	SnapshotKey m_key_;
+	brep_frame_ptr m_frame_;
+};
 
 #endif
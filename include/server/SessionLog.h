@@ -0,0 +1,46 @@
+﻿#ifndef SESSION_LOG_H
+#define SESSION_LOG_H
+
+#include "common/frame_header.hpp"
+#include "common/mapped_file.hpp"
+#include "common/session_file.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <system_error>
+
+// 会话日志：内存超出预算时负载追加写到这里，导航到它时再只读映射回来
+// 记录格式和会话文件(见common/session_file.hpp)的相同，日志可以从头顺序扫描；
+// 记录的位置(索引)由SnapshotStore的条目记着，日志是临时文件，服务端退出后自动删除
+// 打开的会话文件也包装成一个只读的SessionLog，快照按索引里的位置映射
+class SessionLog
+{
+public:
+	static constexpr size_t RECORD_HEADER_SIZE = session_file::RECORD_HEADER_SIZE;
+
+	// 一条记录在日志里的位置，m_size是负载长度
+	struct Record
+	{
+		uint64_t m_offset = 0;
+		uint64_t m_size = 0;
+	};
+
+	// 新建日志文件，失败抛std::system_error
+	explicit SessionLog(std::string const& path);
+	// 已经打开的会话文件，只能映射不能追加
+	explicit SessionLog(std::shared_ptr<mapped_file> file) : m_file_(std::move(file)) {}
+
+	// 追加一帧，多个线程可以同时追加；写失败返回false
+	bool append(brep_frame const& frame, Record& record, std::error_code& ec);
+	// 只读映射一条记录，返回的帧引用映射，不拷贝负载
+	brep_frame_ptr load(Record const& record, std::error_code& ec) const;
+	uint64_t size() const noexcept { return m_end_.load(std::memory_order_relaxed); }
+
+private:
+	std::shared_ptr<mapped_file> m_file_;
+	std::atomic<uint64_t> m_end_ = 0;
+};
+
+#endif
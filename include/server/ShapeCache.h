@@ -0,0 +1,112 @@
+﻿#ifndef SHAPE_CACHE_H
+#define SHAPE_CACHE_H
+
+#include "server/SceneParts.h"
+#include "server/ShapeMesher.h"
+
+#include <TopoDS_Shape.hxx>
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// 一个快照的标识：连接的序号+在该连接历史里的下标；socket句柄会被复用，所以用单调递增的连接序号
+// m_content是负载在SnapshotStore里的编号，由连接和下标决定，不参与比较；形状缓存按它存放
+struct SnapshotKey
+{
+	uint64_t m_connection = 0;
+	int m_index = -1;
+	uint64_t m_content = 0;
+
+	bool valid() const noexcept { return m_index >= 0; }
+
+	friend bool operator==(SnapshotKey const& a, SnapshotKey const& b) noexcept {
+		return a.m_connection == b.m_connection && a.m_index == b.m_index;
+	}
+
+	friend bool operator!=(SnapshotKey const& a, SnapshotKey const& b) noexcept {
+		return !(a == b);
+	}
+};
+
+// 按内存预算做LRU淘汰的已解析形状缓存，形状带着三角网格和拆好的显示部分，前进后退时不用再解析和剖分
+// 条目按快照的内容存放，内容相同的快照(不管是不是同一个连接的)共用一个条目，只解析和剖分一次
+// 每个快照先放进粗糙网格的形状，精细网格算好后再换上；worker线程预取当前快照附近的几个快照
+// 条目发布后不再修改，换精细网格时整体换一个新条目，find拿到的是共享的条目，不拷贝形状和部分列表
+// AIS对象由GUI线程按部分的哈希自己管理，不放在这里
+class ShapeCache
+{
+public:
+	static constexpr size_t DEFAULT_BUDGET = size_t(512) << 20;
+	static constexpr int DEFAULT_PREFETCH_RADIUS = 2;
+
+	struct Entry
+	{
+		TopoDS_Shape m_shape;  // 目前最精细的形状，精细网格没算好之前就是m_coarse
+		TopoDS_Shape m_coarse; // 带粗糙网格的形状
+		bool m_refined = false;
+		std::vector<ScenePart> m_parts;
+		size_t m_cost = 0;
+		SnapshotTiming m_timing;
+	};
+	using EntryPtr = std::shared_ptr<const Entry>;
+
+	void configure(size_t budget_bytes, int prefetch_radius);
+	size_t budget() const;
+	int prefetchRadius() const;
+
+	// 命中时把它移到最近使用的位置
+	EntryPtr find(SnapshotKey key);
+	// 返回缓存里的条目，已经有了的话是先到的那个
+	EntryPtr insert(SnapshotKey key, Entry entry);
+	// 精细网格：条目存在、还没有精细网格、也没有在算时返回true并登记为正在算
+	bool beginRefine(SnapshotKey key);
+	// 换上精细网格的形状和对应的显示部分，fine为空表示放弃(被取消)
+	void endRefine(SnapshotKey key, TopoDS_Shape fine, std::vector<ScenePart> parts, size_t extra_cost, SnapshotTiming timing);
+	// 连接关闭后它的快照都不会再被访问，只被它用过的条目删掉
+	void dropConnection(uint64_t connection);
+
+	// 预取：已经缓存或者内容相同的快照正在预取时返回false，否则登记为正在预取
+	bool beginPrefetch(SnapshotKey key);
+	void endPrefetch(SnapshotKey key);
+
+	// 当前想要显示的快照，导航或者显示流水线开始处理一个快照时更新；解析当前快照的任务发现它不再是焦点就取消，
+	// 离它超过预取半径的预取任务也取消
+	void setFocus(SnapshotKey key);
+	bool isFocus(SnapshotKey key) const;
+	bool isNearFocus(SnapshotKey key) const;
+
+	size_t usage() const;
+
+private:
+	struct Slot
+	{
+		EntryPtr m_entry;
+		bool m_refining = false;
+		std::list<uint64_t>::iterator m_lru;
+		std::vector<uint64_t> m_connections; // 用过这个条目的连接，一般只有一两个
+	};
+	using SlotMap = std::unordered_map<uint64_t, Slot>;
+
+	void touchLocked(Slot& slot, uint64_t connection);
+	void eraseLocked(SlotMap::iterator it);
+	void evictLocked();
+
+	mutable std::mutex m_mtx;
+	std::list<uint64_t> m_lru; // 头部是最近使用的
+	SlotMap m_entries;
+	std::unordered_set<uint64_t> m_pending;
+	size_t m_budget = DEFAULT_BUDGET;
+	size_t m_usage = 0;
+	int m_prefetch_radius = DEFAULT_PREFETCH_RADIUS;
+	SnapshotKey m_focus;
+};
+
+// 估算缓存一个形状的内存：拓扑几何按负载大小算，网格按节点和三角形数算，显示用的顶点缓冲再算一份
+size_t estimateShapeCost(TopoDS_Shape const& shape, size_t payload_size);
+
+#endif
@@ -0,0 +1,52 @@
+﻿#ifndef SHAPE_MESHER_H
+#define SHAPE_MESHER_H
+
+#include <Message_ProgressRange.hxx>
+#include <TopoDS_Shape.hxx>
+
+#include <cstddef>
+
+// 先用粗糙网格尽快显示，精细网格在后台算好后再替换
+enum class MeshLevel
+{
+	Coarse,
+	Fine,
+};
+
+// 剖分参数，服务端的剖分和GUI线程上AIS的显示精度用同一套，AIS发现已有网格够精细就不会再剖分
+struct MeshSettings
+{
+	double m_deviation_coefficient = 0.001;                         // 弦高误差占包围盒尺寸的比例，和AIS默认值一致
+	double m_angle = 20.0 * 3.14159265358979323846 / 180.0;        // 角度误差(弧度)
+	double m_coarse_deviation_coefficient = 0.02;                   // 粗糙层级的弦高误差比例
+	double m_coarse_angle = 45.0 * 3.14159265358979323846 / 180.0; // 粗糙层级的角度误差
+	bool m_parallel = true;                                         // 让BRepMesh按面并行剖分
+
+	// 粗糙层级不比精细层级粗时就不分层级，直接剖分精细网格
+	bool progressive() const {
+		return m_coarse_deviation_coefficient > m_deviation_coefficient;
+	}
+};
+
+// 一个快照在各阶段花的时间
+struct SnapshotTiming
+{
+	double m_decode_ms = 0;
+	double m_coarse_mesh_ms = 0;
+	double m_mesh_ms = 0;
+	size_t m_triangles = 0;
+};
+
+// 按settings里对应层级的精度剖分形状，被取消时返回false
+bool meshShape(TopoDS_Shape const& shape, MeshSettings const& settings, MeshLevel level,
+	const Message_ProgressRange& progress = Message_ProgressRange());
+
+// 复制一份拓扑(几何共享，不带网格)，用来承载另一个层级的网格；两个层级的网格不能放在同一份拓扑上，GUI线程可能正在读
+TopoDS_Shape copyTopology(TopoDS_Shape const& shape);
+
+size_t countTriangles(TopoDS_Shape const& shape);
+
+// 形状上所有面的三角网格(节点、法向和三角形)占的字节数
+size_t estimateMeshBytes(TopoDS_Shape const& shape);
+
+#endif
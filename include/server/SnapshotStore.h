@@ -0,0 +1,114 @@
+﻿#ifndef SNAPSHOT_STORE_H
+#define SNAPSHOT_STORE_H
+
+#include "common/frame_header.hpp"
+#include "server/SessionLog.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+// 库里的一份负载；内存超出预算后负载写进会话日志，要用的时候只读映射回来
+class StoredFrame
+{
+public:
+	StoredFrame(uint64_t content, brep_frame_ptr frame)
+		: m_content_(content), m_digest_(frame->m_digest), m_size_(frame->payload().size()), m_resident_(std::move(frame)) {}
+	// 负载已经在文件里(打开的会话文件)，用到时再映射
+	StoredFrame(uint64_t content, uint64_t digest, std::shared_ptr<const SessionLog> log, SessionLog::Record record)
+		: m_content_(content), m_digest_(digest), m_size_(record.m_size), m_log_(std::move(log)), m_record_(record) {}
+
+	// 负载在库里的编号，内容相同就相同，形状缓存按它共用解析和剖分结果
+	uint64_t content() const noexcept { return m_content_; }
+	uint64_t digest() const noexcept { return m_digest_; }
+	uint64_t size() const noexcept { return m_size_; }
+	// 不拷贝负载；已经写进日志的映射回来，映射失败时返回一个空帧
+	brep_frame_ptr frame() const;
+
+private:
+	friend class SnapshotStore;
+
+	uint64_t m_content_;
+	uint64_t m_digest_;
+	uint64_t m_size_;
+	mutable std::mutex m_mtx_;
+	brep_frame_ptr m_resident_; // 还在内存里时
+	mutable std::weak_ptr<const brep_frame> m_mapped_; // 写进日志之后还有人在用的那份，直接给它，不重新映射
+	std::shared_ptr<const SessionLog> m_log_;
+	SessionLog::Record m_record_;
+};
+
+// 快照历史里的一项，只是一个引用；内容相同的快照指向同一个StoredFrame
+using SnapshotRef = std::shared_ptr<const StoredFrame>;
+
+// 按内容寻址的负载库：收到的帧按content_hash查重，内容相同的只存一份，历史里只留引用
+// 哈希相同时再逐字节比较一遍，不靠哈希不碰撞；库里只有弱引用，负载在最后一个引用它的快照释放时释放
+// 按哈希分片加锁，不同连接的接收任务互不争用
+// 配置了会话日志时，内存里的负载超出预算就把最早收到的写进日志，内存占用不随历史变长
+class SnapshotStore
+{
+public:
+	static constexpr size_t SHARD_COUNT = 16;
+	static constexpr size_t DEFAULT_RAM_BUDGET = size_t(1) << 30;
+
+	// 除了m_resident_bytes，都是累计值，不随负载释放减少
+	struct Stats
+	{
+		uint64_t m_snapshots = 0;      // 收到的快照数
+		uint64_t m_unique = 0;         // 其中内容不重复的
+		uint64_t m_bytes = 0;          // 收到的负载字节数
+		uint64_t m_unique_bytes = 0;   // 实际存下来的负载字节数
+		uint64_t m_spilled = 0;        // 写进会话日志的负载数
+		uint64_t m_spilled_bytes = 0;
+		uint64_t m_resident_bytes = 0; // 还在内存里的负载字节数(只在有会话日志时统计)，已经释放但还没轮到写出的也算在内
+	};
+
+	// 负载在内存里最多占ram_budget字节，超出部分写进log；log为空表示不限制
+	void configureSpill(std::shared_ptr<SessionLog> log, size_t ram_budget);
+
+	// 帧的m_digest要已经算好；库里有内容相同的帧时返回库里那份，传进来的这份丢掉；added表示是不是新存进来的
+	SnapshotRef intern(brep_frame&& frame, bool& added);
+	SnapshotRef intern(brep_frame&& frame) {
+		bool added = false;
+		return intern(std::move(frame), added);
+	}
+	// 放进一条已经在文件里的记录，不读负载；之后收到内容相同的帧会用它
+	SnapshotRef adopt(std::shared_ptr<const SessionLog> log, SessionLog::Record record, uint64_t digest);
+	Stats stats() const;
+
+private:
+	struct Shard
+	{
+		std::mutex m_mtx;
+		std::unordered_multimap<uint64_t, std::weak_ptr<StoredFrame>> m_items; // 按内容哈希
+		size_t m_sweep_at = 64; // 条目数到这里时清掉已经释放了的
+	};
+
+	static bool sameContent(brep_frame const& a, brep_frame const& b) noexcept;
+	static void sweepLocked(Shard& shard);
+	// 超出预算时按收到的先后把负载写进日志，在接收任务里调用，不拿分片的锁
+	void spillOverBudget();
+	bool spill(StoredFrame& stored, std::shared_ptr<SessionLog> const& log);
+
+	std::array<Shard, SHARD_COUNT> m_shards_;
+	std::atomic<uint64_t> m_next_content_ = 1;
+	std::atomic<uint64_t> m_snapshots_ = 0;
+	std::atomic<uint64_t> m_unique_ = 0;
+	std::atomic<uint64_t> m_bytes_ = 0;
+	std::atomic<uint64_t> m_unique_bytes_ = 0;
+	std::atomic<uint64_t> m_spilled_ = 0;
+	std::atomic<uint64_t> m_spilled_bytes_ = 0;
+
+	mutable std::mutex m_spill_mtx_;
+	std::shared_ptr<SessionLog> m_log_;
+	size_t m_ram_budget_ = DEFAULT_RAM_BUDGET;
+	std::deque<std::pair<std::weak_ptr<StoredFrame>, uint64_t>> m_resident_; // 按收到的先后，还没写出的负载和它的大小
+	uint64_t m_resident_bytes_ = 0;
+};
+
+#endif
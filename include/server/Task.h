@@ -0,0 +1,255 @@
+﻿#ifndef TASK_H
+#define TASK_H
+
+#include "common/socket_compat.hpp"
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <initializer_list>
+#include <mutex>
+#include <new>
+#include <utility>
+
+class Task;
+class TaskPtr;
+class TaskList;
+
+// 侵入式引用计数的任务句柄，引用归零时把任务还给创建它的对象池
+class TaskPtr
+{
+public:
+	TaskPtr() noexcept = default;
+	TaskPtr(std::nullptr_t) noexcept {}
+	explicit TaskPtr(Task* task) noexcept;
+	TaskPtr(TaskPtr const& other) noexcept : TaskPtr(other.m_task_) {}
+	TaskPtr(TaskPtr&& other) noexcept : m_task_(std::exchange(other.m_task_, nullptr)) {}
+	~TaskPtr() { reset(); }
+
+	TaskPtr& operator=(TaskPtr other) noexcept {
+		std::swap(m_task_, other.m_task_);
+		return *this;
+	}
+
+	void reset() noexcept;
+
+	Task* get() const noexcept { return m_task_; }
+	Task* operator->() const noexcept { return m_task_; }
+	Task& operator*() const noexcept { return *m_task_; }
+	explicit operator bool() const noexcept { return m_task_ != nullptr; }
+
+private:
+	Task* m_task_ = nullptr;
+};
+
+// 任务的续作列表，容量固定在栈上，状态转移不需要分配内存
+class TaskList
+{
+public:
+	static constexpr size_t CAPACITY = 2;
+
+	TaskList() noexcept = default;
+	TaskList(std::initializer_list<TaskPtr> tasks) noexcept {
+		assert(tasks.size() <= CAPACITY);
+		for (auto& task : tasks) {
+			push_back(task);
+		}
+	}
+
+	void push_back(TaskPtr task) noexcept {
+		assert(m_size_ < CAPACITY);
+		m_items_[m_size_++] = std::move(task);
+	}
+
+	size_t size() const noexcept { return m_size_; }
+	bool empty() const noexcept { return m_size_ == 0; }
+	TaskPtr* begin() noexcept { return m_items_.data(); }
+	TaskPtr* end() noexcept { return m_items_.data() + m_size_; }
+
+private:
+	std::array<TaskPtr, CAPACITY> m_items_;
+	size_t m_size_ = 0;
+};
+
+class Task
+{
+public:
+	virtual TaskList run() { return {}; }
+	virtual ~Task() = default;
+
+	// 任务所属的连接；同一连接的任务按提交顺序一个接一个执行(不一定在同一个worker上)，INVALID_SOCKET表示没有顺序要求
+	virtual SOCKET affinity() const { return INVALID_SOCKET; }
+
+protected:
+	// 重试时直接把自己作为续作返回，不再创建新任务
+	TaskPtr self() noexcept { return TaskPtr(this); }
+
+private:
+	friend class TaskPtr;
+	template<typename T> friend class TaskPool;
+
+	std::atomic<uint32_t> m_refs_ = 0;
+	void (*m_recycle_)(Task*) = nullptr;
+};
+
+inline TaskPtr::TaskPtr(Task* task) noexcept : m_task_(task)
+{
+	if (m_task_) {
+		m_task_->m_refs_.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+inline void TaskPtr::reset() noexcept
+{
+	Task* task = std::exchange(m_task_, nullptr);
+	if (task && task->m_refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		if (task->m_recycle_) {
+			task->m_recycle_(task);
+		}
+		else {
+			delete task;
+		}
+	}
+}
+
+// 每种任务一个按线程缓存的空闲链表，任务析构后内存直接挂回链表，下次makeTask复用
+// 任务常在一个线程上创建(比如reactor线程)、在另一个线程上释放(worker)，只靠线程缓存的话创建的一方永远是空的；
+// 所以线程缓存满了时整批挂到这种任务共用的仓库里，空了时先从仓库整批取，一批只加一次锁
+template<typename T>
+class TaskPool
+{
+public:
+	static constexpr size_t MAX_CACHED = 256;
+	static constexpr size_t TRANSFER_BATCH = 64;
+	static constexpr size_t MAX_DEPOT_BATCHES = 64;
+
+	template<typename... Args>
+	static TaskPtr make(Args&&... args) {
+		auto& cache = local();
+		if (!cache.m_head) {
+			cache.m_head = depot().take();
+			cache.m_count = cache.m_head ? TRANSFER_BATCH : 0;
+		}
+		void* memory = nullptr;
+		if (cache.m_head) {
+			memory = std::exchange(cache.m_head, cache.m_head->m_next);
+			--cache.m_count;
+		}
+		else {
+			// 连续落空说明这个线程一直在净创建，每次多申请一些，个数翻倍直到一批
+			memory = ::operator new(BLOCK_SIZE);
+			for (size_t i = 1; i < cache.m_refill; ++i) {
+				cache.m_head = new (::operator new(BLOCK_SIZE)) FreeNode{ cache.m_head, nullptr };
+				++cache.m_count;
+			}
+			cache.m_refill = cache.m_refill < TRANSFER_BATCH ? cache.m_refill * 2 : TRANSFER_BATCH;
+		}
+
+		T* task = nullptr;
+		try {
+			task = new (memory) T(std::forward<Args>(args)...);
+		}
+		catch (...) {
+			::operator delete(memory);
+			throw;
+		}
+		task->m_recycle_ = &TaskPool::recycle;
+		return TaskPtr(task);
+	}
+
+private:
+	struct FreeNode {
+		FreeNode* m_next;
+		FreeNode* m_next_batch; // 只在仓库里用，把各批串起来
+	};
+
+	static constexpr size_t BLOCK_SIZE = sizeof(T) > sizeof(FreeNode) ? sizeof(T) : sizeof(FreeNode);
+
+	static void release(FreeNode* head) {
+		while (head) {
+			::operator delete(std::exchange(head, head->m_next));
+		}
+	}
+
+	struct Cache {
+		FreeNode* m_head = nullptr;
+		size_t m_count = 0;
+		size_t m_refill = 1; // 下次落空时申请几个
+
+		~Cache() {
+			release(m_head);
+		}
+	};
+
+	// 每批正好TRANSFER_BATCH个节点
+	struct Depot {
+		std::mutex m_mtx;
+		FreeNode* m_batches = nullptr;
+		size_t m_batch_count = 0;
+
+		FreeNode* take() {
+			std::unique_lock lck(m_mtx);
+			if (!m_batches) {
+				return nullptr;
+			}
+			--m_batch_count;
+			return std::exchange(m_batches, m_batches->m_next_batch);
+		}
+
+		void give(FreeNode* batch) {
+			{
+				std::unique_lock lck(m_mtx);
+				if (m_batch_count < MAX_DEPOT_BATCHES) {
+					batch->m_next_batch = std::exchange(m_batches, batch);
+					++m_batch_count;
+					return;
+				}
+			}
+			release(batch);
+		}
+
+		~Depot() {
+			while (m_batches) {
+				release(std::exchange(m_batches, m_batches->m_next_batch));
+			}
+		}
+	};
+
+	static Cache& local() {
+		thread_local Cache cache;
+		return cache;
+	}
+
+	static Depot& depot() {
+		static Depot depot;
+		return depot;
+	}
+
+	static void recycle(Task* base) {
+		T* task = static_cast<T*>(base);
+		task->~T();
+
+		auto& cache = local();
+		cache.m_head = new (static_cast<void*>(task)) FreeNode{ cache.m_head, nullptr };
+		if (++cache.m_count < MAX_CACHED) {
+			return;
+		}
+		// 满了，把最前面的一批交给仓库
+		FreeNode* batch = cache.m_head;
+		FreeNode* last = batch;
+		for (size_t i = 1; i < TRANSFER_BATCH; ++i) {
+			last = last->m_next;
+		}
+		cache.m_head = std::exchange(last->m_next, nullptr);
+		cache.m_count -= TRANSFER_BATCH;
+		depot().give(batch);
+	}
+};
+
+template<typename T, typename... Args>
+TaskPtr makeTask(Args&&... args)
+{
+	return TaskPool<T>::make(std::forward<Args>(args)...);
+}
+
+#endif
@@ -0,0 +1,127 @@
+﻿#ifndef TASK_SCHEDULER_H
+#define TASK_SCHEDULER_H
+
+#include "server/Task.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// 只在满了的时候扩容的环形双端队列；std::deque在队头出队时会反复释放/申请内存块
+template<typename T>
+class RingDeque
+{
+public:
+	bool empty() const noexcept { return m_size_ == 0; }
+	size_t size() const noexcept { return m_size_; }
+
+	void push_back(T value) {
+		if (m_size_ == m_items_.size()) {
+			grow();
+		}
+		m_items_[(m_head_ + m_size_) & (m_items_.size() - 1)] = std::move(value);
+		++m_size_;
+	}
+
+	T pop_front() {
+		T value = std::move(m_items_[m_head_]);
+		m_head_ = (m_head_ + 1) & (m_items_.size() - 1);
+		--m_size_;
+		return value;
+	}
+
+	T pop_back() {
+		--m_size_;
+		return std::move(m_items_[(m_head_ + m_size_) & (m_items_.size() - 1)]);
+	}
+
+private:
+	void grow() {
+		std::vector<T> items(m_items_.empty() ? 64 : m_items_.size() * 2);
+		for (size_t i = 0; i < m_size_; ++i) {
+			items[i] = std::move(m_items_[(m_head_ + i) & (m_items_.size() - 1)]);
+		}
+		m_items_ = std::move(items);
+		m_head_ = 0;
+	}
+
+	std::vector<T> m_items_;
+	size_t m_head_ = 0;
+	size_t m_size_ = 0;
+};
+
+// 多线程任务调度器：每个worker有一个本地任务队列和一个就绪串行队列的队列，都可以被别的worker偷取
+// 有affinity的任务按affinity散列进固定数量的串行队列(strand)，同一个串行队列里的任务按提交顺序一次只跑一个，
+// 但可以在任意worker上跑：某个连接的任务积压时，整个串行队列会被空闲的worker偷走；
+// 散列冲突的两个连接只是多串行了一些，不影响正确性，也不需要为每个连接分配内存
+class TaskScheduler
+{
+public:
+	static constexpr size_t STRAND_COUNT = 1024;
+
+	TaskScheduler() = default;
+	~TaskScheduler();
+	TaskScheduler(TaskScheduler const&) = delete;
+	TaskScheduler& operator=(TaskScheduler const&) = delete;
+
+	void start(size_t worker_count);
+	void stop();
+
+	void submit(TaskPtr task);
+
+	template<typename Iterable>
+	void submit_many(Iterable&& tasks) {
+		for (auto& task : tasks) {
+			submit(std::move(task));
+		}
+	}
+
+	size_t workerCount() const { return m_workers_.size(); }
+
+private:
+	struct Strand {
+		std::mutex m_mtx;
+		RingDeque<TaskPtr> m_tasks;
+		bool m_scheduled = false; // 已经在某个worker的m_strands里或者正在跑，由m_mtx保护
+	};
+
+	struct Worker {
+		std::mutex m_mtx;
+		RingDeque<size_t> m_strands; // 有任务待执行的串行队列下标
+		RingDeque<TaskPtr> m_local;
+
+		std::condition_variable m_cv;
+		bool m_sleeping = false; // 由m_sleep_mtx_保护
+		std::atomic<uint64_t> m_signal = 0;
+		std::thread m_thread;
+	};
+
+	static constexpr size_t NO_STRAND = static_cast<size_t>(-1);
+
+	// 要么是一个任务，要么是一个要跑一步的串行队列
+	struct Work {
+		TaskPtr m_task;
+		size_t m_strand = NO_STRAND;
+	};
+
+	void workerLoop(size_t index);
+	Work findWork(size_t index);
+	void runStrand(size_t strand, size_t index);
+	void dispatch(TaskPtr task, size_t from);
+	void enqueueStrand(size_t strand, size_t target, size_t from);
+	void wakeWorker(size_t index);
+	void wakeAnyIdle(size_t except);
+	size_t strandOf(SOCKET key) const;
+
+	std::vector<std::unique_ptr<Worker>> m_workers_;
+	std::unique_ptr<Strand[]> m_strands_;
+	std::mutex m_sleep_mtx_;
+	std::atomic<uint64_t> m_free_epoch_ = 0;
+	std::atomic<size_t> m_next_victim_ = 0;
+	std::atomic<bool> m_stop_ = false;
+};
+
+#endif
@@ -0,0 +1,188 @@
+﻿// 压缩对比基准：同一个带网格的形状分别用文本/二进制BRep、压缩/不压缩发过本机回环TCP，
+// 接收端用服务端同样的frame_decoder边收边解，统计线上字节数和端到端延迟(开始序列化负载到接收端拿到完整帧)
+#include "common/frame_decoder.hpp"
+#include "common/lz_codec.hpp"
+#include "common/socket_compat.hpp"
+
+#include <BinTools.hxx>
+#include <BRepTools.hxx>
+#include <BRep_Builder.hxx>
+#include <BRepMesh_IncrementalMesh.hxx>
+#include <BRepPrimAPI_MakeCylinder.hxx>
+#include <BRepPrimAPI_MakeSphere.hxx>
+#include <BRepPrimAPI_MakeTorus.hxx>
+#include <TopoDS_Compound.hxx>
+#include <gp_Ax2.hxx>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace {
+	using Clock = std::chrono::steady_clock;
+
+	TopoDS_Shape makeShape(int count)
+	{
+		BRep_Builder builder;
+		TopoDS_Compound compound;
+		builder.MakeCompound(compound);
+		for (int i = 0; i < count; ++i) {
+			gp_Ax2 axis(gp_Pnt(i * 30.0, (i % 7) * 30.0, (i % 3) * 30.0), gp_Dir(0, 0, 1));
+			switch (i % 3) {
+			case 0: builder.Add(compound, BRepPrimAPI_MakeSphere(axis, 10.0).Shape()); break;
+			case 1: builder.Add(compound, BRepPrimAPI_MakeCylinder(axis, 8.0, 20.0).Shape()); break;
+			default: builder.Add(compound, BRepPrimAPI_MakeTorus(axis, 10.0, 3.0).Shape()); break;
+			}
+		}
+		BRepMesh_IncrementalMesh(compound, 0.05); // 带上三角网格，接近实际发送的数据
+		return compound;
+	}
+
+	std::string serialize(TopoDS_Shape const& shape, payload_encoding encoding)
+	{
+		std::ostringstream oss;
+		if (encoding == payload_encoding::brep_binary) {
+			BinTools::Write(shape, oss);
+		}
+		else {
+			BRepTools::Write(shape, oss);
+		}
+		return oss.str();
+	}
+
+	bool sendAll(SOCKET fd, char const* data, size_t size)
+	{
+		while (size > 0) {
+			int chunk = static_cast<int>(std::min<size_t>(size, 1 << 30));
+			int sent = send(fd, data, chunk, 0);
+			if (sent <= 0) {
+				return false;
+			}
+			data += sent;
+			size -= static_cast<size_t>(sent);
+		}
+		return true;
+	}
+
+	struct Result {
+		size_t m_wire_bytes = 0;
+		double m_compress_ms = 0;
+		std::vector<double> m_latency_ms;
+	};
+
+	double percentile(std::vector<double> values, double p)
+	{
+		std::sort(values.begin(), values.end());
+		size_t index = static_cast<size_t>(p * static_cast<double>(values.size() - 1));
+		return values[index];
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int shape_count = argc > 1 ? std::atoi(argv[1]) : 200;
+	int repeat = argc > 2 ? std::atoi(argv[2]) : 10;
+
+	socket_context net;
+
+	// 本机回环连接
+	SOCKET listener = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port = 0;
+	inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+	socklen_t addr_len = sizeof(addr);
+	if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR
+		|| listen(listener, 1) == SOCKET_ERROR
+		|| getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &addr_len) == SOCKET_ERROR) {
+		std::cerr << "listen failed: " << last_socket_error() << std::endl;
+		return EXIT_FAILURE;
+	}
+	SOCKET sender = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(sender, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR) {
+		std::cerr << "connect failed: " << last_socket_error() << std::endl;
+		return EXIT_FAILURE;
+	}
+	SOCKET receiver = accept(listener, nullptr, nullptr);
+
+	// 接收端：和服务端一样用frame_decoder，记录每一帧完整到达的时间
+	std::vector<Clock::time_point> arrivals;
+	arrivals.reserve(static_cast<size_t>(repeat) * 4);
+	std::atomic<size_t> arrived = 0;
+	std::thread receive_thread([&] {
+		frame_decoder decoder;
+		while (true) {
+			auto target = decoder.prepare();
+			int n = recv(receiver, target.data(), static_cast<int>(std::min<size_t>(target.size(), 1 << 30)), 0);
+			if (n <= 0) {
+				return;
+			}
+			decoder.commit(static_cast<size_t>(n), [&](brep_frame&&) {
+				arrivals.push_back(Clock::now());
+				arrived.fetch_add(1, std::memory_order_release);
+			});
+		}
+	});
+
+	TopoDS_Shape shape = makeShape(shape_count);
+
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << "shapes: " << shape_count << ", repeat: " << repeat << "\n\n";
+	std::cout << std::left << std::setw(10) << "encoding" << std::setw(12) << "compressed"
+		<< std::setw(14) << "payload KB" << std::setw(14) << "wire KB" << std::setw(10) << "ratio"
+		<< std::setw(16) << "compress ms" << std::setw(14) << "p50 ms" << std::setw(14) << "p90 ms" << "\n";
+
+	for (auto encoding : { payload_encoding::brep_text, payload_encoding::brep_binary }) {
+		std::string payload = serialize(shape, encoding);
+		for (bool compress : { false, true }) {
+			Result result;
+			for (int i = 0; i < repeat; ++i) {
+				auto begin = Clock::now();
+				frame_header header;
+				header.m_encoding = encoding;
+				std::string compressed;
+				bytes_const_view body{ payload.data(), payload.size() };
+				if (compress) {
+					compressed = lz::compress_stream(body);
+					header.m_flags |= frame_flag_compressed;
+					body = bytes_const_view{ compressed.data(), compressed.size() };
+				}
+				result.m_compress_ms += std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+				header.m_payload_size = body.size();
+
+				size_t expected = arrived.load() + 1;
+				std::string head = header.encode();
+				if (!sendAll(sender, head.data(), head.size()) || !sendAll(sender, body.data(), body.size())) {
+					std::cerr << "send failed: " << last_socket_error() << std::endl;
+					return EXIT_FAILURE;
+				}
+				while (arrived.load(std::memory_order_acquire) < expected) {
+					std::this_thread::yield();
+				}
+				result.m_wire_bytes = head.size() + body.size();
+				result.m_latency_ms.push_back(std::chrono::duration<double, std::milli>(arrivals.back() - begin).count());
+			}
+
+			std::cout << std::setw(10) << (encoding == payload_encoding::brep_text ? "text" : "binary")
+				<< std::setw(12) << (compress ? "yes" : "no")
+				<< std::setw(14) << static_cast<double>(payload.size()) / 1024.0
+				<< std::setw(14) << static_cast<double>(result.m_wire_bytes) / 1024.0
+				<< std::setw(10) << static_cast<double>(payload.size()) / static_cast<double>(result.m_wire_bytes)
+				<< std::setw(16) << result.m_compress_ms / repeat
+				<< std::setw(14) << percentile(result.m_latency_ms, 0.5)
+				<< std::setw(14) << percentile(result.m_latency_ms, 0.9) << "\n";
+		}
+	}
+
+	closesocket(sender);
+	receive_thread.join();
+	closesocket(receiver);
+	closesocket(listener);
+	return EXIT_SUCCESS;
+}
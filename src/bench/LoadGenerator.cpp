@@ -0,0 +1,279 @@
+﻿// 接收吞吐量基准：N个模拟客户端同时按给定的速率往服务端发快照，统计帧/秒、MB/秒和发送延迟的分位数
+// 快照来自Save Session存下的会话文件(按原来的顺序回放)，或者用BRepPrimAPI现做的形状(按给定的负载大小拼成复合体)
+// 服务端不回应答，延迟是从计划发送的时刻到整帧交给内核：服务端接收跟不上时TCP窗口被填满，
+// 延迟随之上涨；按计划时刻而不是实际开始发送的时刻计算，排在后面的帧的等待也算在内
+//
+// load_generator [--host 127.0.0.1] [--port 12345] [--unix path] [--shm name]
+//                [--clients 4] [--frames 200] [--rate 0] [--size 262144] [--unique 16]
+//                [--encoding binary|text] [--compress-threshold 65536] [--replay session.gdbs]
+// --frames是每个客户端发的帧数，--rate是每个客户端每秒的帧数(0表示不限速)，
+// --unique是现做几个不同的形状，--size是每个形状序列化后大约的字节数
+#include "client/RemoteDebugTools.hpp"
+#include "common/session_file.hpp"
+
+#include <BRepBuilderAPI_Transform.hxx>
+#include <BRepPrimAPI_MakeBox.hxx>
+#include <BRepPrimAPI_MakeCylinder.hxx>
+#include <BRepPrimAPI_MakeSphere.hxx>
+#include <BRep_Builder.hxx>
+#include <TopoDS_Compound.hxx>
+#include <gp_Ax2.hxx>
+#include <gp_Trsf.hxx>
+#include <gp_Vec.hxx>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+	using Clock = std::chrono::steady_clock;
+
+	struct Options {
+		std::string m_host = "127.0.0.1";
+		int m_port = 12345;
+		std::string m_unix_path;
+		std::string m_shm_name;
+		size_t m_clients = 4;
+		size_t m_frames = 200;
+		double m_rate = 0;
+		size_t m_size = 256 * 1024;
+		size_t m_unique = 16;
+		payload_encoding m_encoding = payload_encoding::brep_binary;
+		size_t m_compression_threshold = 64 * 1024;
+		std::string m_replay;
+	};
+
+	struct Payload {
+		std::string m_data;
+		payload_encoding m_encoding = payload_encoding::brep_binary;
+	};
+
+	// 每个客户端线程的结果，结束后汇总
+	struct Result {
+		size_t m_sent = 0;
+		size_t m_failed = 0;
+		uint64_t m_bytes = 0;
+		std::vector<double> m_latency_ms;
+	};
+
+	bool parseOptions(int argc, char* argv[], Options& options)
+	{
+		for (int i = 1; i < argc; ++i) {
+			std::string name = argv[i];
+			if (i + 1 >= argc) {
+				std::cerr << "missing value for " << name << std::endl;
+				return false;
+			}
+			char const* value = argv[++i];
+			if (name == "--host") options.m_host = value;
+			else if (name == "--port") options.m_port = std::atoi(value);
+			else if (name == "--unix") options.m_unix_path = value;
+			else if (name == "--shm") options.m_shm_name = value;
+			else if (name == "--clients") options.m_clients = std::strtoull(value, nullptr, 10);
+			else if (name == "--frames") options.m_frames = std::strtoull(value, nullptr, 10);
+			else if (name == "--rate") options.m_rate = std::atof(value);
+			else if (name == "--size") options.m_size = std::strtoull(value, nullptr, 10);
+			else if (name == "--unique") options.m_unique = std::strtoull(value, nullptr, 10);
+			else if (name == "--encoding") options.m_encoding = std::strcmp(value, "text") == 0 ? payload_encoding::brep_text : payload_encoding::brep_binary;
+			else if (name == "--compress-threshold") options.m_compression_threshold = std::strtoull(value, nullptr, 10);
+			else if (name == "--replay") options.m_replay = value;
+			else {
+				std::cerr << "unknown option " << name << std::endl;
+				return false;
+			}
+		}
+		options.m_clients = std::max<size_t>(options.m_clients, 1);
+		options.m_unique = std::max<size_t>(options.m_unique, 1);
+		return true;
+	}
+
+	TopoDS_Shape makePrimitive(int i)
+	{
+		gp_Ax2 axis(gp_Pnt((i % 16) * 30.0, (i / 16 % 16) * 30.0, (i / 256) * 30.0), gp_Dir(0, 0, 1));
+		switch (i % 3) {
+		case 0: return BRepPrimAPI_MakeBox(axis, 10.0, 15.0, 20.0).Shape();
+		case 1: return BRepPrimAPI_MakeSphere(axis, 10.0).Shape();
+		default: return BRepPrimAPI_MakeCylinder(axis, 8.0, 20.0).Shape();
+		}
+	}
+
+	// 第variant个形状：同样的图元整体平移，内容各不相同，服务端不会把它们去重成一个
+	TopoDS_Shape makeShape(int primitives, int variant)
+	{
+		BRep_Builder builder;
+		TopoDS_Compound compound;
+		builder.MakeCompound(compound);
+		gp_Trsf move;
+		move.SetTranslation(gp_Vec(variant * 7.0, variant * 3.0, variant * 5.0));
+		for (int i = 0; i < primitives; ++i) {
+			builder.Add(compound, BRepBuilderAPI_Transform(makePrimitive(i), move, true).Shape());
+		}
+		return compound;
+	}
+
+	std::vector<Payload> makeSynthetic(Options const& options)
+	{
+		// 先量一下每个图元序列化后多大，再按目标大小决定图元个数
+		size_t per_primitive = std::max<size_t>(shapeToBRep(makeShape(8, 0), options.m_encoding).size() / 8, 1);
+		int primitives = static_cast<int>(std::max<size_t>(options.m_size / per_primitive, 1));
+		std::vector<Payload> payloads(options.m_unique);
+		for (size_t i = 0; i < payloads.size(); ++i) {
+			payloads[i].m_data = shapeToBRep(makeShape(primitives, static_cast<int>(i)), options.m_encoding);
+			payloads[i].m_encoding = options.m_encoding;
+		}
+		return payloads;
+	}
+
+	// 整个会话文件读进内存，计时的时候不读盘
+	bool loadReplay(std::string const& path, std::vector<Payload>& payloads)
+	{
+		session_file::reader reader;
+		std::error_code ec;
+		if (!reader.open(path, ec)) {
+			std::cerr << "failed to open " << path << ": " << ec.message() << std::endl;
+			return false;
+		}
+		payloads.resize(reader.entries().size());
+		for (size_t i = 0; i < payloads.size(); ++i) {
+			auto frame = reader.load(i, ec);
+			if (!frame) {
+				std::cerr << "failed to read snapshot " << i << " of " << path << ": " << ec.message() << std::endl;
+				return false;
+			}
+			payloads[i].m_data.assign(frame->payload().data(), frame->payload().size());
+			payloads[i].m_encoding = frame->m_encoding;
+		}
+		return !payloads.empty();
+	}
+
+	double percentile(std::vector<double> const& sorted, double p)
+	{
+		if (sorted.empty()) {
+			return 0;
+		}
+		return sorted[static_cast<size_t>(p * static_cast<double>(sorted.size() - 1))];
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!parseOptions(argc, argv, options)) {
+		return EXIT_FAILURE;
+	}
+
+	std::vector<Payload> payloads;
+	if (!options.m_replay.empty()) {
+		if (!loadReplay(options.m_replay, payloads)) {
+			return EXIT_FAILURE;
+		}
+	}
+	else {
+		payloads = makeSynthetic(options);
+	}
+	uint64_t payload_bytes = 0;
+	for (auto& payload : payloads) {
+		payload_bytes += payload.m_data.size();
+	}
+
+	// 先全部连上，再从同一个时刻开始发
+	std::atomic<bool> reported = false;
+	std::vector<std::unique_ptr<Client>> clients;
+	for (size_t i = 0; i < options.m_clients; ++i) {
+		auto client = std::make_unique<Client>();
+		client->withCompressionThreshold(options.m_compression_threshold)
+			.withErrorHandler([&reported](std::error_code ec, const std::string& what) {
+				// 服务端断开之后每一帧都会失败，只报第一次
+				if (!reported.exchange(true)) {
+					std::cerr << what << ". Error: " << ec.value() << " " << ec.message() << std::endl;
+				}
+			});
+		if (!options.m_shm_name.empty()) {
+			client->connectSharedMemory(options.m_shm_name);
+		}
+		else if (!options.m_unix_path.empty()) {
+			client->connectUnixSocket(options.m_unix_path);
+		}
+		else {
+			client->connectServer(options.m_host, options.m_port);
+		}
+		if (!client->isConnected()) {
+			return EXIT_FAILURE;
+		}
+		clients.push_back(std::move(client));
+	}
+
+	std::vector<Result> results(options.m_clients);
+	std::vector<std::thread> threads;
+	auto interval = options.m_rate > 0
+		? std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / options.m_rate))
+		: Clock::duration::zero();
+	auto begin = Clock::now() + std::chrono::milliseconds(10);
+	for (size_t c = 0; c < options.m_clients; ++c) {
+		threads.emplace_back([&, c] {
+			Client& client = *clients[c];
+			Result& result = results[c];
+			result.m_latency_ms.reserve(options.m_frames);
+			std::this_thread::sleep_until(begin);
+			for (size_t i = 0; i < options.m_frames; ++i) {
+				// 不限速时每帧发完紧接着发下一帧
+				auto planned = interval == Clock::duration::zero() ? Clock::now() : begin + interval * static_cast<Clock::rep>(i);
+				std::this_thread::sleep_until(planned);
+				// 各客户端错开起点，同一时刻发的不是同一个快照
+				Payload const& payload = payloads[(c * payloads.size() / options.m_clients + i) % payloads.size()];
+				if (client.sendBrepData(payload.m_data, payload.m_encoding)) {
+					++result.m_sent;
+					result.m_bytes += payload.m_data.size();
+					result.m_latency_ms.push_back(std::chrono::duration<double, std::milli>(Clock::now() - planned).count());
+				}
+				else {
+					++result.m_failed;
+				}
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+	Result total;
+	for (auto& result : results) {
+		total.m_sent += result.m_sent;
+		total.m_failed += result.m_failed;
+		total.m_bytes += result.m_bytes;
+		total.m_latency_ms.insert(total.m_latency_ms.end(), result.m_latency_ms.begin(), result.m_latency_ms.end());
+	}
+	std::sort(total.m_latency_ms.begin(), total.m_latency_ms.end());
+
+	std::cout << std::fixed << std::setprecision(2)
+		<< "source:        " << (options.m_replay.empty() ? "synthetic" : options.m_replay) << ", " << payloads.size()
+		<< " snapshots, avg " << static_cast<double>(payload_bytes) / static_cast<double>(payloads.size()) / 1024.0 << " KB\n"
+		<< "clients:       " << options.m_clients << " x " << options.m_frames << " frames, ";
+	if (options.m_rate > 0) {
+		std::cout << options.m_rate << " frames/s each\n";
+	}
+	else {
+		std::cout << "unthrottled\n";
+	}
+	std::cout
+		<< "sent:          " << total.m_sent << ", failed: " << total.m_failed << " in " << seconds << " s\n"
+		<< "frames/s:      " << static_cast<double>(total.m_sent) / seconds << "\n"
+		<< "MB/s:          " << static_cast<double>(total.m_bytes) / (1024.0 * 1024.0) / seconds << "\n"
+		<< "latency ms:    p50 " << percentile(total.m_latency_ms, 0.5)
+		<< "  p90 " << percentile(total.m_latency_ms, 0.9)
+		<< "  p99 " << percentile(total.m_latency_ms, 0.99)
+		<< "  max " << percentile(total.m_latency_ms, 1.0) << std::endl;
+
+	// 析构Client时关闭连接
+	clients.clear();
+	return total.m_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,180 @@
+﻿// 调度器空转的分配次数基准，统计预热之后每轮的堆分配次数：
+// 一是任务在重试路径上反复把自己/同类任务作为续作返回；二是像reactor那样在非worker线程上创建任务、交给worker执行和释放
+#include "server/TaskScheduler.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+namespace {
+	std::atomic<size_t> g_alloc_count = 0;
+
+	constexpr size_t WARMUP_ROUNDS = 10'000;
+	size_t g_measure_from = 0; // 倒数到这一轮时预热结束
+	std::atomic<size_t> g_alloc_after_warmup = 0;
+	std::atomic<size_t> g_alloc_at_end = 0;
+	std::atomic<bool> g_finished = false;
+
+	std::atomic<size_t> g_ready_done = 0;
+	constexpr size_t MAX_IN_FLIGHT = 64;
+	constexpr SOCKET CONNECTION_COUNT = 8;
+}
+
+void* operator new(size_t size)
+{
+	g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	std::free(p);
+}
+
+class PingTask;
+
+// 模拟WaitingDrawTask：没等到就把自己作为续作返回
+class RetryTask : public Task
+{
+public:
+	RetryTask(size_t rounds, size_t retries) : m_rounds_(rounds), m_retries_(retries) {}
+	TaskList run() override;
+	SOCKET affinity() const override { return 1; }
+
+private:
+	size_t m_rounds_;
+	size_t m_retries_;
+};
+
+// 模拟BrepDataSetTask和WaitingDrawTask之间的来回切换，每轮都通过对象池创建新任务
+class PingTask : public Task
+{
+public:
+	PingTask(size_t rounds) : m_rounds_(rounds) {}
+	TaskList run() override {
+		return { makeTask<RetryTask>(m_rounds_, 3) };
+	}
+	SOCKET affinity() const override { return 1; }
+
+private:
+	size_t m_rounds_;
+};
+
+// 模拟BrepDataReceiveTask：由reactor线程创建，在worker上跑完就释放
+class ReadyTask : public Task
+{
+public:
+	ReadyTask(SOCKET connection) : m_connection_(connection) {}
+	TaskList run() override {
+		g_ready_done.fetch_add(1, std::memory_order_release);
+		return {};
+	}
+	SOCKET affinity() const override { return m_connection_; }
+
+private:
+	SOCKET m_connection_;
+};
+
+TaskList RetryTask::run()
+{
+	if (m_retries_ > 0) {
+		--m_retries_;
+		return { self() };
+	}
+	if (m_rounds_ == g_measure_from) {
+		g_alloc_after_warmup = g_alloc_count.load();
+	}
+	if (m_rounds_ == 0) {
+		g_alloc_at_end = g_alloc_count.load();
+		g_finished = true;
+		return {};
+	}
+	return { makeTask<PingTask>(m_rounds_ - 1) };
+}
+
+namespace {
+	bool benchRetry(size_t rounds, size_t workers)
+	{
+		g_measure_from = rounds - WARMUP_ROUNDS;
+
+		TaskScheduler scheduler;
+		scheduler.start(workers);
+
+		auto begin = std::chrono::steady_clock::now();
+		scheduler.submit(makeTask<PingTask>(rounds));
+		while (!g_finished) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		auto end = std::chrono::steady_clock::now();
+		scheduler.stop();
+
+		// 每轮 = 1个PingTask + 4次RetryTask
+		size_t measured = g_measure_from;
+		size_t allocations = g_alloc_at_end - g_alloc_after_warmup;
+		double seconds = std::chrono::duration<double>(end - begin).count();
+		std::cout << "[retry on workers]\n"
+			<< "workers:               " << workers << "\n"
+			<< "rounds:                " << rounds << "\n"
+			<< "task runs/s:           " << static_cast<double>(rounds * 5) / seconds << "\n"
+			<< "allocations measured:  " << allocations << " over " << measured << " rounds\n"
+			<< "allocations per round: " << static_cast<double>(allocations) / static_cast<double>(measured) << std::endl;
+		return allocations == 0;
+	}
+
+	// 当前线程当reactor：每轮创建一个有affinity的任务提交出去，最多MAX_IN_FLIGHT个没跑完
+	bool benchReactor(size_t rounds, size_t workers)
+	{
+		TaskScheduler scheduler;
+		scheduler.start(workers);
+
+		size_t alloc_after_warmup = 0;
+		auto begin = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < rounds; ++i) {
+			if (i == WARMUP_ROUNDS) {
+				alloc_after_warmup = g_alloc_count.load();
+			}
+			while (i - g_ready_done.load(std::memory_order_acquire) >= MAX_IN_FLIGHT) {
+				std::this_thread::yield();
+			}
+			scheduler.submit(makeTask<ReadyTask>(static_cast<SOCKET>(i % CONNECTION_COUNT)));
+		}
+		while (g_ready_done.load(std::memory_order_acquire) < rounds) {
+			std::this_thread::yield();
+		}
+		size_t allocations = g_alloc_count.load() - alloc_after_warmup;
+		auto end = std::chrono::steady_clock::now();
+		scheduler.stop();
+
+		size_t measured = rounds - WARMUP_ROUNDS;
+		double seconds = std::chrono::duration<double>(end - begin).count();
+		std::cout << "[created on reactor thread]\n"
+			<< "workers:               " << workers << "\n"
+			<< "rounds:                " << rounds << "\n"
+			<< "task runs/s:           " << static_cast<double>(rounds) / seconds << "\n"
+			<< "allocations measured:  " << allocations << " over " << measured << " rounds\n"
+			<< "allocations per round: " << static_cast<double>(allocations) / static_cast<double>(measured) << std::endl;
+		return allocations == 0;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t rounds = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1'000'000;
+	size_t workers = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1;
+	if (rounds <= WARMUP_ROUNDS) {
+		rounds = WARMUP_ROUNDS + 1;
+	}
+
+	bool retry_ok = benchRetry(rounds, workers);
+	bool reactor_ok = benchReactor(rounds, workers);
+	return retry_ok && reactor_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
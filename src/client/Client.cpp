@@ -7,7 +7,9 @@
 
 int main() {
     Client c;
-    c.connectServer("127.0.0.1", 12345);
+    // 异步发送：sendBrepData只把快照放进队列，服务端慢或者没开时也不会卡住这里，队列满了丢掉最旧的
+    c.withAsyncSender(8, Client::OverflowPolicy::DropOldest)
+        .connectServer("127.0.0.1", 12345);
 
     // 创建几何对象
     TopoDS_Shape shape1 = createLine({ 0,0,0 }, { 100,100,100 });
@@ -17,8 +19,12 @@ int main() {
     std::string brepData = shapeToBRep(shape1);
     c.sendBrepData(brepData);
 
-    brepData = shapeToBRep(shape2);
-    c.sendBrepData(brepData);
+    // 大模型用二进制格式，直接序列化进发送缓冲区
+    c.sendShape(shape2, payload_encoding::brep_binary);
+
+    c.flush(std::chrono::seconds(1));
+    auto stats = c.stats();
+    std::cout << "sent: " << stats.sent << ", dropped: " << stats.dropped << ", failed: " << stats.failed << std::endl;
 
     int a;
     std::cin >> a;
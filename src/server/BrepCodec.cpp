@@ -0,0 +1,36 @@
+﻿#include "server/BrepCodec.h"
+
+#include "common/bytes_stream.hpp"
+
+#include <BinTools.hxx>
+#include <BRepTools.hxx>
+#include <BRep_Builder.hxx>
+#include <Standard_Failure.hxx>
+
+#include <iostream>
+
+TopoDS_Shape decodeBrepPayload(payload_encoding encoding, bytes_const_view payload, const Message_ProgressRange& progress)
+{
+	TopoDS_Shape shape;
+	bytes_istream iss(payload);
+	try {
+		switch (encoding) {
+		case payload_encoding::brep_binary:
+			BinTools::Read(shape, iss, progress);
+			break;
+		case payload_encoding::brep_text:
+		default:
+			BRep_Builder builder;
+			BRepTools::Read(shape, iss, builder, progress);
+			break;
+		}
+	}
+	catch (Standard_Failure const& e) {
+		std::cerr << "decodeBrepPayload: " << e.GetMessageString() << std::endl;
+		shape.Nullify();
+	}
+	if (progress.UserBreak()) {
+		shape.Nullify(); // 读到一半被取消的形状不完整
+	}
+	return shape;
+}
@@ -0,0 +1,86 @@
+﻿#include "server/ConnectionRegistry.h"
+
+#include <algorithm>
+#include <functional>
+#include <utility>
+
+ConnectionRegistry::Shard& ConnectionRegistry::shardOf(SOCKET id) const noexcept
+{
+	return m_shards_[std::hash<SOCKET>{}(id) % SHARD_COUNT];
+}
+
+ConnectionHandle ConnectionRegistry::find(SOCKET id) const
+{
+	Shard& shard = shardOf(id);
+	std::shared_lock lck(shard.m_mtx);
+	auto it = shard.m_connections.find(id);
+	return it != shard.m_connections.end() ? it->second : nullptr;
+}
+
+ConnectionHandle ConnectionRegistry::add(SOCKET id, uint64_t serial, std::string peer)
+{
+	auto connection = std::make_shared<ConnectionInfo>();
+	connection->m_id = id;
+	connection->m_serial = serial;
+	connection->m_peer = std::move(peer);
+	{
+		Shard& shard = shardOf(id);
+		std::unique_lock lck(shard.m_mtx);
+		shard.m_connections[id] = connection;
+	}
+
+	std::unique_lock lck(m_list_mtx_);
+	std::vector<ConnectionSummary> list = *m_list_.load();
+	list.push_back(ConnectionSummary{ id, serial, connection->m_peer });
+	m_list_.store(std::move(list));
+	return connection;
+}
+
+ConnectionHandle ConnectionRegistry::remove(SOCKET id)
+{
+	ConnectionHandle connection;
+	{
+		Shard& shard = shardOf(id);
+		std::unique_lock lck(shard.m_mtx);
+		auto it = shard.m_connections.find(id);
+		if (it == shard.m_connections.end()) {
+			return nullptr;
+		}
+		connection = std::move(it->second);
+		shard.m_connections.erase(it);
+	}
+
+	{
+		// 新连接可能已经成了当前连接，只在当前的还是它时置空
+		std::unique_lock lck(m_current_mtx_);
+		if (*m_current_.load() == connection) {
+			m_current_.store(ConnectionHandle());
+			m_current_id_.store(INVALID_SOCKET, std::memory_order_release);
+		}
+	}
+
+	std::unique_lock lck(m_list_mtx_);
+	std::vector<ConnectionSummary> list = *m_list_.load();
+	list.erase(std::remove_if(list.begin(), list.end(),
+		[&](ConnectionSummary const& summary) { return summary.m_serial == connection->m_serial; }), list.end());
+	m_list_.store(std::move(list));
+	return connection;
+}
+
+ConnectionHandle ConnectionRegistry::current() const
+{
+	return *m_current_.load();
+}
+
+void ConnectionRegistry::setCurrent(ConnectionHandle connection)
+{
+	SOCKET id = connection ? connection->m_id : INVALID_SOCKET;
+	std::unique_lock lck(m_current_mtx_);
+	m_current_.store(std::move(connection));
+	m_current_id_.store(id, std::memory_order_release);
+}
+
+std::shared_ptr<const std::vector<ConnectionSummary>> ConnectionRegistry::list() const
+{
+	return m_list_.load();
+}
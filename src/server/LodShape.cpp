@@ -0,0 +1,24 @@
+﻿#include "server/LodShape.h"
+
+#include <utility>
+
+void LodShape::Compute(const Handle(PrsMgr_PresentationManager)& manager,
+	const Handle(Prs3d_Presentation)& presentation,
+	const Standard_Integer mode)
+{
+	if (mode < COARSE_MODE_OFFSET) {
+		AIS_Shape::Compute(manager, presentation, mode);
+		return;
+	}
+
+	// 借用AIS_Shape的实现，临时把myshape换成粗糙层级；只在GUI线程上调用
+	std::swap(myshape, m_coarse_);
+	try {
+		AIS_Shape::Compute(manager, presentation, mode - COARSE_MODE_OFFSET);
+	}
+	catch (...) {
+		std::swap(myshape, m_coarse_);
+		throw;
+	}
+	std::swap(myshape, m_coarse_);
+}
@@ -1,10 +1,20 @@
 ﻿// mainwindow.cpp
-#include "server/mainwindow.h"
+#include "server/MainWindow.h"
 #include <BRepPrimAPI_MakeBox.hxx>
 #include <AIS_Shape.hxx>
 //#include <QtConcurrent>
 #include <QAction>
+#include <QCoreApplication>
+#include <QDir>
+#include <QDockWidget>
+#include <QFileDialog>
+#include <QStatusBar>
 #include <QToolBar>
+
+#include <iostream>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
 MainWindow::MainWindow(QWidget* parent)
     : QMainWindow(parent)
 {
@@ -18,14 +28,59 @@ MainWindow::MainWindow(QWidget* parent)
     tool_bar->addAction(forward_action);
     tool_bar->addAction(toggle_action);
 
+    QAction* open_action = new QAction(QIcon::fromTheme("document-open"), "Open Session", this);
+    QAction* save_action = new QAction(QIcon::fromTheme("document-save"), "Save Session", this);
+    tool_bar->addAction(open_action);
+    tool_bar->addAction(save_action);
+
     m_occt_viewer_ = new OcctViewer(this);
-    m_server_ = new MyServer(this);
+    m_server_ = std::make_unique<MyServer>();
     setCentralWidget(m_occt_viewer_);
 
-    connect(m_server_, &MyServer::sigDrawDataReady, m_occt_viewer_, &OcctViewer::drawBrepData);
-    connect(forward_action, &QAction::triggered, m_server_, &MyServer::onMoveNextBrep);
-    connect(back_action, &QAction::triggered, m_server_, &MyServer::onMovePreviousBrep);
-    connect(toggle_action, &QAction::toggled, m_server_, &MyServer::onUpdateMode);
+    QDockWidget* connection_dock = new QDockWidget("Connections", this);
+    m_connection_list_ = new QListWidget(connection_dock);
+    connection_dock->setWidget(m_connection_list_);
+    addDockWidget(Qt::LeftDockWidgetArea, connection_dock);
+
+    // 服务端的通知大多来自worker线程，都转到GUI线程处理
+    ServerEvents events;
+    events.m_draw_data_ready = [viewer = m_occt_viewer_] {
+        QMetaObject::invokeMethod(viewer, &OcctViewer::drawBrepData, Qt::QueuedConnection);
+    };
+    events.m_shape_refined = [viewer = m_occt_viewer_] {
+        QMetaObject::invokeMethod(viewer, &OcctViewer::onShapeRefined, Qt::QueuedConnection);
+    };
+    events.m_connections_changed = [this] {
+        QMetaObject::invokeMethod(this, &MainWindow::refreshConnections, Qt::QueuedConnection);
+    };
+    events.m_session_message = [this](std::string message) {
+        QMetaObject::invokeMethod(this, [this, message = QString::fromStdString(message)] {
+            statusBar()->showMessage(message);
+        }, Qt::QueuedConnection);
+    };
+    m_server_->withEvents(std::move(events));
+    connect(m_occt_viewer_, &OcctViewer::snapshotDrawn, this, [this] { m_server_->onSnapshotDrawn(); });
+    connect(m_occt_viewer_, &OcctViewer::statusMessage, this, [this](const QString& message) {
+        statusBar()->showMessage(message);
+    });
+    connect(open_action, &QAction::triggered, this, [this] {
+        QString path = QFileDialog::getOpenFileName(this, "Open Session", QString(), "Session (*.gdbs);;All files (*)");
+        if (!path.isEmpty()) {
+            openSession(path);
+        }
+    });
+    connect(save_action, &QAction::triggered, this, [this] {
+        QString path = QFileDialog::getSaveFileName(this, "Save Session", QString(), "Session (*.gdbs)");
+        if (!path.isEmpty()) {
+            m_server_->onSaveSession(path.toStdString());
+        }
+    });
+    connect(m_connection_list_, &QListWidget::itemClicked, this, [this](QListWidgetItem* item) {
+        m_server_->onSelectConnection(item->data(Qt::UserRole).toULongLong());
+    });
+    connect(forward_action, &QAction::triggered, this, [this] { m_server_->onMoveNextBrep(); });
+    connect(back_action, &QAction::triggered, this, [this] { m_server_->onMovePreviousBrep(); });
+    connect(toggle_action, &QAction::toggled, this, [this](bool checked) { m_server_->onUpdateMode(checked); });
 	connect(toggle_action, &QAction::toggled, [=](bool checked) {
 		if (checked) {
 			back_action->setEnabled(false);
@@ -38,5 +93,60 @@ MainWindow::MainWindow(QWidget* parent)
 
     toggle_action->setChecked(true);
 
-    m_server_->withListenPort("127.0.0.1", "12345").run();
+    // 过夜跑的时候历史很长，超出内存预算的快照写进临时文件
+    m_server_->withSessionLog(QDir::temp().filePath(QString("geomdebug-%1.log").arg(QCoreApplication::applicationPid())).toStdString());
+    m_server_->withListenPort("127.0.0.1", "12345");
+    // 同机传输的名字按用户和进程区分，同一台机器上的多个用户、多个服务端互不冲突；
+    // 环境变量GEOMDEBUG_SHM_NAME/GEOMDEBUG_UNIX_SOCKET可以指定固定的名字。起不来(被占用、不支持)只记一下，TCP照常工作
+    QStringList endpoints("127.0.0.1:12345");
+#if defined(__linux__)
+    QString shm_name = QString("%1-%2").arg(getuid()).arg(QCoreApplication::applicationPid());
+    if (!qEnvironmentVariableIsEmpty("GEOMDEBUG_SHM_NAME")) {
+        shm_name = QString::fromLocal8Bit(qgetenv("GEOMDEBUG_SHM_NAME"));
+    }
+    try {
+        m_server_->withSharedMemory(shm_name.toStdString());
+        endpoints << QString("shm %1").arg(shm_name);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Shared memory transport disabled: " << e.what() << std::endl;
+    }
+#endif
+#if !defined(_WIN32)
+    QString runtime_dir = qEnvironmentVariableIsEmpty("XDG_RUNTIME_DIR") ? QDir::tempPath() : QString::fromLocal8Bit(qgetenv("XDG_RUNTIME_DIR"));
+    QString unix_path = QDir(runtime_dir).filePath(QString("geomdebug-%1-%2.sock").arg(getuid()).arg(QCoreApplication::applicationPid()));
+    if (!qEnvironmentVariableIsEmpty("GEOMDEBUG_UNIX_SOCKET")) {
+        unix_path = QString::fromLocal8Bit(qgetenv("GEOMDEBUG_UNIX_SOCKET"));
+    }
+    try {
+        m_server_->withUnixSocket(unix_path.toStdString());
+        endpoints << QString("unix %1").arg(unix_path);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Unix socket transport disabled: " << e.what() << std::endl;
+    }
+#endif
+    m_server_->run();
+    statusBar()->showMessage("Listening on " + endpoints.join(", "));
+}
+
+void MainWindow::openSession(const QString& path)
+{
+    m_server_->onOpenSession(path.toStdString());
+}
+
+void MainWindow::refreshConnections()
+{
+    auto connections = m_server_->connections();
+    SOCKET current = m_server_->currentConnectionId();
+    m_connection_list_->clear();
+    for (auto& connection : *connections) {
+        auto* item = new QListWidgetItem(QString("#%1  %2")
+            .arg(static_cast<qulonglong>(connection.m_serial))
+            .arg(QString::fromStdString(connection.m_peer)), m_connection_list_);
+        item->setData(Qt::UserRole, static_cast<qulonglong>(connection.m_serial));
+        if (connection.m_id == current) {
+            m_connection_list_->setCurrentItem(item);
+        }
+    }
 }
@@ -1,16 +1,18 @@
 ﻿// occtviewer.cpp
-#include "server/OcctViewer.h"
+#include "server/OCCTViewer.h"
 #include <Aspect_DisplayConnection.hxx>
 #include <OpenGl_GraphicDriver.hxx>
 #include <BRepTools.hxx>
 #include <BRep_Builder.hxx>
 #include <TopoDS_Shape.hxx>
-#include <AIS_Shape.hxx>
 #include <V3d_View.hxx>
 #include <V3d_Viewer.hxx>
 
 #include "server/Server.h"
 
+#include <algorithm>
+#include <utility>
+
 #ifdef _WIN32
 #include <WNT_Window.hxx>
 #else
@@ -36,20 +38,158 @@ OcctViewer::~OcctViewer()
 
 void OcctViewer::drawBrepData()
 {
-	TopoDS_Shape shape;
-    std::istringstream iss(getCriticalSection().m_brep_data.value());
-    BRep_Builder builder;
-    BRepTools::Read(shape, iss, builder);
+    auto snapshot = getCriticalSection().m_brep_data.load();
+
+    // 形状已经在worker上解析、剖分并拆好了部分，这里只做显示
+    ShapeCache::EntryPtr entry = snapshot->m_entry;
+    if (!entry) {
+        emit snapshotDrawn(); // 解析失败的帧直接跳过，不要卡住后面的帧
+        return;
+    }
+    // 缓存里可能已经换上了精细网格
+    if (auto cached = getCriticalSection().m_shape_cache.find(snapshot->m_key)) {
+        entry = std::move(cached);
+    }
+
+    restoreFineLevel();
+    updateScene(entry->m_parts);
+    mContext->UpdateCurrentViewer();
+    mDisplayedKey = snapshot->m_key;
+    emit snapshotDrawn();
+
+    mCoalesced = snapshot->m_coalesced;
+    showTiming(entry->m_timing);
+}
+
+void OcctViewer::updateScene(const std::vector<ScenePart>& parts)
+{
+    // 哈希相同的部分保留原来的AIS对象，只显示新出现的、隐藏消失了的，AIS上的开销和变化的部分成正比
+    std::unordered_map<uint64_t, PartPresentation> scene;
+    scene.reserve(parts.size());
+    for (const auto& part : parts) {
+        PartPresentation shown;
+        auto it = mScene.find(part.m_hash);
+        if (it != mScene.end()) {
+            shown = std::move(it->second);
+            mScene.erase(it);
+            refinePart(shown, part);
+        }
+        else {
+            shown = takeHidden(part.m_hash);
+            if (shown.m_shape.IsNull()) {
+                shown = PartPresentation{ new LodShape(part.m_shape, part.m_coarse), part.m_cost };
+            }
+            else {
+                refinePart(shown, part);
+            }
+            mContext->Display(shown.m_shape, Standard_False);
+        }
+        scene.emplace(part.m_hash, std::move(shown));
+    }
+    // 剩下的是这个快照里没有的部分
+    for (auto& [hash, shown] : mScene) {
+        mContext->Erase(shown.m_shape, Standard_False);
+        hidePart(hash, std::move(shown));
+    }
+    mScene = std::move(scene);
+}
+
+bool OcctViewer::refinePart(PartPresentation& shown, const ScenePart& part)
+{
+    // 已经是精细网格的不动，几何相同的部分可能来自别的快照，网格略有不同也没关系
+    if (shown.m_shape->hasCoarseLevel() || part.m_shape.IsEqual(part.m_coarse)) {
+        return false;
+    }
+    shown.m_shape->Set(part.m_shape);
+    shown.m_cost = part.m_cost;
+    mContext->Redisplay(shown.m_shape, Standard_False);
+    return true;
+}
 
-    if (shape.IsNull()) {
-        throw;
+void OcctViewer::hidePart(uint64_t hash, PartPresentation part)
+{
+    mHiddenBytes += part.m_cost;
+    mHidden.emplace_front(hash, std::move(part));
+    mHiddenIndex[hash] = mHidden.begin();
+
+    size_t budget = getCriticalSection().m_shape_cache.budget() / HIDDEN_BUDGET_SHARE;
+    while (!mHidden.empty() && (mHidden.size() > HIDDEN_PART_LIMIT || mHiddenBytes > budget)) {
+        auto& oldest = mHidden.back();
+        mContext->Remove(oldest.second.m_shape, Standard_False);
+        mHiddenBytes -= oldest.second.m_cost;
+        mHiddenIndex.erase(oldest.first);
+        mHidden.pop_back();
     }
+}
 
-    // 显示形状
-    Handle(AIS_Shape) aisShape = new AIS_Shape(shape);
-    mContext->EraseAll(Standard_False);  // 清除之前的显示
-    mContext->Display(aisShape, Standard_True);  // 显示新形状
-    getCriticalSection().m_has_drawn = true;
+OcctViewer::PartPresentation OcctViewer::takeHidden(uint64_t hash)
+{
+    auto it = mHiddenIndex.find(hash);
+    if (it == mHiddenIndex.end()) {
+        return {};
+    }
+    PartPresentation part = std::move(it->second->second);
+    mHiddenBytes -= part.m_cost;
+    mHidden.erase(it->second);
+    mHiddenIndex.erase(it);
+    return part;
+}
+
+void OcctViewer::onShapeRefined()
+{
+    if (mContext.IsNull() || mScene.empty()) {
+        return;
+    }
+    // 只替换正在显示的快照，其他的下次显示时再换；Set+Redisplay不动相机
+    auto cached = getCriticalSection().m_shape_cache.find(mDisplayedKey);
+    if (!cached || !cached->m_refined) {
+        return;
+    }
+    bool changed = false;
+    for (const auto& part : cached->m_parts) {
+        auto it = mScene.find(part.m_hash);
+        if (it != mScene.end()) {
+            changed |= refinePart(it->second, part);
+        }
+    }
+    if (changed) {
+        mContext->UpdateCurrentViewer();
+        showTiming(cached->m_timing);
+    }
+}
+
+void OcctViewer::showTiming(const SnapshotTiming& timing)
+{
+    QString message;
+    if (timing.m_mesh_ms == 0 && timing.m_coarse_mesh_ms > 0) {
+        message = QString("decode %1 ms, coarse mesh %2 ms, %3 triangles, refining...")
+            .arg(timing.m_decode_ms, 0, 'f', 1)
+            .arg(timing.m_coarse_mesh_ms, 0, 'f', 1)
+            .arg(static_cast<qulonglong>(timing.m_triangles));
+    }
+    else {
+        message = QString("decode %1 ms, coarse mesh %2 ms, mesh %3 ms, %4 triangles")
+            .arg(timing.m_decode_ms, 0, 'f', 1)
+            .arg(timing.m_coarse_mesh_ms, 0, 'f', 1)
+            .arg(timing.m_mesh_ms, 0, 'f', 1)
+            .arg(static_cast<qulonglong>(timing.m_triangles));
+    }
+    if (mCoalesced > 0) {
+        message += QString(", %1 frames coalesced").arg(static_cast<qulonglong>(mCoalesced));
+    }
+    auto stored = getCriticalSection().m_snapshot_store.stats();
+    if (stored.m_unique < stored.m_snapshots) {
+        message += QString(", %1 of %2 snapshots unique").arg(static_cast<qulonglong>(stored.m_unique)).arg(static_cast<qulonglong>(stored.m_snapshots));
+    }
+    emit statusMessage(message);
+}
+
+void OcctViewer::restoreFineLevel()
+{
+    for (auto& shape : mCoarseParts) {
+        mContext->UnsetDisplayMode(shape, Standard_False);
+    }
+    mCoarseParts.clear();
 }
 
 void OcctViewer::initOcctViewer()
@@ -72,6 +212,12 @@ void OcctViewer::initOcctViewer()
     // 创建交互上下文
     mContext = new AIS_InteractiveContext(mViewer);
 
+    // 显示精度和服务端剖分用同一套参数，形状到这里时已经剖分好了，不允许AIS在GUI线程上再剖分
+    MeshSettings mesh = getCriticalSection().m_mesh_settings.value();
+    mContext->DefaultDrawer()->SetDeviationCoefficient(mesh.m_deviation_coefficient);
+    mContext->DefaultDrawer()->SetDeviationAngle(mesh.m_angle);
+    mContext->DefaultDrawer()->SetAutoTriangulation(Standard_False);
+
     // 绑定窗口
     WId windowHandle = winId();
 
@@ -133,8 +279,18 @@ void OcctViewer::mousePressEvent(QMouseEvent* event)
     mLastMousePos = event->pos();
 
     if (event->button() == Qt::LeftButton) {
-        // 旋转视图
+        // 旋转视图，旋转期间临时切到粗糙层级，显示数据都缓存着，切换不用重新计算
         mView->StartRotation(x, y);
+        if (mCoarseParts.empty()) {
+            Standard_Integer mode = LodShape::coarseMode(mContext->DisplayMode());
+            for (auto& [hash, shown] : mScene) {
+                if (shown.m_shape->hasCoarseLevel()) {
+                    mContext->SetDisplayMode(shown.m_shape, mode, Standard_False);
+                    mCoarseParts.push_back(shown.m_shape);
+                }
+            }
+            mContext->UpdateCurrentViewer();
+        }
     }
 }
 
@@ -143,9 +299,10 @@ void OcctViewer::mouseReleaseEvent(QMouseEvent* event)
     if (mView.IsNull() || mContext.IsNull())
         return;
 
-    // 鼠标释放，结束旋转操作
-    if (event->button() == Qt::LeftButton) {
-        // 停止旋转操作时不需要特殊处理
+    // 鼠标释放，结束旋转操作，换回精细层级
+    if (event->button() == Qt::LeftButton && !mCoarseParts.empty()) {
+        restoreFineLevel();
+        mContext->UpdateCurrentViewer();
     }
 }
 
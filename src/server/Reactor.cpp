@@ -0,0 +1,263 @@
+﻿#include "server/Reactor.h"
+
+#include "common/convert_return.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#elif !defined(_WIN32)
+#include <poll.h>
+#endif
+
+#if defined(__linux__)
+
+Reactor::Reactor()
+{
+	m_epoll_fd_ = convert_error(epoll_create1(EPOLL_CLOEXEC))
+		.throw_if_equal(-1, "epoll_create1")
+		.result();
+
+	m_wakeup_fd_ = convert_error(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+		.execute([this] { close(m_epoll_fd_); }).if_equal(-1)
+		.throw_if_equal(-1, "eventfd")
+		.result();
+
+	epoll_event ev{};
+	ev.events = EPOLLIN;
+	ev.data.fd = m_wakeup_fd_;
+	convert_error(epoll_ctl(m_epoll_fd_, EPOLL_CTL_ADD, m_wakeup_fd_, &ev))
+		.execute([this] { close(m_wakeup_fd_); close(m_epoll_fd_); }).if_equal(-1)
+		.throw_if_equal(-1, "epoll_ctl");
+}
+
+Reactor::~Reactor()
+{
+	close(m_wakeup_fd_);
+	close(m_epoll_fd_);
+}
+
+void Reactor::watch(SOCKET fd)
+{
+	epoll_event ev{};
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.fd = fd;
+	convert_error(epoll_ctl(m_epoll_fd_, EPOLL_CTL_ADD, fd, &ev))
+		.throw_if_equal(-1, "epoll_ctl");
+}
+
+void Reactor::rearm(SOCKET fd)
+{
+	epoll_event ev{};
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.fd = fd;
+	convert_error(epoll_ctl(m_epoll_fd_, EPOLL_CTL_MOD, fd, &ev))
+		.throw_if_equal(-1, "epoll_ctl");
+}
+
+void Reactor::unwatch(SOCKET fd)
+{
+	epoll_ctl(m_epoll_fd_, EPOLL_CTL_DEL, fd, nullptr); //连接可能已经关闭，这里不关心结果
+}
+
+size_t Reactor::wait(std::vector<SOCKET>& ready_list, int timeout_ms)
+{
+	ready_list.clear();
+
+	epoll_event events[64];
+	int n = epoll_wait(m_epoll_fd_, events, 64, timeout_ms);
+	if (n < 0) {
+		convert_error(errno).throw_if_not_equal(EINTR, "epoll_wait");
+		return 0;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		if (events[i].data.fd == m_wakeup_fd_) {
+			uint64_t counter = 0;
+			while (read(m_wakeup_fd_, &counter, sizeof(counter)) > 0) {}
+			continue;
+		}
+		ready_list.push_back(events[i].data.fd);
+	}
+	return ready_list.size();
+}
+
+void Reactor::wakeup()
+{
+	uint64_t one = 1;
+	[[maybe_unused]] auto ret = write(m_wakeup_fd_, &one, sizeof(one));
+}
+
+#else
+
+namespace {
+#if defined(_WIN32)
+	using pollfd_t = WSAPOLLFD;
+	inline int pollSockets(pollfd_t* fds, size_t n, int timeout_ms) {
+		return WSAPoll(fds, static_cast<ULONG>(n), timeout_ms);
+	}
+#else
+	using pollfd_t = pollfd;
+	inline int pollSockets(pollfd_t* fds, size_t n, int timeout_ms) {
+		return poll(fds, static_cast<nfds_t>(n), timeout_ms);
+	}
+#endif
+	// 唤醒socket建不起来时，每次最多等这么久再检查wakeup标志
+	constexpr int POLL_SLICE_MS = 50;
+
+	// WSAPoll只能等socket，所以用一个连向自己的回环UDP socket做唤醒，POSIX上也一样用
+	SOCKET makeLoopbackSocket()
+	{
+		SOCKET s = socket(AF_INET, SOCK_DGRAM, 0);
+		if (s == INVALID_SOCKET) {
+			return INVALID_SOCKET;
+		}
+		sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len = sizeof(addr);
+		if (bind(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR
+			|| getsockname(s, reinterpret_cast<sockaddr*>(&addr), &len) == SOCKET_ERROR
+			|| connect(s, reinterpret_cast<sockaddr*>(&addr), len) == SOCKET_ERROR
+			|| set_non_blocking(s) == SOCKET_ERROR) {
+			closesocket(s);
+			return INVALID_SOCKET;
+		}
+		return s;
+	}
+}
+
+Reactor::Reactor() = default;
+
+Reactor::~Reactor()
+{
+	SOCKET s = m_wakeup_socket_.load();
+	if (s != INVALID_SOCKET) {
+		closesocket(s);
+	}
+}
+
+void Reactor::watch(SOCKET fd)
+{
+	{
+		std::unique_lock lck(m_mtx_);
+		m_armed_[fd] = true;
+	}
+	interrupt();
+}
+
+void Reactor::rearm(SOCKET fd)
+{
+	{
+		std::unique_lock lck(m_mtx_);
+		auto it = m_armed_.find(fd);
+		if (it == m_armed_.end()) {
+			return;
+		}
+		it->second = true;
+	}
+	interrupt();
+}
+
+void Reactor::unwatch(SOCKET fd)
+{
+	std::unique_lock lck(m_mtx_);
+	m_armed_.erase(fd);
+}
+
+size_t Reactor::wait(std::vector<SOCKET>& ready_list, int timeout_ms)
+{
+	ready_list.clear();
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms < 0 ? 0 : timeout_ms);
+
+	// Windows上要WSAStartup之后才能建socket，所以第一次wait时才建；只有reactor线程调用wait
+	SOCKET wakeup_socket = m_wakeup_socket_.load();
+	if (wakeup_socket == INVALID_SOCKET) {
+		wakeup_socket = makeLoopbackSocket();
+		m_wakeup_socket_.store(wakeup_socket);
+	}
+
+	std::vector<pollfd_t> fds;
+	while (!m_wakeup_.exchange(false)) {
+		fds.clear();
+		if (wakeup_socket != INVALID_SOCKET) {
+			pollfd_t p{};
+			p.fd = wakeup_socket;
+			p.events = POLLIN;
+			fds.push_back(p);
+		}
+		{
+			std::unique_lock lck(m_mtx_);
+			for (auto& [fd, armed] : m_armed_) {
+				if (armed) {
+					pollfd_t p{};
+					p.fd = fd;
+					p.events = POLLIN;
+					fds.push_back(p);
+				}
+			}
+		}
+
+		// 有唤醒socket时一直等到有事件，watch/rearm改了关注的集合也会通过它打断poll；建不起来时退回到分片轮询
+		int slice = wakeup_socket != INVALID_SOCKET ? -1 : POLL_SLICE_MS;
+		if (timeout_ms >= 0) {
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			int limit = slice < 0 ? INT_MAX : slice;
+			slice = static_cast<int>(std::clamp<decltype(left)>(left, 0, limit));
+		}
+
+		int n = 0;
+		if (fds.empty()) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(slice));
+		}
+		else {
+			n = pollSockets(fds.data(), fds.size(), slice);
+		}
+
+		if (n > 0) {
+			std::unique_lock lck(m_mtx_);
+			for (auto& p : fds) {
+				if (p.revents == 0) {
+					continue;
+				}
+				if (p.fd == wakeup_socket) {
+					char drain[64];
+					while (recv(wakeup_socket, drain, sizeof(drain), 0) > 0) {}
+					continue;
+				}
+				auto it = m_armed_.find(p.fd);
+				if (it != m_armed_.end()) {
+					it->second = false;
+					ready_list.push_back(p.fd);
+				}
+			}
+			if (!ready_list.empty()) {
+				break;
+			}
+		}
+		if (timeout_ms >= 0 && std::chrono::steady_clock::now() >= deadline) {
+			break;
+		}
+	}
+	return ready_list.size();
+}
+
+void Reactor::wakeup()
+{
+	m_wakeup_ = true;
+	interrupt();
+}
+
+void Reactor::interrupt()
+{
+	SOCKET s = m_wakeup_socket_.load();
+	if (s != INVALID_SOCKET) {
+		char one = 1;
+		send(s, &one, 1, 0); //缓冲区满了说明已经有没读的唤醒，不关心结果
+	}
+}
+
+#endif
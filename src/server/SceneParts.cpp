@@ -0,0 +1,95 @@
+﻿#include "server/SceneParts.h"
+
+#include "common/bytes_buffer.hpp"
+#include "common/bytes_stream.hpp"
+#include "common/content_hash.hpp"
+#include "server/ShapeMesher.h"
+
+#include <BinTools.hxx>
+#include <BRep_Builder.hxx>
+#include <TopExp_Explorer.hxx>
+#include <TopoDS_Compound.hxx>
+#include <TopoDS_Iterator.hxx>
+
+#include <unordered_map>
+#include <utility>
+
+namespace {
+	// 按遍历顺序拆出各部分的形状，拓扑结构相同的两个形状拆出来一一对应
+	void collectParts(TopoDS_Shape const& shape, std::vector<TopoDS_Shape>& out)
+	{
+		if (shape.IsNull()) {
+			return;
+		}
+		if (shape.ShapeType() == TopAbs_COMPOUND || shape.ShapeType() == TopAbs_COMPSOLID) {
+			for (TopoDS_Iterator it(shape); it.More(); it.Next()) {
+				collectParts(it.Value(), out);
+			}
+			return;
+		}
+
+		size_t faces = 0;
+		for (TopExp_Explorer it(shape, TopAbs_FACE); it.More() && faces <= FACES_PER_PART; it.Next()) {
+			++faces;
+		}
+		if (faces <= FACES_PER_PART) {
+			out.push_back(shape);
+			return;
+		}
+
+		BRep_Builder builder;
+		TopoDS_Compound chunk;
+		size_t count = 0;
+		for (TopExp_Explorer it(shape, TopAbs_FACE); it.More(); it.Next()) {
+			if (count == 0) {
+				builder.MakeCompound(chunk);
+			}
+			builder.Add(chunk, it.Current());
+			if (++count == FACES_PER_PART) {
+				out.push_back(chunk);
+				count = 0;
+			}
+		}
+		if (count > 0) {
+			out.push_back(chunk);
+		}
+	}
+}
+
+std::vector<ScenePart> splitScene(TopoDS_Shape const& shape)
+{
+	std::vector<TopoDS_Shape> shapes;
+	collectParts(shape, shapes);
+
+	std::vector<ScenePart> parts;
+	parts.reserve(shapes.size());
+	std::unordered_map<uint64_t, uint64_t> seen;
+	bytes_buffer buffer;
+	for (auto& part : shapes) {
+		// 不带网格序列化：网格的精度跟着整个形状的包围盒走，别处变了这里的网格也会变
+		bytes_ostream os(buffer);
+		BinTools::Write(part, os, Standard_False, Standard_False, BinTools_FormatVersion_CURRENT);
+		uint64_t hash = content_hash(os.view());
+		// 完全相同的部分出现多次时按出现次数区分
+		if (uint64_t repeat = seen[hash]++) {
+			hash ^= repeat * 0x9e3779b97f4a7c15ull;
+		}
+		// 显示数据大约是网格的两倍(三角网格+顶点缓冲)
+		parts.push_back(ScenePart{ hash, part, part, estimateMeshBytes(part) * 2 });
+	}
+	return parts;
+}
+
+bool assignFineParts(std::vector<ScenePart>& parts, TopoDS_Shape const& fine)
+{
+	std::vector<TopoDS_Shape> shapes;
+	collectParts(fine, shapes);
+	if (shapes.size() != parts.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < parts.size(); ++i) {
+		parts[i].m_cost += estimateMeshBytes(shapes[i]) * 2;
+		parts[i].m_shape = std::move(shapes[i]);
+	}
+	return true;
+}
@@ -2,81 +2,259 @@
 
 #include "common/utf8_system_category.hpp"
 #include "common/convert_return.hpp"
+#include "common/shm_transport.hpp"
+#include "server/BrepCodec.h"
 
+#include <Message_ProgressScope.hxx>
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
 #include <deque>
+#include <iterator>
 #include <vector>
 #include <memory>
 #include <thread>
+#include <tuple>
 
 #include <BRepTools.hxx>
 #include <BRep_Builder.hxx>
-#include <V3d_Viewer.hxx>
-
-
-#pragma comment(lib, "ws2_32.lib")
 
-MyServer::WSAContext::WSAContext() {
-    WSADATA wsa_data;
-    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
-        auto ec = std::error_code(WSAGetLastError(), utf8_system_category());
-        std::cerr << ec.message();
-        throw std::system_error(ec, "WSAStartup");
-    }
-}
-
-MyServer::WSAContext::~WSAContext() {
-    WSACleanup();
+namespace {
+	// 没设置的通知直接跳过
+	template<class Event, class... Args>
+	void fire(Event const& event, Args&&... args)
+	{
+		if (event) {
+			event(std::forward<Args>(args)...);
+		}
+	}
 }
 
 MyServer::~MyServer()
 {
-	getCriticalSection().m_stop_server = true;
-    m_work_thread_.join();
+    stop();
     if (m_id_ != INVALID_SOCKET) {
         closesocket(m_id_);
     }
+    if (m_shm_id_ != INVALID_SOCKET) {
+        closesocket(m_shm_id_);
+    }
+    if (m_unix_id_ != INVALID_SOCKET) {
+        closesocket(m_unix_id_);
+#if !defined(_WIN32)
+        unlink(m_unix_path_.c_str());
+#endif
+    }
 
 }
 
 void MyServer::onMovePreviousBrep()
 {
 	if(!getCriticalSection().m_mode_draw_new){
-		auto& task_deque = getCriticalSection().m_task_deque;
-		task_deque.push(std::make_shared<PreviousBrepTask>(this, getCriticalSection().m_current_connetion_id.value()));
+		m_scheduler_.submit(makeTask<PreviousBrepTask>(this, currentConnectionId()));
 	}
 }
 
 void MyServer::onMoveNextBrep()
 {
 	if(!getCriticalSection().m_mode_draw_new){
-		auto& task_deque = getCriticalSection().m_task_deque;
-		task_deque.push(std::make_shared<NextBrepTask>(this, getCriticalSection().m_current_connetion_id.value()));
+		m_scheduler_.submit(makeTask<NextBrepTask>(this, currentConnectionId()));
+	}
+}
+
+void MyServer::onSnapshotDrawn()
+{
+	getCriticalSection().m_has_drawn = true;
+	notifyDraw();
+}
+
+void MyServer::notifyDraw()
+{
+	if (TaskPtr parked = getCriticalSection().m_draw_notifier.notify()) {
+		m_scheduler_.submit(std::move(parked));
 	}
 }
 
 void MyServer::onUpdateMode(bool selected)
 {
 	getCriticalSection().m_mode_draw_new = selected;
-	auto current_id = getCriticalSection().m_current_connetion_id.value();
-	m_connection_map_[current_id].setCurrentIndexToLatest();
+	auto current_id = currentConnectionId();
+	m_scheduler_.submit(makeTask<LatestBrepTask>(this, current_id));
+}
+
+void MyServer::onSelectConnection(uint64_t serial)
+{
+	for (auto& summary : *m_connections_.list()) {
+		if (summary.m_serial != serial) {
+			continue;
+		}
+		auto connection = m_connections_.find(summary.m_id);
+		if (connection && connection->m_serial == serial) {
+			m_connections_.setCurrent(std::move(connection));
+			notifyDraw();
+			fire(m_events_.m_connections_changed);
+		}
+		return;
+	}
+}
+
+void MyServer::onOpenSession(std::string path)
+{
+	session_file::reader reader;
+	std::error_code ec;
+	if (!reader.open(path, ec)) {
+		fire(m_events_.m_session_message, "Failed to open " + path + ": " + ec.message());
+		return;
+	}
+	// 文件里的快照按原来的连接分组，组内保持原来的先后
+	std::vector<std::pair<uint64_t, std::vector<session_file::index_entry>>> groups;
+	for (auto& entry : reader.entries()) {
+		auto it = std::find_if(groups.begin(), groups.end(), [&entry](auto& group) { return group.first == entry.m_connection; });
+		if (it == groups.end()) {
+			groups.emplace_back(entry.m_connection, std::vector<session_file::index_entry>{});
+			it = std::prev(groups.end());
+		}
+		it->second.push_back(entry);
+	}
+
+	auto file = std::make_shared<const SessionLog>(reader.file());
+	std::string name = path.substr(path.find_last_of("/\\") + 1);
+	for (size_t i = 0; i < groups.size(); ++i) {
+		SOCKET id = nextOfflineId();
+		addConnection(id, name + " #" + std::to_string(groups[i].first));
+		m_scheduler_.submit(makeTask<SessionLoadTask>(this, id, file, std::move(groups[i].second), i == 0));
+	}
+	fire(m_events_.m_session_message, "Opened " + path + ": " + std::to_string(reader.entries().size()) + " snapshots");
+}
+
+void MyServer::onSaveSession(std::string path)
+{
+	SOCKET current = currentConnectionId();
+	if (current == INVALID_SOCKET) {
+		fire(m_events_.m_session_message, std::string("No connection to save"));
+		return;
+	}
+	m_scheduler_.submit(makeTask<SessionSaveTask>(this, current, std::move(path)));
+}
+
+SOCKET MyServer::nextOfflineId() noexcept
+{
+	// 真socket在POSIX上非负，在Windows上是较小的句柄值，从-2往下数不会撞上，也避开了INVALID_SOCKET
+	uint64_t n = m_next_offline_id_.fetch_add(1, std::memory_order_relaxed);
+	return static_cast<SOCKET>(-2 - static_cast<long long>(n));
+}
+
+bool MyServer::isOfflineId(SOCKET id) const noexcept
+{
+	long long n = -2 - static_cast<long long>(id);
+	return n >= 0 && static_cast<uint64_t>(n) < m_next_offline_id_.load(std::memory_order_relaxed);
+}
+
+ConnectionHandle MyServer::addConnection(SOCKET id, std::string peer)
+{
+	uint64_t serial = m_next_connection_serial_.fetch_add(1, std::memory_order_relaxed);
+	auto connection = m_connections_.add(id, serial, std::move(peer));
+	fire(m_events_.m_connections_changed);
+	return connection;
+}
+
+void MyServer::removeConnection(SOCKET id)
+{
+	if (auto connection = m_connections_.remove(id)) {
+		getCriticalSection().m_shape_cache.dropConnection(connection->m_serial);
+		fire(m_events_.m_connections_changed);
+		if (m_keep_closed_) {
+			std::lock_guard lck(m_closed_mtx_);
+			m_closed_.push_back(std::move(connection));
+		}
+	}
+}
+
+void MyServer::onNewSnapshot(SnapshotRef stored)
+{
+	if (!m_validate_) {
+		return;
+	}
+	m_validate_pending_.fetch_add(1, std::memory_order_relaxed);
+	m_scheduler_.submit(makeTask<SnapshotValidateTask>(this, std::move(stored)));
+}
+
+void MyServer::onValidated(bool ok, double decode_ms)
+{
+	m_validate_pending_.fetch_sub(1, std::memory_order_relaxed);
+	m_validated_.fetch_add(1, std::memory_order_relaxed);
+	if (!ok) {
+		m_invalid_.fetch_add(1, std::memory_order_relaxed);
+	}
+	std::lock_guard lck(m_decode_time_mtx_);
+	m_decode_ms_total_ += decode_ms;
+	m_decode_ms_max_ = std::max(m_decode_ms_max_, decode_ms);
+}
+
+MyServer::Stats MyServer::stats() const
+{
+	Stats stats;
+	stats.m_connections = m_connections_.list()->size();
+	stats.m_connections_total = m_next_connection_serial_.load(std::memory_order_relaxed) - 1;
+	stats.m_store = getCriticalSection().m_snapshot_store.stats();
+	stats.m_validated = m_validated_.load(std::memory_order_relaxed);
+	stats.m_invalid = m_invalid_.load(std::memory_order_relaxed);
+	stats.m_validate_pending = m_validate_pending_.load(std::memory_order_relaxed);
+	std::lock_guard lck(m_decode_time_mtx_);
+	stats.m_decode_ms_total = m_decode_ms_total_;
+	stats.m_decode_ms_max = m_decode_ms_max_;
+	return stats;
+}
+
+void MyServer::prefetchAround(ConnectionInfo& connection, SnapshotKey focus)
+{
+	auto& cache = getCriticalSection().m_shape_cache;
+	if (!focus.valid()) {
+		return;
+	}
+	// 由近到远提交，前后两个方向交替
+	int radius = cache.prefetchRadius();
+	int count = static_cast<int>(connection.m_brep_data_list.size());
+	for (int distance = 1; distance <= radius; ++distance) {
+		for (int index : { focus.m_index - distance, focus.m_index + distance }) {
+			if (index < 0 || index >= count) {
+				continue;
+			}
+			SnapshotKey key = connection.getKey(index);
+			if (!cache.beginPrefetch(key)) {
+				continue;
+			}
+			m_scheduler_.submit(makeTask<ShapePrefetchTask>(key, connection.m_brep_data_list[index]->frame()));
+		}
+	}
 }
 
 MyServer& MyServer::withListenPort(std::string ip, std::string port)
 {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
     struct addrinfo* head = nullptr;
-    convert_error(getaddrinfo(ip.c_str(), port.c_str(), NULL, &head))
+    convert_error(getaddrinfo(ip.c_str(), port.c_str(), &hints, &head))
         .throw_if_not_equal(0, "getaddrinfo");
+    std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> head_guard(head, &freeaddrinfo);
 
     SOCKET temp_id = convert_error(socket(head->ai_family, head->ai_socktype, head->ai_protocol))
         .throw_if_equal(INVALID_SOCKET)
         .result();
 
-    u_long mode = 1; //非阻塞的accept模式
-    convert_error(ioctlsocket(temp_id, FIONBIO, &mode))
+    int reuse = 1;
+    setsockopt(temp_id, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+    //非阻塞的accept模式
+    convert_error(set_non_blocking(temp_id))
         .execute([temp_id] {closesocket(temp_id); }).if_not_equal(NO_ERROR)
         .throw_if_not_equal(NO_ERROR);
 
-    convert_error(bind(temp_id, head->ai_addr, head->ai_addrlen))
+    convert_error(bind(temp_id, head->ai_addr, static_cast<socklen_t>(head->ai_addrlen)))
         .execute([temp_id] {closesocket(temp_id); }).if_equal(SOCKET_ERROR)
         .throw_if_equal(SOCKET_ERROR);
 
@@ -85,19 +263,147 @@ MyServer& MyServer::withListenPort(std::string ip, std::string port)
     return *this;
 }
 
+MyServer& MyServer::withSharedMemory(std::string name)
+{
+#if defined(__linux__)
+    sockaddr_un addr;
+    socklen_t addr_len = shm_transport::make_address(name, addr);
+
+    SOCKET temp_id = convert_error(socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))
+        .throw_if_equal(INVALID_SOCKET)
+        .result();
+
+    convert_error(bind(temp_id, reinterpret_cast<sockaddr*>(&addr), addr_len))
+        .execute([temp_id] {closesocket(temp_id); }).if_equal(SOCKET_ERROR)
+        .throw_if_equal(SOCKET_ERROR);
+
+    m_shm_id_ = temp_id;
+    listen(m_shm_id_, SOMAXCONN);
+    return *this;
+#else
+    (void)name;
+    throw std::system_error(std::make_error_code(std::errc::not_supported), "withSharedMemory");
+#endif
+}
+
+MyServer& MyServer::withUnixSocket(std::string path)
+{
+#if !defined(_WIN32)
+    sockaddr_un addr;
+    socklen_t addr_len = make_unix_address(path, addr);
+    if (addr_len == 0) {
+        throw std::system_error(std::make_error_code(std::errc::filename_too_long), "withUnixSocket " + path);
+    }
+
+    SOCKET temp_id = convert_error(socket(AF_UNIX, SOCK_STREAM, 0))
+        .throw_if_equal(INVALID_SOCKET)
+        .result();
+
+    convert_error(set_non_blocking(temp_id))
+        .execute([temp_id] {closesocket(temp_id); }).if_not_equal(NO_ERROR)
+        .throw_if_not_equal(NO_ERROR);
+
+    // 上次异常退出留下的socket文件会让bind失败，先删掉；还能连上说明有别的服务端在用，不能抢
+    SOCKET probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool in_use = probe != INVALID_SOCKET && connect(probe, reinterpret_cast<sockaddr*>(&addr), addr_len) == 0;
+    if (probe != INVALID_SOCKET) {
+        closesocket(probe);
+    }
+    if (in_use) {
+        closesocket(temp_id);
+        throw std::system_error(std::make_error_code(std::errc::address_in_use), "withUnixSocket " + path);
+    }
+    unlink(path.c_str());
+    convert_error(bind(temp_id, reinterpret_cast<sockaddr*>(&addr), addr_len))
+        .execute([temp_id] {closesocket(temp_id); }).if_equal(SOCKET_ERROR)
+        .throw_if_equal(SOCKET_ERROR);
+
+    m_unix_id_ = temp_id;
+    m_unix_path_ = std::move(path);
+    listen(m_unix_id_, SOMAXCONN);
+    return *this;
+#else
+    (void)path;
+    throw std::system_error(std::make_error_code(std::errc::not_supported), "withUnixSocket");
+#endif
+}
+
+MyServer& MyServer::withWorkerCount(size_t count)
+{
+    m_worker_count_ = count;
+    return *this;
+}
+
+MyServer& MyServer::withMeshing(MeshSettings settings)
+{
+    getCriticalSection().m_mesh_settings.setValue(settings);
+    return *this;
+}
+
+MyServer& MyServer::withShapeCache(size_t budget_bytes, int prefetch_radius)
+{
+    getCriticalSection().m_shape_cache.configure(budget_bytes, prefetch_radius);
+    return *this;
+}
+
+MyServer& MyServer::withSessionLog(std::string path, size_t ram_budget)
+{
+    getCriticalSection().m_snapshot_store.configureSpill(std::make_shared<SessionLog>(path), ram_budget);
+    return *this;
+}
+
+MyServer& MyServer::withEvents(ServerEvents events)
+{
+    m_events_ = std::move(events);
+    return *this;
+}
+
+MyServer& MyServer::withoutDisplay()
+{
+    m_display_ = false;
+    return *this;
+}
+
+MyServer& MyServer::withValidation()
+{
+    m_validate_ = true;
+    return *this;
+}
+
+MyServer& MyServer::withClosedHistory()
+{
+    m_keep_closed_ = true;
+    return *this;
+}
+
 void MyServer::run()
 {
+	m_scheduler_.start(m_worker_count_);
+	// 整个服务端只有一条显示流水线，没事可做时停在m_draw_notifier上
+	if (m_display_) {
+		m_scheduler_.submit(makeTask<BrepDataSetTask>(this));
+	}
+
+	// 这个线程只负责等内核的就绪通知，任务都交给调度器的worker执行
 	auto guardFunc = [this]{
-		auto& task_deque = getCriticalSection().m_task_deque;
-		task_deque.push(std::make_shared<ConnectionAcceptTask>(this));
-		while (!task_deque.getAccessor().value().empty()) {
-			if (getCriticalSection().m_stop_server) /*[[unlikely]]*/ {
-				task_deque.getAccessor().value().clear();
-				return;
+		// 几种监听socket都交给同一个Reactor，接受之后的连接也一样
+		for (SOCKET listener : { m_id_, m_shm_id_, m_unix_id_ }) {
+			if (listener != INVALID_SOCKET) {
+				m_reactor_.watch(listener);
 			}
+		}
 
-			auto t1 = task_deque.pop();
-			task_deque.push_many(t1->run());
+		std::vector<SOCKET> ready_list;
+		while (!getCriticalSection().m_stop_server) {
+			m_reactor_.wait(ready_list, -1);
+			for (SOCKET fd : ready_list) {
+				if (isListener(fd)) {
+					m_scheduler_.submit(makeTask<ConnectionAcceptTask>(this, fd));
+				}
+				else {
+					submitReceive(fd);
+				}
+			}
 		}
 	};
 	
@@ -109,21 +415,142 @@ void MyServer::run()
     m_work_thread_ = std::move(t);
 }
 
-std::vector<std::shared_ptr<Task>> ErrorThrowTask::run()
+void MyServer::submitReceive(SOCKET id)
+{
+	m_receive_tasks_.fetch_add(1, std::memory_order_relaxed);
+	m_scheduler_.submit(makeTask<BrepDataReceiveTask>(this, id));
+}
+
+void MyServer::stopReceiving(std::chrono::steady_clock::duration grace)
 {
-	auto ec = std::error_code(WSAGetLastError(), utf8_system_category());
+	if (m_receive_deadline_.load(std::memory_order_relaxed) == INT64_MAX) {
+		m_receive_deadline_.store((std::chrono::steady_clock::now() + grace).time_since_epoch().count(), std::memory_order_relaxed);
+	}
+	getCriticalSection().m_stop_server = true;
+	m_reactor_.wakeup();
+	if (!m_work_thread_.joinable()) {
+		return;
+	}
+	m_work_thread_.join();
+	// Reactor已经不派发了，内核里已经到了、还没派发的数据再收一遍；同一连接的任务串行，和还在跑的接收任务不冲突
+	for (auto& connection : *m_connections_.list()) {
+		if (!isOfflineId(connection.m_id)) {
+			submitReceive(connection.m_id);
+		}
+	}
+	while (m_receive_tasks_.load(std::memory_order_acquire) != 0) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+size_t MyServer::partialFrames()
+{
+	size_t count = 0;
+	for (auto& summary : *m_connections_.list()) {
+		auto connection = m_connections_.find(summary.m_id);
+		if (connection && connection->m_decoder.partial()) {
+			++count;
+		}
+	}
+	std::lock_guard lck(m_closed_mtx_);
+	for (auto& connection : m_closed_) {
+		if (connection->m_decoder.partial()) {
+			++count;
+		}
+	}
+	return count;
+}
+
+void MyServer::stop()
+{
+	stopReceiving();
+	m_scheduler_.stop();
+	// 停着的显示任务要在对象池还在时释放
+	getCriticalSection().m_draw_notifier.notify();
+}
+
+namespace {
+	// 一个连接的历史按先后写进会话文件，已经写进会话日志的映射回来写，不整段读进内存
+	bool appendHistory(session_file::writer& writer, ConnectionInfo const& connection, std::error_code& ec)
+	{
+		for (size_t i = 0; i < connection.m_brep_data_list.size(); ++i) {
+			auto& stored = connection.m_brep_data_list[i];
+			if (!writer.append(*stored->frame(), connection.m_serial, connection.m_receive_times[i], stored->content(), ec)) {
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+bool MyServer::saveSession(std::string const& path, std::error_code& ec)
+{
+	session_file::writer writer;
+	if (!writer.create(path, ec)) {
+		return false;
+	}
+	// 按连接建立的先后写
+	std::vector<ConnectionHandle> connections;
+	{
+		std::lock_guard lck(m_closed_mtx_);
+		connections = m_closed_;
+	}
+	for (auto& summary : *m_connections_.list()) {
+		if (auto connection = m_connections_.find(summary.m_id)) {
+			connections.push_back(std::move(connection));
+		}
+	}
+	std::sort(connections.begin(), connections.end(), [](auto& a, auto& b) { return a->m_serial < b->m_serial; });
+	for (auto& connection : connections) {
+		if (!appendHistory(writer, *connection, ec)) {
+			return false;
+		}
+	}
+	return writer.finish(ec);
+}
+
+TaskList ErrorThrowTask::run()
+{
+	auto ec = std::error_code(last_socket_error(), utf8_system_category());
 	std::cerr << ec.message();
 	throw std::system_error(ec, m_str);
 	return {};
 }
 
-std::vector<std::shared_ptr<Task>> ConnectionAcceptTask::run()
+namespace {
+	// 连接列表里显示的对端地址
+	std::string peerName(sockaddr_storage const& addr, socklen_t addr_len)
+	{
+		char host[NI_MAXHOST] = {};
+		char port[NI_MAXSERV] = {};
+		if (getnameinfo(reinterpret_cast<sockaddr const*>(&addr), addr_len, host, sizeof(host), port, sizeof(port),
+			NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+			return "unknown";
+		}
+		return addr.ss_family == AF_INET6 ? "[" + std::string(host) + "]:" + port : std::string(host) + ":" + port;
+	}
+
+#if defined(__linux__)
+	// 本机连接没有网络地址，显示传输方式和对端进程号
+	std::string localPeerName(SOCKET fd, std::string kind)
+	{
+		ucred cred{};
+		socklen_t len = sizeof(cred);
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+			return kind;
+		}
+		return kind + " pid " + std::to_string(cred.pid);
+	}
+#endif
+}
+
+TaskList ConnectionAcceptTask::run()
 {
-	sockaddr_in client_addr;
-	int addr_len = sizeof(client_addr);
-	auto res = convert_return(accept(m_boss_->m_id_, (struct sockaddr*)&client_addr, &addr_len))
+	sockaddr_storage client_addr;
+	socklen_t addr_len = sizeof(client_addr);
+	auto res = convert_return(accept(m_listener_, (struct sockaddr*)&client_addr, &addr_len))
 		.to(AcceptOne).if_meet_condition([](auto socket) {return socket != INVALID_SOCKET; })
-		.to(NeedReTry).if_meet_condition([](auto socket) {return socket == INVALID_SOCKET && WSAGetLastError() == WSAEWOULDBLOCK; })
+		.to(NeedReTry).if_meet_condition([](auto socket) {return socket == INVALID_SOCKET && is_would_block(last_socket_error()); })
 		.to(Error);
 
 	SOCKET m_recently_connected = res.result();
@@ -131,119 +558,430 @@ std::vector<std::shared_ptr<Task>> ConnectionAcceptTask::run()
 	// 状态转移
 	switch(res)
 	{
-	case AcceptOne:
-		getCriticalSection().m_current_connetion_id.setValue(m_recently_connected);
-		m_boss_->m_connection_map_.emplace(m_recently_connected, MyServer::ConnectionInfo{ m_recently_connected });
-		return { std::make_shared<BrepDataReceiveTask>(m_boss_, m_recently_connected),
-			std::make_shared<BrepDataSetTask>(m_boss_) };
+	case AcceptOne: {
+		set_non_blocking(m_recently_connected);
+		bool shared_memory = m_listener_ == m_boss_->m_shm_id_;
+		std::string peer;
+		if (m_listener_ == m_boss_->m_id_) {
+			peer = peerName(client_addr, addr_len);
+		}
+		else {
+			std::string kind = shared_memory ? "shm" : "unix";
+#if defined(__linux__)
+			peer = localPeerName(m_recently_connected, std::move(kind));
+#else
+			peer = std::move(kind);
+#endif
+		}
+		auto connection = m_boss_->addConnection(m_recently_connected, std::move(peer));
+		connection->m_shared_memory = shared_memory;
+		// 新连接成为当前连接
+		m_boss_->m_connections_.setCurrent(std::move(connection));
+		m_boss_->m_reactor_.watch(m_recently_connected);
+		m_boss_->notifyDraw();
+		// 监听队列里可能还有别的连接，继续accept直到EWOULDBLOCK
+		return { self() };
+	}
 
 	case NeedReTry:
-		return { std::make_shared<ConnectionAcceptTask>(m_boss_) };
+		m_boss_->m_reactor_.rearm(m_listener_);
+		return {};
 
 	default:
-		return { std::make_shared<ErrorThrowTask>("Accept") };
+		return { makeTask<ErrorThrowTask>("Accept") };
 	}
 }
 
-std::vector<std::shared_ptr<Task>> BrepDataReceiveTask::run()
+TaskList BrepDataReceiveTask::run()
 {
 
-	auto recvBrepDataFromSocket = [](MyServer::ConnectionInfo& connection){
-		auto& temp_data_buffer = connection.m_reserve_buffer;
-		size_t old_size = temp_data_buffer.size();
-		size_t new_size = old_size + 4096;
-		temp_data_buffer.resize(new_size);
-
-		auto res = convert_return(recv(connection.m_id, temp_data_buffer.data()+old_size, 4096,0))
+	auto recvBrepDataFromSocket = [](ConnectionInfo& connection){
+		// 直接收进解码器给出的位置：帧头阶段是暂存区，帧体阶段就是这一帧最终的存储
+		auto target = connection.m_decoder.prepare();
+		int capacity = static_cast<int>(std::min<size_t>(target.size(), INT_MAX));
+		auto res = convert_return(recv(connection.m_id, target.data(), capacity, 0))
 		.to(Received).if_meet_condition([](auto received) {return received > 0; })
 		.to(ClientClosed).if_meet_condition([](auto received){return received == 0;})
-		.to(NeedReTry).if_meet_condition([](auto received){return received < 0 && WSAGetLastError() == WSAEWOULDBLOCK;})
+		.to(NeedReTry).if_meet_condition([](auto received){return received < 0 && is_would_block(last_socket_error());})
 		.to(Error);
 
-		if(res == Received){
-			temp_data_buffer.resize(old_size + res.result());
+		return std::pair{res.value(), res == Received ? static_cast<size_t>(res.result()) : size_t(0)};
+	};
+
+#if defined(__linux__)
+	// 共享内存连接一次收一条消息，一条消息就是完整的一帧
+	auto recvFrameFromSharedMemory = [](ConnectionInfo& connection, brep_frame& frame) {
+		if (connection.m_shm_scratch.size() < shm_transport::MAX_MESSAGE) {
+			connection.m_shm_scratch.resize(shm_transport::MAX_MESSAGE);
 		}
-		else if(res == NeedReTry){
-			temp_data_buffer.resize(old_size);
+		switch (shm_transport::recv_frame(connection.m_id, connection.m_shm_scratch, frame)) {
+		case shm_transport::recv_status::frame: return Received;
+		case shm_transport::recv_status::would_block: return NeedReTry;
+		case shm_transport::recv_status::closed: return ClientClosed;
+		case shm_transport::recv_status::bad: return BadFrame;
+		default: return Error;
 		}
-
-		return res.value();
 	};
-
-	auto addBrepDataToList = [](MyServer::ConnectionInfo& connection) {
-		auto& temp_data_buffer = connection.m_reserve_buffer;
-		const size_t HEADER_SIZE = sizeof(int32_t);
-		size_t buffer_size = temp_data_buffer.size();
-
-		std::string draw_data;
-		if (HEADER_SIZE < buffer_size) {
-			int32_t data_length_r = 0;
-			memcpy(&data_length_r, temp_data_buffer.data(), HEADER_SIZE);
-			int32_t data_length = ntohl(data_length_r);
-			if (data_length < buffer_size) {
-				draw_data.resize(data_length);
-				memcpy(draw_data.data(), temp_data_buffer.data() + HEADER_SIZE, data_length); //这里可以优化，但目前没太大必要                        
-				temp_data_buffer.erase(0, HEADER_SIZE + data_length);// 从缓冲区中移除已处理的数据
-				connection.m_brep_data_list.push_back(draw_data);
-				if (getCriticalSection().m_mode_draw_new) {
-					connection.setCurrentIndexToLatest();
-				}
+#endif
+
+	// deliver把这次收到的完整帧逐个交给回调，数据不合法时返回false
+	auto addBrepDataToList = [this](ConnectionInfo& connection, auto&& deliver) {
+		size_t count = connection.m_brep_data_list.size();
+		bool ok = deliver([this, &connection](brep_frame&& draw_data) {
+			// 和之前收到过的(任何连接的)快照内容相同时只记一个引用，新收的这份直接释放
+			bool added = false;
+			SnapshotRef stored = getCriticalSection().m_snapshot_store.intern(std::move(draw_data), added);
+			connection.m_brep_data_list.push_back(stored);
+			connection.m_receive_times.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::system_clock::now().time_since_epoch()).count());
+			if (getCriticalSection().m_mode_draw_new) {
+				connection.setCurrentIndexToLatest();
+			}
+			if (added) {
+				m_boss_->onNewSnapshot(std::move(stored));
 			}
+		});
+		// 总是显示最新时，当前连接来了新快照就叫醒显示流水线；正在解析的快照不取消，
+		// 否则发送频率高于解析速度时永远画不出一帧，解析完它再直接跳到那时最新的快照
+		if (getCriticalSection().m_mode_draw_new && connection.m_brep_data_list.size() != count
+			&& connection.m_id == m_boss_->currentConnectionId()) {
+			m_boss_->notifyDraw();
 		}
+		return ok;
 	};
 
-	auto& connection = m_boss_->m_connection_map_[m_connection_id_];
-	auto res = recvBrepDataFromSocket(connection);
-	addBrepDataToList(connection);
+	auto connection = m_boss_->findConnection(m_connection_id_);
+	if (!connection) {
+		m_boss_->onReceiveDone();
+		return {};
+	}
+	int res = Error;
+#if defined(__linux__)
+	if (connection->m_shared_memory) {
+		brep_frame frame;
+		res = recvFrameFromSharedMemory(*connection, frame);
+		if (res == Received) {
+			addBrepDataToList(*connection, [&frame](auto&& on_frame) { on_frame(std::move(frame)); return true; });
+		}
+	}
+	else
+#endif
+	{
+		// 这次收到的数据里有几帧完整的就全部放进列表
+		size_t received = 0;
+		std::tie(res, received) = recvBrepDataFromSocket(*connection);
+		if (res == Received && !addBrepDataToList(*connection, [&](auto&& on_frame) { return connection->m_decoder.commit(received, on_frame); })) {
+			res = BadFrame;
+		}
+	}
 
+	// 只有还要接着收的时候才算没结束；停止接收的期限到了就不再接着收
+	if (res == Received && m_boss_->receiveExpired()) {
+		m_boss_->onReceiveDone();
+		return {};
+	}
+	if (res != Received) {
+		m_boss_->onReceiveDone();
+	}
 	switch(res){
 	case Received:
-		return { std::make_shared<BrepDataReceiveTask>(m_boss_, m_connection_id_)};
+		return { self() };
 	case ClientClosed:
-		return {std::make_shared<ConnectionCloseTask>(m_boss_, m_connection_id_)};
+	case BadFrame:
+		return {makeTask<ConnectionCloseTask>(m_boss_, m_connection_id_)};
 	case NeedReTry:
-		return {std::make_shared<BrepDataReceiveTask>(m_boss_, m_connection_id_)}; 
+		m_boss_->m_reactor_.rearm(m_connection_id_);
+		return {};
 	default:
-		return {std::make_shared<ErrorThrowTask>("Recv")};
+		return {makeTask<ErrorThrowTask>("Recv")};
 	}
 }
 
-std::vector<std::shared_ptr<Task>> BrepDataSetTask::run()
-{
-	SOCKET current_id = getCriticalSection().m_current_connetion_id.value();
-	if(m_boss_->m_connection_map_.find(current_id) == m_boss_->m_connection_map_.end()) {
-		return {};
+namespace {
+	double elapsedMs(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 	}
 
-	auto& connection = m_boss_->m_connection_map_[current_id];
+	// 焦点离开key就取消；取消是粘滞的，并行剖分时会从多个线程询问
+	Handle(CancellableProgress) makeFocusProgress(SnapshotKey key, std::atomic<bool>& cancelled)
+	{
+		return new CancellableProgress([key, &cancelled] {
+			if (!getCriticalSection().m_shape_cache.isFocus(key)) {
+				cancelled = true;
+			}
+			return cancelled.load();
+		});
+	}
 
-	auto next_draw_data = connection.getCurrentBrepData();
-	if(getCriticalSection().m_brep_data.value() != next_draw_data) {
-		getCriticalSection().m_brep_data.setValue(next_draw_data);
+	// 把缓存里的条目交给GUI线程，然后等它画完；条目为空表示解析失败
+	TaskList publishDrawSnapshot(MyServer* boss, SnapshotKey key, ShapeCache::EntryPtr entry)
+	{
+		getCriticalSection().m_brep_data.store(DrawSnapshot{ key, std::move(entry),
+			getCriticalSection().m_coalesced_frames.load(std::memory_order_relaxed) });
 		getCriticalSection().m_has_drawn = false;
-		emit m_boss_->sigDrawDataReady();
-		return {std::make_shared<WaitingDrawTask>(m_boss_)};
+		fire(boss->events().m_draw_data_ready);
+		return { makeTask<WaitingDrawTask>(boss) };
+	}
+
+	// 显示缓存里的条目，还只有粗糙网格时顺带开始算精细网格
+	TaskList publishEntry(MyServer* boss, SnapshotKey key, ShapeCache::EntryPtr entry)
+	{
+		TaskList next = publishDrawSnapshot(boss, key, entry);
+		if (!entry->m_refined && getCriticalSection().m_shape_cache.beginRefine(key)) {
+			next.push_back(makeTask<ShapeRefineTask>(boss, key, std::move(entry)));
+		}
+		return next;
+	}
+}
+
+TaskList BrepDataSetTask::run()
+{
+	// 先记下代数再看状态，看完之后状态又变了的话park会失败，不会漏掉通知
+	auto& notifier = getCriticalSection().m_draw_notifier;
+	uint64_t generation = notifier.generation();
+	auto idle = [&]() -> TaskList {
+		if (notifier.park(self(), generation)) {
+			return {};
+		}
+		return { self() };
+	};
+
+	// 显示流水线每一轮都要读当前连接，原子读句柄，不查表
+	auto connection = m_boss_->m_connections_.current();
+	if(!connection) {
+		return idle();
+	}
+	if(connection->m_id != m_connection_id_) {
+		m_connection_id_ = connection->m_id;
+		return { self() };
+	}
+
+	// 连接的历史只会追加，键没变就是同一个快照，不用比较负载
+	SnapshotKey next_key = connection->getCurrentKey();
+	SnapshotKey shown_key = getCriticalSection().m_brep_data.load()->m_key;
+	if(shown_key == next_key) {
+		return idle();
+	}
+	// 总是显示最新时这里就是只留最新的信箱：上次显示的和最新的之间的快照只记在历史里，不解析也不显示
+	if(getCriticalSection().m_mode_draw_new && shown_key.m_connection == next_key.m_connection
+		&& next_key.m_index > shown_key.m_index + 1) {
+		getCriticalSection().m_coalesced_frames.fetch_add(static_cast<uint64_t>(next_key.m_index - shown_key.m_index - 1), std::memory_order_relaxed);
+	}
+
+	auto& cache = getCriticalSection().m_shape_cache;
+	cache.setFocus(next_key);
+	if(!next_key.valid()) {
+		// 连接上还没有快照，没什么可画的
+		DrawSnapshot empty;
+		empty.m_key = next_key;
+		getCriticalSection().m_brep_data.store(std::move(empty));
+		return idle();
+	}
+	if(!getCriticalSection().m_mode_draw_new) {
+		m_boss_->prefetchAround(*connection, next_key);
+	}
+
+	// 缓存里有解析好的形状就直接显示，否则交给worker解析，GUI线程不做解析
+	if(auto cached = cache.find(next_key)) {
+		return publishEntry(m_boss_, next_key, std::move(cached));
+	}
+	return { makeTask<ShapeDecodeTask>(m_boss_, next_key, connection->getCurrentBrepData()) };
+}
+
+TaskList ShapeDecodeTask::run()
+{
+	std::atomic<bool> cancelled = false;
+	Handle(CancellableProgress) progress = makeFocusProgress(m_key_, cancelled);
+	auto start = std::chrono::steady_clock::now();
+	TopoDS_Shape shape = decodeBrepFrame(*m_frame_, progress->Start());
+
+	// 解析期间用户切到了别的快照，回去看现在要显示哪个
+	if (cancelled || !getCriticalSection().m_shape_cache.isFocus(m_key_)) {
+		return { makeTask<BrepDataSetTask>(m_boss_) };
+	}
+	// 数据损坏的快照交一个空形状过去，GUI线程直接跳过
+	if (shape.IsNull()) {
+		return publishDrawSnapshot(m_boss_, m_key_, nullptr);
+	}
+	SnapshotTiming timing;
+	timing.m_decode_ms = elapsedMs(start);
+	return { makeTask<ShapeMeshTask>(m_boss_, m_key_, std::move(shape), m_frame_->payload().size(), timing) };
+}
+
+TaskList ShapeMeshTask::run()
+{
+	auto& cache = getCriticalSection().m_shape_cache;
+	MeshSettings settings = getCriticalSection().m_mesh_settings.value();
+	// 分层级时先剖分粗糙网格尽快显示，精细网格交给ShapeRefineTask
+	MeshLevel level = settings.progressive() ? MeshLevel::Coarse : MeshLevel::Fine;
+	std::atomic<bool> cancelled = false;
+	Handle(CancellableProgress) progress = makeFocusProgress(m_key_, cancelled);
+	auto start = std::chrono::steady_clock::now();
+	if (!meshShape(m_shape_, settings, level, progress->Start()) || cancelled) {
+		return { makeTask<BrepDataSetTask>(m_boss_) };
+	}
+	double elapsed = elapsedMs(start);
+
+	ShapeCache::Entry entry;
+	entry.m_shape = m_shape_;
+	entry.m_coarse = m_shape_;
+	entry.m_parts = splitScene(m_shape_);
+	entry.m_refined = level == MeshLevel::Fine;
+	entry.m_cost = estimateShapeCost(m_shape_, m_payload_size_);
+	entry.m_timing = m_timing_;
+	if (entry.m_refined) {
+		entry.m_timing.m_mesh_ms = elapsed;
+	}
+	else {
+		entry.m_timing.m_coarse_mesh_ms = elapsed;
+	}
+	entry.m_timing.m_triangles = countTriangles(m_shape_);
+	auto cached = cache.insert(m_key_, std::move(entry));
+
+	// 剖分完用户已经切走了：结果留在缓存里，回去看现在要显示哪个
+	if (!cache.isFocus(m_key_)) {
+		return { makeTask<BrepDataSetTask>(m_boss_) };
 	}
-	else{
-		return {std::make_shared<BrepDataSetTask>(m_boss_)};
+	return publishEntry(m_boss_, m_key_, std::move(cached));
+}
+
+TaskList ShapeRefineTask::run()
+{
+	auto& cache = getCriticalSection().m_shape_cache;
+	SnapshotTiming timing = m_coarse_->m_timing;
+	if (!cache.isNearFocus(m_key_)) {
+		cache.endRefine(m_key_, TopoDS_Shape(), {}, 0, timing);
+		return {};
 	}
+	// 粗糙网格的形状GUI线程可能正在显示，精细网格放到一份拓扑副本上，部分列表也另拷一份
+	Handle(CancellableProgress) progress = new CancellableProgress([&cache, key = m_key_] { return !cache.isNearFocus(key); });
+	auto start = std::chrono::steady_clock::now();
+	TopoDS_Shape fine = copyTopology(m_coarse_->m_coarse);
+	std::vector<ScenePart> parts = m_coarse_->m_parts;
+	if (!meshShape(fine, getCriticalSection().m_mesh_settings.value(), MeshLevel::Fine, progress->Start())
+		|| !assignFineParts(parts, fine)) {
+		cache.endRefine(m_key_, TopoDS_Shape(), {}, 0, timing);
+		return {};
+	}
+	timing.m_mesh_ms = elapsedMs(start);
+	timing.m_triangles = countTriangles(fine);
+	size_t extra_cost = estimateShapeCost(fine, 0);
+	cache.endRefine(m_key_, std::move(fine), std::move(parts), extra_cost, timing);
+	fire(m_boss_->events().m_shape_refined);
+	return {};
 }
 
-std::vector<std::shared_ptr<Task>> WaitingDrawTask::run()
+TaskList WaitingDrawTask::run()
 {
+	// GUI线程画完后通过onSnapshotDrawn通知，在那之前停着
+	auto& notifier = getCriticalSection().m_draw_notifier;
+	uint64_t generation = notifier.generation();
 	if(getCriticalSection().m_has_drawn){
-		return {std::make_shared<BrepDataSetTask>(m_boss_)};
+		return {makeTask<BrepDataSetTask>(m_boss_)};
 	}
-	else{
-		std::this_thread::sleep_for(std::chrono::microseconds(100));
-		return {std::make_shared<WaitingDrawTask>(m_boss_)};
+	if(notifier.park(self(), generation)){
+		return {};
 	}
+	return { self() };
 }
 
-std::vector<std::shared_ptr<Task>> ConnectionCloseTask::run()
+TaskList ConnectionCloseTask::run()
 {
-	m_boss_->m_connection_map_.erase(m_connection_id_);
+	m_boss_->m_reactor_.unwatch(m_connection_id_);
+	m_boss_->removeConnection(m_connection_id_);
 	closesocket(m_connection_id_);
 	return {};
 }
 
+TaskList SessionLoadTask::run()
+{
+	auto connection = m_boss_->findConnection(m_connection_id_);
+	if (!connection) {
+		return {};
+	}
+	// 写文件时内容相同的快照共用一条记录，位置相同的就是同一个内容
+	auto& store = getCriticalSection().m_snapshot_store;
+	std::unordered_map<uint64_t, SnapshotRef> records;
+	connection->m_brep_data_list.reserve(m_entries_.size());
+	connection->m_receive_times.reserve(m_entries_.size());
+	for (auto& entry : m_entries_) {
+		auto& stored = records[entry.m_offset];
+		if (!stored) {
+			stored = store.adopt(m_file_, SessionLog::Record{ entry.m_offset, entry.m_size }, entry.m_digest);
+		}
+		connection->m_brep_data_list.push_back(stored);
+		connection->m_receive_times.push_back(entry.m_timestamp_us);
+	}
+	connection->setCurrentIndexToLatest();
+	if (m_make_current_) {
+		m_boss_->m_connections_.setCurrent(std::move(connection));
+		fire(m_boss_->events().m_connections_changed);
+	}
+	m_boss_->notifyDraw();
+	return {};
+}
+
+TaskList SessionSaveTask::run()
+{
+	auto connection = m_boss_->findConnection(m_connection_id_);
+	if (!connection) {
+		return {};
+	}
+	session_file::writer writer;
+	std::error_code ec;
+	bool ok = writer.create(m_path_, ec) && appendHistory(writer, *connection, ec) && writer.finish(ec);
+	fire(m_boss_->events().m_session_message, ok
+		? "Saved " + std::to_string(writer.count()) + " snapshots to " + m_path_
+		: "Failed to save " + m_path_ + ": " + ec.message());
+	return {};
+}
+
+TaskList SnapshotValidateTask::run()
+{
+	auto start = std::chrono::steady_clock::now();
+	auto frame = m_stored_->frame();
+	bool ok = !decodeBrepFrame(*frame).IsNull();
+	m_boss_->onValidated(ok, elapsedMs(start));
+	return {};
+}
+
+TaskList ShapePrefetchTask::run()
+{
+	auto& cache = getCriticalSection().m_shape_cache;
+	if (cache.isNearFocus(m_key_)) {
+		// 用户走远了就中途放弃；预取的快照不着急显示，两个层级都算好再放进缓存
+		Handle(CancellableProgress) progress = new CancellableProgress([&cache, key = m_key_] { return !cache.isNearFocus(key); });
+		MeshSettings settings = getCriticalSection().m_mesh_settings.value();
+		bool progressive = settings.progressive();
+		Message_ProgressScope scope(progress->Start(), NULL, progressive ? 3 : 2);
+		ShapeCache::Entry entry;
+		auto start = std::chrono::steady_clock::now();
+		TopoDS_Shape shape = decodeBrepFrame(*m_frame_, scope.Next());
+		entry.m_timing.m_decode_ms = elapsedMs(start);
+		bool meshed = !shape.IsNull();
+		entry.m_coarse = shape;
+		entry.m_shape = shape;
+		if (meshed && progressive) {
+			start = std::chrono::steady_clock::now();
+			meshed = meshShape(shape, settings, MeshLevel::Coarse, scope.Next());
+			entry.m_timing.m_coarse_mesh_ms = elapsedMs(start);
+			entry.m_shape = copyTopology(shape);
+		}
+		start = std::chrono::steady_clock::now();
+		if (meshed && meshShape(entry.m_shape, settings, MeshLevel::Fine, scope.Next())) {
+			entry.m_parts = splitScene(entry.m_coarse);
+			assignFineParts(entry.m_parts, entry.m_shape);
+			entry.m_timing.m_mesh_ms = elapsedMs(start);
+			entry.m_timing.m_triangles = countTriangles(entry.m_shape);
+			entry.m_refined = true;
+			entry.m_cost = estimateShapeCost(entry.m_shape, m_frame_->payload().size());
+			if (progressive) {
+				entry.m_cost += estimateShapeCost(entry.m_coarse, 0);
+			}
+			cache.insert(m_key_, std::move(entry));
+		}
+	}
+	cache.endPrefetch(m_key_);
+	return {};
+}
@@ -0,0 +1,34 @@
+﻿#include "server/SessionLog.h"
+
+#include <utility>
+
+SessionLog::SessionLog(std::string const& path)
+{
+	std::error_code ec;
+	m_file_ = std::make_shared<mapped_file>(mapped_file::create(path, ec, true));
+	if (ec) {
+		throw std::system_error(ec, "SessionLog " + path);
+	}
+}
+
+bool SessionLog::append(brep_frame const& frame, Record& record, std::error_code& ec)
+{
+	bytes_const_view payload = frame.payload();
+	// 先占好位置，写的时候不用加锁
+	uint64_t offset = m_end_.fetch_add(RECORD_HEADER_SIZE + payload.size(), std::memory_order_relaxed);
+
+	char head[RECORD_HEADER_SIZE];
+	session_file::encode_record_header(head, frame);
+	if (!m_file_->write_at(offset, bytes_const_view{ head, sizeof(head) }, ec)
+		|| !m_file_->write_at(offset + RECORD_HEADER_SIZE, payload, ec)) {
+		return false;
+	}
+	record.m_offset = offset;
+	record.m_size = payload.size();
+	return true;
+}
+
+brep_frame_ptr SessionLog::load(Record const& record, std::error_code& ec) const
+{
+	return session_file::load_record(*m_file_, record.m_offset, record.m_size, ec);
+}
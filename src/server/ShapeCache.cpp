@@ -0,0 +1,167 @@
+﻿#include "server/ShapeCache.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iterator>
+#include <utility>
+
+void ShapeCache::configure(size_t budget_bytes, int prefetch_radius)
+{
+	std::unique_lock lck(m_mtx);
+	m_budget = budget_bytes;
+	m_prefetch_radius = prefetch_radius;
+	evictLocked();
+}
+
+size_t ShapeCache::budget() const
+{
+	std::unique_lock lck(m_mtx);
+	return m_budget;
+}
+
+int ShapeCache::prefetchRadius() const
+{
+	std::unique_lock lck(m_mtx);
+	return m_prefetch_radius;
+}
+
+ShapeCache::EntryPtr ShapeCache::find(SnapshotKey key)
+{
+	std::unique_lock lck(m_mtx);
+	auto it = m_entries.find(key.m_content);
+	if (it == m_entries.end()) {
+		return nullptr;
+	}
+	touchLocked(it->second, key.m_connection);
+	return it->second.m_entry;
+}
+
+ShapeCache::EntryPtr ShapeCache::insert(SnapshotKey key, Entry entry)
+{
+	std::unique_lock lck(m_mtx);
+	auto it = m_entries.find(key.m_content);
+	if (it != m_entries.end()) {
+		// 当前快照的解析和预取可能同时解析了同一个快照(或者内容相同的两个快照)，留先到的那个
+		touchLocked(it->second, key.m_connection);
+		return it->second.m_entry;
+	}
+	auto shared = std::make_shared<const Entry>(std::move(entry));
+	m_lru.push_front(key.m_content);
+	m_usage += shared->m_cost;
+	m_entries.emplace(key.m_content, Slot{ shared, false, m_lru.begin(), { key.m_connection } });
+	evictLocked();
+	return shared;
+}
+
+bool ShapeCache::beginRefine(SnapshotKey key)
+{
+	std::unique_lock lck(m_mtx);
+	auto it = m_entries.find(key.m_content);
+	if (it == m_entries.end() || it->second.m_entry->m_refined || it->second.m_refining) {
+		return false;
+	}
+	it->second.m_refining = true;
+	return true;
+}
+
+void ShapeCache::endRefine(SnapshotKey key, TopoDS_Shape fine, std::vector<ScenePart> parts, size_t extra_cost, SnapshotTiming timing)
+{
+	std::unique_lock lck(m_mtx);
+	auto it = m_entries.find(key.m_content);
+	if (it == m_entries.end()) {
+		return;
+	}
+	it->second.m_refining = false;
+	if (fine.IsNull()) {
+		return;
+	}
+	// 正在显示的还是旧条目，换一个新的进去
+	Entry const& coarse = *it->second.m_entry;
+	it->second.m_entry = std::make_shared<const Entry>(Entry{ std::move(fine), coarse.m_coarse, true, std::move(parts),
+		coarse.m_cost + extra_cost, timing });
+	m_usage += extra_cost;
+	evictLocked();
+}
+
+void ShapeCache::dropConnection(uint64_t connection)
+{
+	std::unique_lock lck(m_mtx);
+	for (auto it = m_entries.begin(); it != m_entries.end();) {
+		auto next = std::next(it);
+		auto& users = it->second.m_connections;
+		users.erase(std::remove(users.begin(), users.end(), connection), users.end());
+		if (users.empty()) {
+			eraseLocked(it);
+		}
+		it = next;
+	}
+}
+
+bool ShapeCache::beginPrefetch(SnapshotKey key)
+{
+	std::unique_lock lck(m_mtx);
+	auto it = m_entries.find(key.m_content);
+	if (it != m_entries.end()) {
+		touchLocked(it->second, key.m_connection);
+		return false;
+	}
+	return m_pending.insert(key.m_content).second;
+}
+
+void ShapeCache::endPrefetch(SnapshotKey key)
+{
+	std::unique_lock lck(m_mtx);
+	m_pending.erase(key.m_content);
+}
+
+void ShapeCache::setFocus(SnapshotKey key)
+{
+	std::unique_lock lck(m_mtx);
+	m_focus = key;
+}
+
+bool ShapeCache::isFocus(SnapshotKey key) const
+{
+	std::unique_lock lck(m_mtx);
+	return key == m_focus;
+}
+
+bool ShapeCache::isNearFocus(SnapshotKey key) const
+{
+	std::unique_lock lck(m_mtx);
+	return key.m_connection == m_focus.m_connection && std::abs(key.m_index - m_focus.m_index) <= m_prefetch_radius;
+}
+
+size_t ShapeCache::usage() const
+{
+	std::unique_lock lck(m_mtx);
+	return m_usage;
+}
+
+void ShapeCache::touchLocked(Slot& slot, uint64_t connection)
+{
+	m_lru.splice(m_lru.begin(), m_lru, slot.m_lru);
+	if (std::find(slot.m_connections.begin(), slot.m_connections.end(), connection) == slot.m_connections.end()) {
+		slot.m_connections.push_back(connection);
+	}
+}
+
+void ShapeCache::eraseLocked(SlotMap::iterator it)
+{
+	m_usage -= it->second.m_entry->m_cost;
+	m_lru.erase(it->second.m_lru);
+	m_entries.erase(it);
+}
+
+void ShapeCache::evictLocked()
+{
+	// 最近使用的那个总是留着，哪怕它自己就超出了预算
+	while (m_usage > m_budget && m_lru.size() > 1) {
+		eraseLocked(m_entries.find(m_lru.back()));
+	}
+}
+
+size_t estimateShapeCost(TopoDS_Shape const& shape, size_t payload_size)
+{
+	return payload_size * 2 + estimateMeshBytes(shape) * 2;
+}
@@ -0,0 +1,66 @@
+﻿#include "server/ShapeMesher.h"
+
+#include <BRep_Tool.hxx>
+#include <BRepBuilderAPI_Copy.hxx>
+#include <BRepMesh_IncrementalMesh.hxx>
+#include <IMeshTools_Parameters.hxx>
+#include <Poly_Triangulation.hxx>
+#include <Prs3d_Drawer.hxx>
+#include <StdPrs_ToolTriangulatedShape.hxx>
+#include <TopExp_Explorer.hxx>
+#include <TopoDS.hxx>
+
+bool meshShape(TopoDS_Shape const& shape, MeshSettings const& settings, MeshLevel level, const Message_ProgressRange& progress)
+{
+	if (shape.IsNull()) {
+		return true;
+	}
+	bool coarse = level == MeshLevel::Coarse;
+	double coefficient = coarse ? settings.m_coarse_deviation_coefficient : settings.m_deviation_coefficient;
+	double angle = coarse ? settings.m_coarse_angle : settings.m_angle;
+
+	// 和AIS一样按包围盒尺寸换算出绝对的弦高误差
+	Handle(Prs3d_Drawer) drawer = new Prs3d_Drawer();
+	drawer->SetDeviationCoefficient(coefficient);
+	drawer->SetDeviationAngle(angle);
+
+	IMeshTools_Parameters parameters;
+	parameters.Deflection = StdPrs_ToolTriangulatedShape::GetDeflection(shape, drawer);
+	parameters.Angle = angle;
+	parameters.InParallel = settings.m_parallel;
+	BRepMesh_IncrementalMesh mesher(shape, parameters, progress);
+	return !progress.UserBreak();
+}
+
+TopoDS_Shape copyTopology(TopoDS_Shape const& shape)
+{
+	BRepBuilderAPI_Copy copier(shape, Standard_False, Standard_False);
+	return copier.Shape();
+}
+
+size_t countTriangles(TopoDS_Shape const& shape)
+{
+	size_t triangles = 0;
+	TopLoc_Location location;
+	for (TopExp_Explorer it(shape, TopAbs_FACE); it.More(); it.Next()) {
+		Handle(Poly_Triangulation) triangulation = BRep_Tool::Triangulation(TopoDS::Face(it.Current()), location);
+		if (!triangulation.IsNull()) {
+			triangles += static_cast<size_t>(triangulation->NbTriangles());
+		}
+	}
+	return triangles;
+}
+
+size_t estimateMeshBytes(TopoDS_Shape const& shape)
+{
+	size_t mesh_bytes = 0;
+	TopLoc_Location location;
+	for (TopExp_Explorer it(shape, TopAbs_FACE); it.More(); it.Next()) {
+		Handle(Poly_Triangulation) triangulation = BRep_Tool::Triangulation(TopoDS::Face(it.Current()), location);
+		if (!triangulation.IsNull()) {
+			mesh_bytes += static_cast<size_t>(triangulation->NbNodes()) * (sizeof(gp_Pnt) + 3 * sizeof(float))
+				+ static_cast<size_t>(triangulation->NbTriangles()) * sizeof(Poly_Triangle);
+		}
+	}
+	return mesh_bytes;
+}
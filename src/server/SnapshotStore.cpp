@@ -0,0 +1,210 @@
+﻿#include "server/SnapshotStore.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+brep_frame_ptr StoredFrame::frame() const
+{
+	std::unique_lock lck(m_mtx_);
+	if (m_resident_) {
+		return m_resident_;
+	}
+	if (auto mapped = m_mapped_.lock()) {
+		return mapped;
+	}
+	std::error_code ec;
+	auto mapped = m_log_->load(m_record_, ec);
+	if (!mapped) {
+		std::cerr << "Failed to map snapshot from session log: " << ec.message() << std::endl;
+		return std::make_shared<const brep_frame>();
+	}
+	m_mapped_ = mapped;
+	return mapped;
+}
+
+void SnapshotStore::configureSpill(std::shared_ptr<SessionLog> log, size_t ram_budget)
+{
+	std::unique_lock lck(m_spill_mtx_);
+	m_log_ = std::move(log);
+	m_ram_budget_ = ram_budget;
+}
+
+SnapshotRef SnapshotStore::intern(brep_frame&& frame, bool& added)
+{
+	added = false;
+	size_t size = frame.payload().size();
+	m_snapshots_.fetch_add(1, std::memory_order_relaxed);
+	m_bytes_.fetch_add(size, std::memory_order_relaxed);
+
+	std::shared_ptr<StoredFrame> stored;
+	{
+		// 哈希的各位都足够均匀，直接取模分片
+		Shard& shard = m_shards_[frame.m_digest % SHARD_COUNT];
+		// 每个重复的快照都要逐字节比较一遍，已经写进日志的还要映射回来，所以比较放在锁外；
+		// 解锁期间别的接收任务可能放进了内容相同的帧，重新加锁后只比较新出现的，都不相同才放进来
+		std::vector<std::shared_ptr<StoredFrame>> compared;
+		std::vector<std::shared_ptr<StoredFrame>> candidates;
+		std::unique_lock lck(shard.m_mtx);
+		while (true) {
+			auto range = shard.m_items.equal_range(frame.m_digest);
+			for (auto it = range.first; it != range.second;) {
+				auto existing = it->second.lock();
+				if (!existing) {
+					it = shard.m_items.erase(it);
+					continue;
+				}
+				if (existing->size() == size && std::find(compared.begin(), compared.end(), existing) == compared.end()) {
+					candidates.push_back(std::move(existing));
+				}
+				++it;
+			}
+			if (candidates.empty()) {
+				break;
+			}
+			lck.unlock();
+			for (auto& candidate : candidates) {
+				if (sameContent(*candidate->frame(), frame)) {
+					return candidate;
+				}
+				compared.push_back(std::move(candidate));
+			}
+			candidates.clear();
+			lck.lock();
+		}
+
+		uint64_t content = m_next_content_.fetch_add(1, std::memory_order_relaxed);
+		stored = std::make_shared<StoredFrame>(content, std::make_shared<const brep_frame>(std::move(frame)));
+		shard.m_items.emplace(stored->digest(), stored);
+		if (shard.m_items.size() >= shard.m_sweep_at) {
+			sweepLocked(shard);
+		}
+	}
+	added = true;
+	m_unique_.fetch_add(1, std::memory_order_relaxed);
+	m_unique_bytes_.fetch_add(size, std::memory_order_relaxed);
+
+	bool over_budget = false;
+	{
+		std::unique_lock lck(m_spill_mtx_);
+		if (m_log_) {
+			m_resident_.emplace_back(stored, size);
+			m_resident_bytes_ += size;
+			over_budget = m_resident_bytes_ > m_ram_budget_;
+		}
+	}
+	if (over_budget) {
+		spillOverBudget();
+	}
+	return stored;
+}
+
+SnapshotRef SnapshotStore::adopt(std::shared_ptr<const SessionLog> log, SessionLog::Record record, uint64_t digest)
+{
+	uint64_t content = m_next_content_.fetch_add(1, std::memory_order_relaxed);
+	auto stored = std::make_shared<StoredFrame>(content, digest, std::move(log), record);
+	Shard& shard = m_shards_[digest % SHARD_COUNT];
+	std::unique_lock lck(shard.m_mtx);
+	shard.m_items.emplace(digest, stored);
+	if (shard.m_items.size() >= shard.m_sweep_at) {
+		sweepLocked(shard);
+	}
+	return stored;
+}
+
+SnapshotStore::Stats SnapshotStore::stats() const
+{
+	Stats stats;
+	stats.m_snapshots = m_snapshots_.load(std::memory_order_relaxed);
+	stats.m_unique = m_unique_.load(std::memory_order_relaxed);
+	stats.m_bytes = m_bytes_.load(std::memory_order_relaxed);
+	stats.m_unique_bytes = m_unique_bytes_.load(std::memory_order_relaxed);
+	stats.m_spilled = m_spilled_.load(std::memory_order_relaxed);
+	stats.m_spilled_bytes = m_spilled_bytes_.load(std::memory_order_relaxed);
+	std::unique_lock lck(m_spill_mtx_);
+	stats.m_resident_bytes = m_resident_bytes_;
+	return stats;
+}
+
+bool SnapshotStore::sameContent(brep_frame const& a, brep_frame const& b) noexcept
+{
+	bytes_const_view x = a.payload();
+	bytes_const_view y = b.payload();
+	return a.m_encoding == b.m_encoding && x.size() == y.size()
+		&& (x.size() == 0 || std::memcmp(x.data(), y.data(), x.size()) == 0);
+}
+
+void SnapshotStore::sweepLocked(Shard& shard)
+{
+	for (auto it = shard.m_items.begin(); it != shard.m_items.end();) {
+		if (it->second.expired()) {
+			it = shard.m_items.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+	// 下次到现存条目数的两倍再清，均摊下来每次放入是常数时间
+	shard.m_sweep_at = std::max<size_t>(64, shard.m_items.size() * 2);
+}
+
+void SnapshotStore::spillOverBudget()
+{
+	// 先在锁里挑出要写出的，写文件时不拿锁；几个接收任务同时超出预算时各写各挑出的
+	std::vector<std::shared_ptr<StoredFrame>> victims;
+	std::shared_ptr<SessionLog> log;
+	{
+		std::unique_lock lck(m_spill_mtx_);
+		log = m_log_;
+		while (log && m_resident_bytes_ > m_ram_budget_ && !m_resident_.empty()) {
+			auto [weak, size] = std::move(m_resident_.front());
+			m_resident_.pop_front();
+			m_resident_bytes_ -= size;
+			// 已经没有快照引用它的，内存早就释放了
+			if (auto victim = weak.lock()) {
+				victims.push_back(std::move(victim));
+			}
+		}
+	}
+	for (auto& victim : victims) {
+		if (!spill(*victim, log)) {
+			// 磁盘满了之类的，之后都留在内存里，不再每次重试
+			std::unique_lock lck(m_spill_mtx_);
+			m_log_.reset();
+			m_resident_.clear();
+			m_resident_bytes_ = 0;
+			return;
+		}
+	}
+}
+
+bool SnapshotStore::spill(StoredFrame& stored, std::shared_ptr<SessionLog> const& log)
+{
+	brep_frame_ptr resident;
+	{
+		std::unique_lock lck(stored.m_mtx_);
+		resident = stored.m_resident_;
+	}
+	if (!resident) {
+		return true;
+	}
+	SessionLog::Record record;
+	std::error_code ec;
+	if (!log->append(*resident, record, ec)) {
+		std::cerr << "Failed to write snapshot to session log, keeping history in memory: " << ec.message() << std::endl;
+		return false;
+	}
+	{
+		std::unique_lock lck(stored.m_mtx_);
+		stored.m_log_ = log;
+		stored.m_record_ = record;
+		// 正在解析它的任务手里还有内存里的这份，用完之前frame()直接给它
+		stored.m_mapped_ = resident;
+		stored.m_resident_.reset();
+	}
+	m_spilled_.fetch_add(1, std::memory_order_relaxed);
+	m_spilled_bytes_.fetch_add(resident->payload().size(), std::memory_order_relaxed);
+	return true;
+}
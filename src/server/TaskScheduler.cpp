@@ -0,0 +1,229 @@
+﻿#include "server/TaskScheduler.h"
+
+#include <functional>
+
+namespace {
+	constexpr size_t NOT_A_WORKER = static_cast<size_t>(-1);
+	// 串行队列被取出来一次最多连着跑几步
+	constexpr size_t STRAND_BATCH = 16;
+
+	// 当前线程是哪个调度器的第几个worker，用来判断续作任务是不是由自己提交的
+	thread_local TaskScheduler const* t_scheduler = nullptr;
+	thread_local size_t t_worker_index = NOT_A_WORKER;
+}
+
+TaskScheduler::~TaskScheduler()
+{
+	stop();
+}
+
+void TaskScheduler::start(size_t worker_count)
+{
+	if (worker_count == 0) {
+		worker_count = 1;
+	}
+
+	m_stop_ = false;
+	m_workers_.clear();
+	m_strands_ = std::make_unique<Strand[]>(STRAND_COUNT);
+	for (size_t i = 0; i < worker_count; ++i) {
+		m_workers_.push_back(std::make_unique<Worker>());
+	}
+	// 先把所有worker都建好再起线程，偷取时会遍历整个m_workers_
+	for (size_t i = 0; i < worker_count; ++i) {
+		m_workers_[i]->m_thread = std::thread([this, i] { workerLoop(i); });
+	}
+}
+
+void TaskScheduler::stop()
+{
+	m_stop_ = true;
+	{
+		std::unique_lock lck(m_sleep_mtx_);
+		for (auto& worker : m_workers_) {
+			worker->m_cv.notify_all();
+		}
+	}
+	for (auto& worker : m_workers_) {
+		if (worker->m_thread.joinable()) {
+			worker->m_thread.join();
+		}
+	}
+	m_workers_.clear();
+	m_strands_.reset();
+}
+
+void TaskScheduler::submit(TaskPtr task)
+{
+	if (!task || m_workers_.empty()) {
+		return;
+	}
+	size_t from = (t_scheduler == this) ? t_worker_index : NOT_A_WORKER;
+	dispatch(std::move(task), from);
+}
+
+size_t TaskScheduler::strandOf(SOCKET key) const
+{
+	return std::hash<SOCKET>{}(key) % STRAND_COUNT;
+}
+
+void TaskScheduler::dispatch(TaskPtr task, size_t from)
+{
+	SOCKET key = task->affinity();
+	if (key != INVALID_SOCKET) {
+		size_t strand_index = strandOf(key);
+		auto& strand = m_strands_[strand_index];
+		bool schedule = false;
+		{
+			std::unique_lock lck(strand.m_mtx);
+			strand.m_tasks.push_back(std::move(task));
+			schedule = !std::exchange(strand.m_scheduled, true);
+		}
+		// 正在跑或者已经排上了的串行队列，跑完当前这一步会自己接着排
+		if (schedule) {
+			enqueueStrand(strand_index, strand_index % m_workers_.size(), from);
+		}
+		return;
+	}
+
+	size_t target = (from != NOT_A_WORKER) ? from : m_next_victim_.fetch_add(1) % m_workers_.size();
+	size_t backlog = 0;
+	{
+		std::unique_lock lck(m_workers_[target]->m_mtx);
+		m_workers_[target]->m_local.push_back(std::move(task));
+		backlog = m_workers_[target]->m_local.size() + m_workers_[target]->m_strands.size();
+	}
+	m_free_epoch_.fetch_add(1);
+
+	if (target != from) {
+		wakeWorker(target);
+	}
+	// 自己手上已经有活了，叫醒一个空闲的worker来偷
+	if (backlog > 1 || target != from) {
+		wakeAnyIdle(target);
+	}
+}
+
+void TaskScheduler::enqueueStrand(size_t strand, size_t target, size_t from)
+{
+	size_t backlog = 0;
+	{
+		std::unique_lock lck(m_workers_[target]->m_mtx);
+		m_workers_[target]->m_strands.push_back(strand);
+		backlog = m_workers_[target]->m_local.size() + m_workers_[target]->m_strands.size();
+	}
+	m_free_epoch_.fetch_add(1);
+
+	if (target != from) {
+		wakeWorker(target);
+	}
+	if (backlog > 1) {
+		wakeAnyIdle(target);
+	}
+}
+
+void TaskScheduler::runStrand(size_t strand_index, size_t index)
+{
+	auto& strand = m_strands_[strand_index];
+	// 一次最多连着跑STRAND_BATCH步，还有任务就排到自己队尾，让别的连接也轮得到；积压时别的worker会把它偷走
+	for (size_t step = 0; step <= STRAND_BATCH; ++step) {
+		TaskPtr task;
+		{
+			std::unique_lock lck(strand.m_mtx);
+			if (strand.m_tasks.empty()) {
+				strand.m_scheduled = false;
+				return;
+			}
+			if (step == STRAND_BATCH) {
+				break;
+			}
+			task = strand.m_tasks.pop_front();
+		}
+		for (auto& next : task->run()) {
+			dispatch(std::move(next), index);
+		}
+	}
+	enqueueStrand(strand_index, index, index);
+}
+
+void TaskScheduler::wakeWorker(size_t index)
+{
+	auto& worker = *m_workers_[index];
+	worker.m_signal.fetch_add(1);
+	std::unique_lock lck(m_sleep_mtx_);
+	if (worker.m_sleeping) {
+		worker.m_cv.notify_one();
+	}
+}
+
+void TaskScheduler::wakeAnyIdle(size_t except)
+{
+	std::unique_lock lck(m_sleep_mtx_);
+	for (size_t i = 0; i < m_workers_.size(); ++i) {
+		if (i != except && m_workers_[i]->m_sleeping) {
+			m_workers_[i]->m_cv.notify_one();
+			return;
+		}
+	}
+}
+
+TaskScheduler::Work TaskScheduler::findWork(size_t index)
+{
+	{
+		auto& own = *m_workers_[index];
+		std::unique_lock lck(own.m_mtx);
+		if (!own.m_strands.empty()) {
+			return { nullptr, own.m_strands.pop_front() };
+		}
+		if (!own.m_local.empty()) {
+			return { own.m_local.pop_back() };
+		}
+	}
+
+	// 主人从串行队列的队头、本地队列的队尾取，偷的时候反过来，错开
+	for (size_t offset = 1; offset < m_workers_.size(); ++offset) {
+		auto& victim = *m_workers_[(index + offset) % m_workers_.size()];
+		std::unique_lock lck(victim.m_mtx);
+		if (!victim.m_local.empty()) {
+			return { victim.m_local.pop_front() };
+		}
+		if (!victim.m_strands.empty()) {
+			return { nullptr, victim.m_strands.pop_back() };
+		}
+	}
+	return {};
+}
+
+void TaskScheduler::workerLoop(size_t index)
+{
+	t_scheduler = this;
+	t_worker_index = index;
+	auto& self = *m_workers_[index];
+
+	while (!m_stop_) {
+		uint64_t seen_signal = self.m_signal.load();
+		uint64_t seen_free = m_free_epoch_.load();
+
+		Work work = findWork(index);
+		if (work.m_strand != NO_STRAND) {
+			runStrand(work.m_strand, index);
+			continue;
+		}
+		if (work.m_task) {
+			for (auto& next : work.m_task->run()) {
+				dispatch(std::move(next), index);
+			}
+			continue;
+		}
+
+		std::unique_lock lck(m_sleep_mtx_);
+		self.m_sleeping = true;
+		self.m_cv.wait(lck, [&] {
+			return m_stop_ || self.m_signal.load() != seen_signal || m_free_epoch_.load() != seen_free;
+		});
+		self.m_sleeping = false;
+	}
+
+	t_scheduler = nullptr;
+	t_worker_index = NOT_A_WORKER;
+}
@@ -0,0 +1,249 @@
+﻿// 没有窗口的服务端：接收、去重、解析校验并保存快照，定期输出统计；构建服务器和CI上当抓取进程用，
+// 退出时把收到的快照存成会话文件，之后用有窗口的服务端打开浏览
+//
+// server_headless [--host 127.0.0.1] [--port 12345] [--unix path] [--shm name] [--workers N]
+//                 [--ram-budget MB] [--log path] [--save session.gdbs] [--stats stats.json]
+//                 [--interval 5] [--drain-timeout 60] [--no-validate]
+// Ctrl+C或者SIGTERM时停止接收，等收到的快照解析完(最多--drain-timeout秒)，写会话文件和最后一次统计后退出；
+// 有解析失败或者没来得及解析的快照、会话文件没写成时退出码不为0
+#include "server/Server.h"
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#if defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+	std::atomic<bool> g_stop = false;
+
+	void onSignal(int)
+	{
+		g_stop = true;
+	}
+
+	struct Options {
+		std::string m_host = "127.0.0.1";
+		std::string m_port = "12345";
+		std::string m_unix_path;
+		std::string m_shm_name;
+		size_t m_workers = std::thread::hardware_concurrency();
+		size_t m_ram_budget = SnapshotStore::DEFAULT_RAM_BUDGET;
+		std::string m_log_path;
+		std::string m_save_path;
+		std::string m_stats_path;
+		int m_interval_s = 5;
+		int m_drain_timeout_s = 60; // 退出时最多等这么久让收到的快照解析完
+		bool m_validate = true;
+	};
+
+	bool parseOptions(int argc, char* argv[], Options& options)
+	{
+		for (int i = 1; i < argc; ++i) {
+			std::string name = argv[i];
+			if (name == "--no-validate") {
+				options.m_validate = false;
+				continue;
+			}
+			if (i + 1 >= argc) {
+				std::cerr << "missing value for " << name << std::endl;
+				return false;
+			}
+			char const* value = argv[++i];
+			if (name == "--host") options.m_host = value;
+			else if (name == "--port") options.m_port = value;
+			else if (name == "--unix") options.m_unix_path = value;
+			else if (name == "--shm") options.m_shm_name = value;
+			else if (name == "--workers") options.m_workers = std::strtoull(value, nullptr, 10);
+			else if (name == "--ram-budget") options.m_ram_budget = std::strtoull(value, nullptr, 10) << 20;
+			else if (name == "--log") options.m_log_path = value;
+			else if (name == "--save") options.m_save_path = value;
+			else if (name == "--stats") options.m_stats_path = value;
+			else if (name == "--interval") options.m_interval_s = std::atoi(value);
+			else if (name == "--drain-timeout") options.m_drain_timeout_s = std::atoi(value);
+			else {
+				std::cerr << "unknown option " << name << std::endl;
+				return false;
+			}
+		}
+		if (options.m_workers == 0) {
+			options.m_workers = 1;
+		}
+		if (options.m_interval_s <= 0) {
+			options.m_interval_s = 5;
+		}
+		return true;
+	}
+
+	// 和有窗口的服务端一样把会话日志放在临时目录下
+	std::string defaultLogPath()
+	{
+#if defined(_WIN32)
+		char const* dir = std::getenv("TEMP");
+		std::string base = dir && *dir ? std::string(dir) + "\\" : std::string();
+#else
+		char const* dir = std::getenv("TMPDIR");
+		std::string base = (dir && *dir ? std::string(dir) : std::string("/tmp")) + "/";
+#endif
+		return base + "geomdebug-" + std::to_string(getpid()) + ".log";
+	}
+
+	std::string statsJson(MyServer::Stats const& stats, double uptime_s)
+	{
+		std::ostringstream os;
+		os << std::fixed << std::setprecision(3)
+			<< "{\n"
+			<< "  \"uptime_s\": " << uptime_s << ",\n"
+			<< "  \"connections\": " << stats.m_connections << ",\n"
+			<< "  \"connections_total\": " << stats.m_connections_total << ",\n"
+			<< "  \"snapshots\": " << stats.m_store.m_snapshots << ",\n"
+			<< "  \"unique\": " << stats.m_store.m_unique << ",\n"
+			<< "  \"bytes\": " << stats.m_store.m_bytes << ",\n"
+			<< "  \"unique_bytes\": " << stats.m_store.m_unique_bytes << ",\n"
+			<< "  \"resident_bytes\": " << stats.m_store.m_resident_bytes << ",\n"
+			<< "  \"spilled\": " << stats.m_store.m_spilled << ",\n"
+			<< "  \"spilled_bytes\": " << stats.m_store.m_spilled_bytes << ",\n"
+			<< "  \"validated\": " << stats.m_validated << ",\n"
+			<< "  \"invalid\": " << stats.m_invalid << ",\n"
+			<< "  \"validate_pending\": " << stats.m_validate_pending << ",\n"
+			<< "  \"decode_ms_avg\": " << (stats.m_validated ? stats.m_decode_ms_total / static_cast<double>(stats.m_validated) : 0.0) << ",\n"
+			<< "  \"decode_ms_max\": " << stats.m_decode_ms_max << "\n"
+			<< "}\n";
+		return os.str();
+	}
+
+	// 先写临时文件再改名，读统计的一方不会看到写了一半的文件
+	void writeStats(std::string const& path, std::string const& json)
+	{
+		std::string temp = path + ".tmp";
+		{
+			std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+			out << json;
+			if (!out) {
+				std::cerr << "failed to write " << temp << std::endl;
+				return;
+			}
+		}
+#if defined(_WIN32)
+		std::remove(path.c_str());
+#endif
+		if (std::rename(temp.c_str(), path.c_str()) != 0) {
+			std::cerr << "failed to replace " << path << std::endl;
+		}
+	}
+
+	void printStats(MyServer::Stats const& stats, MyServer::Stats const& last, double interval_s)
+	{
+		double mb = static_cast<double>(stats.m_store.m_bytes - last.m_store.m_bytes) / (1024.0 * 1024.0);
+		std::cout << std::fixed << std::setprecision(1)
+			<< "connections " << stats.m_connections
+			<< "  snapshots " << stats.m_store.m_snapshots << " (" << stats.m_store.m_unique << " unique)"
+			<< "  " << static_cast<double>(stats.m_store.m_snapshots - last.m_store.m_snapshots) / interval_s << " frames/s"
+			<< "  " << mb / interval_s << " MB/s"
+			<< "  spilled " << stats.m_store.m_spilled
+			<< "  invalid " << stats.m_invalid << "/" << stats.m_validated
+			<< std::endl;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!parseOptions(argc, argv, options)) {
+		return EXIT_FAILURE;
+	}
+
+	MyServer server;
+	try {
+		// CI上的客户端发完就退出，断开的连接的历史要留到退出时写进会话文件
+		server.withoutDisplay()
+			.withClosedHistory()
+			.withWorkerCount(options.m_workers)
+			.withSessionLog(options.m_log_path.empty() ? defaultLogPath() : options.m_log_path, options.m_ram_budget)
+			.withEvents(ServerEvents{ {}, {}, {}, [](std::string message) { std::cout << message << std::endl; } })
+			.withListenPort(options.m_host, options.m_port);
+		if (options.m_validate) {
+			server.withValidation();
+		}
+		if (!options.m_unix_path.empty()) {
+			server.withUnixSocket(options.m_unix_path);
+		}
+		if (!options.m_shm_name.empty()) {
+			server.withSharedMemory(options.m_shm_name);
+		}
+	}
+	catch (std::exception const& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::signal(SIGINT, onSignal);
+	std::signal(SIGTERM, onSignal);
+	server.run();
+	std::cout << "listening on " << options.m_host << ":" << options.m_port << std::endl;
+
+	auto begin = std::chrono::steady_clock::now();
+	auto next_report = begin + std::chrono::seconds(options.m_interval_s);
+	MyServer::Stats last;
+	while (!g_stop) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		auto now = std::chrono::steady_clock::now();
+		if (now < next_report) {
+			continue;
+		}
+		next_report += std::chrono::seconds(options.m_interval_s);
+		auto stats = server.stats();
+		printStats(stats, last, options.m_interval_s);
+		if (!options.m_stats_path.empty()) {
+			writeStats(options.m_stats_path, statsJson(stats, std::chrono::duration<double>(now - begin).count()));
+		}
+		last = stats;
+	}
+
+	// 先停止接收：已经到了的数据收完、接收任务都结束之后才返回，之后不会再有新快照；
+	// 再等收到的快照都解析完才停下worker、写会话文件。到期限还没收完或者没解析完的算失败，不能让CI把它们当成通过
+	auto drain_until = std::chrono::steady_clock::now() + std::chrono::seconds(options.m_drain_timeout_s);
+	server.stopReceiving(std::chrono::seconds(options.m_drain_timeout_s));
+	size_t partial = server.partialFrames();
+	while (server.stats().m_validate_pending > 0 && std::chrono::steady_clock::now() < drain_until) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	server.stop();
+	auto stats = server.stats();
+	if (!options.m_stats_path.empty()) {
+		writeStats(options.m_stats_path, statsJson(stats, std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count()));
+	}
+	int result = stats.m_invalid == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (stats.m_validate_pending > 0) {
+		std::cerr << stats.m_validate_pending << " snapshots were not validated within " << options.m_drain_timeout_s << "s" << std::endl;
+		result = EXIT_FAILURE;
+	}
+	if (partial > 0) {
+		std::cerr << partial << " frames were only partly received when receiving stopped" << std::endl;
+		result = EXIT_FAILURE;
+	}
+	if (!options.m_save_path.empty()) {
+		std::error_code ec;
+		if (server.saveSession(options.m_save_path, ec)) {
+			std::cout << "saved " << stats.m_store.m_snapshots << " snapshots to " << options.m_save_path << std::endl;
+		}
+		else {
+			std::cerr << "failed to save " << options.m_save_path << ": " << ec.message() << std::endl;
+			result = EXIT_FAILURE;
+		}
+	}
+	return result;
+}
@@ -11,6 +11,10 @@ int main(int argc, char* argv[])
 	MainWindow w;
 	w.resize(800, 600);
 	w.show();
+	// server session.gdbs 直接打开保存的会话
+	if (argc > 1) {
+		w.openSession(QString::fromLocal8Bit(argv[1]));
+	}
 
 	return a.exec();
 }